@@ -0,0 +1,255 @@
+// Benchmarks for mkjson. Each benchmark prints its name and the best wall
+// clock time, in milliseconds, out of a few runs. Run from a directory on a
+// local disk, since the benchmarks write their input files there.
+
+#define MKJSON_INLINE_IMPL
+#include "mkjson.hpp"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace mk::json;
+
+// runs is the number of times we run each benchmark.
+static constexpr int runs = 5;
+
+// measure returns the best time, in milliseconds, of @p runs calls of @p fn.
+template <typename Fn>
+static double measure(Fn fn) {
+  double best = 0.0;
+  for (int i = 0; i < runs; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    if (i == 0 || elapsed.count() < best) best = elapsed.count();
+  }
+  return best;
+}
+
+// report prints the result of the benchmark called @p name.
+static void report(const std::string &name, double ms) {
+  std::cout << name << ": " << ms << " ms" << std::endl;
+}
+
+// write_file writes @p data into the file at @p path.
+static bool write_file(const std::string &path, const std::string &data) {
+  std::FILE *filep = std::fopen(path.c_str(), "wb");
+  if (filep == nullptr) return false;
+  bool ok = std::fwrite(data.data(), 1, data.size(), filep) == data.size();
+  return std::fclose(filep) == 0 && ok;
+}
+
+// open_file opens the file at @p path for reading. Returns -1 on failure.
+static int open_file(const std::string &path) {
+#ifdef _WIN32
+  return _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+  return open(path.c_str(), O_RDONLY);
+#endif
+}
+
+// close_file closes @p fd.
+static void close_file(int fd) {
+#ifdef _WIN32
+  (void)_close(fd);
+#else
+  (void)close(fd);
+#endif
+}
+
+// set_no_io_uring sets or clears MKJSON_NO_IO_URING depending on @p set.
+static void set_no_io_uring(bool set) {
+#ifdef _WIN32
+  (void)_putenv_s("MKJSON_NO_IO_URING", set ? "1" : "");
+#else
+  if (set) {
+    (void)setenv("MKJSON_NO_IO_URING", "1", 1);
+  } else {
+    (void)unsetenv("MKJSON_NO_IO_URING");
+  }
+#endif
+}
+
+// drain reads all the chunks from @p reader and returns their total size.
+static uint64_t drain(ChunkReader &reader) {
+  uint64_t total = 0;
+  Chunk chunk;
+  while (reader.next(chunk)) total += chunk.size;
+  return total;
+}
+
+// count_lines reads all the lines from @p reader and returns their number.
+static int64_t count_lines(JSONLReader &reader) {
+  int64_t count = 0;
+  while (reader.read_next().good) count += 1;
+  return count;
+}
+
+// benchmark_jsonl_reader compares reading many JSONL files one after the
+// other with the plain reader, with io_uring, and with the pread fallback.
+// We measure both reading the bytes alone and parsing the lines, because
+// parsing usually dominates and hides the difference between readers.
+static bool benchmark_jsonl_reader() {
+  constexpr int64_t files = 64, lines = 20000;
+  std::vector<std::string> paths;
+  std::string data;
+  for (int64_t j = 0; j < lines; ++j) {
+    data += R"({"i": )" + std::to_string(j) + R"(, "padding": "xxxxxxxx"})" "\n";
+  }
+  for (int64_t i = 0; i < files; ++i) {
+    std::string path = "benchmark-jsonl-reader-" + std::to_string(i) + ".jsonl";
+    if (!write_file(path, data)) return false;
+    paths.push_back(std::move(path));
+  }
+  bool ok = true;
+  set_no_io_uring(false);
+  bool ring = FilesReader{paths}.uses_io_uring();
+  for (const char *mode : {"plain", "io_uring", "pread"}) {
+    std::string name = mode;
+    if (name == "io_uring" && !ring) continue;  // Same as pread
+    set_no_io_uring(name == "pread");
+    report("jsonl_reader/read/" + name, measure([&]() {
+             uint64_t total = 0;
+             if (name == "plain") {
+               for (const std::string &path : paths) {
+                 int fd = open_file(path);
+                 if (fd == -1) break;
+                 FdReader reader{fd};
+                 total += drain(reader);
+                 close_file(fd);
+               }
+             } else {
+               FilesReader reader{paths};
+               total = drain(reader);
+             }
+             ok = ok && total == (uint64_t)files * data.size();
+           }));
+    report("jsonl_reader/parse/" + name, measure([&]() {
+             int64_t count = 0;
+             if (name == "plain") {
+               for (const std::string &path : paths) {
+                 int fd = open_file(path);
+                 if (fd == -1) break;
+                 JSONLReader reader{fd};
+                 count += count_lines(reader);
+                 close_file(fd);
+               }
+             } else {
+               JSONLReader reader{paths};
+               count = count_lines(reader);
+             }
+             ok = ok && count == files * lines;
+           }));
+  }
+  set_no_io_uring(false);
+  for (const std::string &path : paths) {
+    (void)std::remove(path.c_str());
+  }
+  return ok;
+}
+
+// benchmark_packed_arrays compares parsing and dumping 1M-element arrays
+// of int64 and of float64 as packed arrays and as nlohmann nodes.
+static bool benchmark_packed_arrays() {
+  bool ok = true;
+  for (const char *type : {"int64", "float64"}) {
+    std::string name = type;
+    std::string text = "[";
+    for (int64_t i = 0; i < 1000000; ++i) {
+      if (i > 0) text += ",";
+      int64_t value = (i * 7919) % 2000003 - 1000001;
+      text += (name == "int64") ? std::to_string(value)
+                                : std::to_string((double)value / 64.0);
+    }
+    text += "]";
+    Result<JSON> packed;
+    Value nodes;
+    report("packed_arrays/parse/packed/" + name,
+           measure([&]() { packed = JSON::parse(text); }));
+    report("packed_arrays/parse/nodes/" + name,
+           measure([&]() { nodes = Value::parse(text); }));
+    std::string packed_dump, nodes_dump;
+    report("packed_arrays/dump/packed/" + name,
+           measure([&]() { packed_dump = packed.value.dump().value; }));
+    report("packed_arrays/dump/nodes/" + name,
+           measure([&]() { nodes_dump = nodes.dump(); }));
+    ok = ok && packed.good && packed_dump == nodes_dump;
+  }
+  return ok;
+}
+
+// benchmark_template compares emitting 100000 documents with 25 fields
+// using a Template and building each document with set_value_at and then
+// calling dump. Both variants append to the same reused output string.
+static bool benchmark_template() {
+  constexpr int64_t documents = 100000, fields = 25;
+  std::string skeleton = "{";
+  for (int64_t i = 0; i < fields; ++i) {
+    if (i > 0) skeleton += ",";
+    skeleton += R"("field)" + std::to_string(i) + R"(": "${f)" +
+                std::to_string(i) + R"(}")";
+  }
+  skeleton += "}";
+  Result<Template> tmpl = Template::compile(skeleton);
+  if (!tmpl.good) return false;
+  // The slots are sorted like the keys, so recover each field index from
+  // the slot name to write the same value as set_value_at does below.
+  std::vector<int64_t> order;
+  for (const std::string &slot : tmpl.value.slots()) {
+    order.push_back(std::stoll(slot.substr(1)));
+  }
+  bool ok = true;
+  std::string output, expected;
+  report("template/template", measure([&]() {
+           for (int64_t d = 0; d < documents; ++d) {
+             output.clear();
+             TemplateWriter writer{tmpl.value, output};
+             for (int64_t i : order) {
+               switch (i % 3) {
+                 case 0: writer.write_int64(d * fields + i); break;
+                 case 1: writer.write_float64((double)(d + i) / 8.0); break;
+                 default: writer.write_string("value"); break;
+               }
+             }
+             ok = writer.finish().good && ok;
+           }
+         }));
+  report("template/set_value_at", measure([&]() {
+           for (int64_t d = 0; d < documents; ++d) {
+             JSON json;
+             for (int64_t i = 0; i < fields; ++i) {
+               JSON value;
+               switch (i % 3) {
+                 case 0: value.set_value_int64(d * fields + i); break;
+                 case 1: value.set_value_float64((double)(d + i) / 8.0); break;
+                 default: value.set_value_string("value"); break;
+               }
+               ok = json.set_value_at("field" + std::to_string(i),
+                                      std::move(value)).good && ok;
+             }
+             Result<std::string> dumped = json.dump();
+             ok = dumped.good && ok;
+             expected = std::move(dumped.value);
+           }
+         }));
+  return ok && output == expected;
+}
+
+int main() {
+  bool ok = benchmark_jsonl_reader();
+  ok = benchmark_packed_arrays() && ok;
+  ok = benchmark_template() && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
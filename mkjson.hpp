@@ -4,12 +4,22 @@
 #ifndef MEASUREMENT_KIT_MKJSON_HPP
 #define MEASUREMENT_KIT_MKJSON_HPP
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if __cplusplus >= 201703L
+#include <optional>
+#endif
+
 namespace mk {
 namespace json {
 
@@ -25,6 +35,74 @@ class Result {
 
   /// value is the result of a successful operation.
   Type value = {};
+
+  /// and_then returns the Result returned by @p func, called with value, if
+  /// good, or a Result with the same failure, otherwise. Use it to chain
+  /// operations that may fail, e.g., lookups using View.
+  template <typename Func>
+  auto and_then(Func &&func) & -> decltype(func(std::declval<Type &>())) {
+    if (good) return func(value);
+    decltype(func(std::declval<Type &>())) result;
+    result.good = false;
+    result.failure = failure;
+    return result;
+  }
+
+  /// and_then is like and_then but moves value or failure.
+  template <typename Func>
+  auto and_then(Func &&func) && -> decltype(func(std::declval<Type &&>())) {
+    if (good) return func(std::move(value));
+    decltype(func(std::declval<Type &&>())) result;
+    result.good = false;
+    result.failure = std::move(failure);
+    return result;
+  }
+
+  /// transform is like and_then but @p func returns a value, rather than a
+  /// Result, thus it cannot fail. The value must not be void.
+  template <typename Func>
+  auto transform(Func &&func) & -> Result<
+      typename std::decay<decltype(func(std::declval<Type &>()))>::type> {
+    Result<typename std::decay<decltype(func(std::declval<Type &>()))>::type>
+        result;
+    if (good) {
+      result.value = func(value);
+    } else {
+      result.good = false;
+      result.failure = failure;
+    }
+    return result;
+  }
+
+  /// transform is like transform but moves value or failure.
+  template <typename Func>
+  auto transform(Func &&func) && -> Result<
+      typename std::decay<decltype(func(std::declval<Type &&>()))>::type> {
+    Result<typename std::decay<decltype(func(std::declval<Type &&>()))>::type>
+        result;
+    if (good) {
+      result.value = func(std::move(value));
+    } else {
+      result.good = false;
+      result.failure = std::move(failure);
+    }
+    return result;
+  }
+
+  /// or_else returns a copy of this Result, if good, or the Result returned
+  /// by @p func, called with failure, otherwise. Use it to recover.
+  template <typename Func>
+  Result or_else(Func &&func) const & {
+    if (good) return *this;
+    return func(failure);
+  }
+
+  /// or_else is like or_else but moves this Result or failure.
+  template <typename Func>
+  Result or_else(Func &&func) && {
+    if (good) return std::move(*this);
+    return func(std::move(failure));
+  }
 };
 
 // Result<void> is a template specialization for the void special case.
@@ -33,17 +111,312 @@ class Result<void> {
  public:
   bool good = true;
   std::string failure;
+
+  // and_then is like Result<Type>::and_then but @p func takes no arguments.
+  template <typename Func>
+  auto and_then(Func &&func) const -> decltype(func()) {
+    if (good) return func();
+    decltype(func()) result;
+    result.good = false;
+    result.failure = failure;
+    return result;
+  }
+
+  // transform is like Result<Type>::transform but @p func takes no arguments.
+  template <typename Func>
+  auto transform(Func &&func) const
+      -> Result<typename std::decay<decltype(func())>::type> {
+    Result<typename std::decay<decltype(func())>::type> result;
+    if (good) {
+      result.value = func();
+    } else {
+      result.good = false;
+      result.failure = failure;
+    }
+    return result;
+  }
+
+  // or_else is like Result<Type>::or_else.
+  template <typename Func>
+  Result or_else(Func &&func) const {
+    if (good) return *this;
+    return func(failure);
+  }
+};
+
+/// Compression is a compression format for the output.
+enum class Compression {
+  /// none means no compression.
+  none,
+
+  /// gzip means gzip. Requires MKJSON_HAVE_ZLIB.
+  gzip,
+
+  /// zstd means zstd. Requires MKJSON_HAVE_ZSTD.
+  zstd,
+};
+
+/// DuplicateKeys is the policy for duplicate keys inside a JSON object.
+enum class DuplicateKeys {
+  /// last_wins keeps the last value. This is what nlohmann/json does.
+  last_wins,
+
+  /// first_wins keeps the first value and ignores the others.
+  first_wins,
+
+  /// reject fails the parse.
+  reject,
+
+  /// collect replaces the value with an array containing all the values
+  /// for that key, in order. Keys that are not duplicate are unaffected.
+  collect,
+};
+
+/// SortOrder is the order used by JSON::sort_by.
+enum class SortOrder {
+  /// ascending sorts from the smallest to the largest value.
+  ascending,
+
+  /// descending sorts from the largest to the smallest value.
+  descending,
+};
+
+/// MemoryResource is the interface of memory resources. It is like
+/// std::pmr::memory_resource, which we cannot use since we target C++11,
+/// and allows choosing where a JSON allocates its nodes, e.g., from an arena
+/// scoped to a request. A resource must outlive the JSONs using it as well
+/// as any value moved out of such JSONs.
+class MemoryResource {
+ public:
+  /// allocate returns @p size bytes aligned to @p alignment, or throws.
+  virtual void *allocate(size_t size, size_t alignment) = 0;
+
+  /// deallocate releases memory returned by allocate.
+  virtual void deallocate(void *ptr, size_t size,
+                          size_t alignment) noexcept = 0;
+
+  /// ~MemoryResource destroys the resource.
+  virtual ~MemoryResource() noexcept;
+};
+
+/// AllocatorHooks is a table of functions through which we allocate the
+/// nodes and the JSON instances not allocated from a MemoryResource, e.g.,
+/// for directing them to a dedicated jemalloc or mimalloc arena. The nodes
+/// are the objects, including their map nodes, the arrays, including their
+/// elements, and the holders of strings. The characters of strings, the
+/// elements of packed arrays and the output of dump are std::string and
+/// std::vector exchanged with the caller by move, hence they always use
+/// operator new. The table must outlive the memory allocated through it,
+/// since we deallocate using the same table.
+class AllocatorHooks {
+ public:
+  /// allocate returns @p size bytes aligned to @p alignment, or nullptr.
+  void *(*allocate)(size_t size, size_t alignment, void *opaque) = nullptr;
+
+  /// deallocate releases memory returned by allocate.
+  void (*deallocate)(void *ptr, size_t size, size_t alignment,
+                     void *opaque) = nullptr;
+
+  /// opaque is passed to allocate and deallocate, e.g., the arena.
+  void *opaque = nullptr;
+};
+
+/// set_allocator_hooks sets the hooks used by threads that did not set
+/// their own hooks. Passing nullptr restores operator new and delete.
+void set_allocator_hooks(const AllocatorHooks *hooks) noexcept;
+
+/// set_thread_allocator_hooks sets the hooks used by the calling thread.
+/// Passing nullptr restores the hooks set with set_allocator_hooks.
+void set_thread_allocator_hooks(const AllocatorHooks *hooks) noexcept;
+
+/// BufferResource is a MemoryResource allocating sequentially from a
+/// caller-provided buffer and, when the buffer is full, from the heap.
+/// Deallocating buffer memory does nothing until there are no live buffer
+/// allocations, at which point the whole buffer becomes available again.
+/// A BufferResource must not be used by more than one thread at a time.
+class BufferResource : public MemoryResource {
+ public:
+  /// BufferResource allocates from the @p size bytes at @p buffer, which
+  /// must be aligned to 16 and outlive the resource.
+  BufferResource(void *buffer, size_t size) noexcept;
+
+  /// BufferResource is not copy constructible.
+  BufferResource(const BufferResource &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  BufferResource &operator=(const BufferResource &) = delete;
+
+  /// BufferResource is not move constructible.
+  BufferResource(BufferResource &&) = delete;
+
+  /// operator= is not allowed for move operations.
+  BufferResource &operator=(BufferResource &&) = delete;
+
+  /// allocate allocates from the buffer or, if full, from the heap.
+  void *allocate(size_t size, size_t alignment) override;
+
+  /// deallocate deallocates memory returned by allocate.
+  void deallocate(void *ptr, size_t size,
+                  size_t alignment) noexcept override;
+
+  /// spills returns how many allocations did not fit into the buffer, which
+  /// helps to choose the buffer size.
+  size_t spills() const noexcept;
+
+  /// ~BufferResource destroys the resource.
+  ~BufferResource() noexcept override;
+
+ private:
+  // base is the beginning of the buffer.
+  char *base = nullptr;
+
+  // capacity is the size of the buffer.
+  size_t capacity = 0;
+
+  // offset is where the next allocation may begin.
+  size_t offset = 0;
+
+  // live is the number of live allocations within the buffer.
+  size_t live = 0;
+
+  // spilled is the number of allocations that did not fit.
+  size_t spilled = 0;
+};
+
+/// SmallJSON is a BufferResource with an inline buffer of @p Size bytes,
+/// e.g., on the stack, for parsing small documents with JSON::parse without
+/// allocating their nodes on the heap. Parsing still allocates the scratch
+/// buffers of the nlohmann/json parser, as well as strings longer than the
+/// small string optimization.
+template <size_t Size>
+class SmallJSON : public BufferResource {
+ public:
+  /// SmallJSON constructs the resource.
+  SmallJSON() noexcept : BufferResource{storage, Size} {}
+
+ private:
+  // storage is the inline buffer.
+  alignas(16) char storage[Size];
+};
+
+/// ParseOptions contains the options for parsing.
+class ParseOptions {
+ public:
+  /// duplicate_keys is the policy for duplicate keys. The policy is
+  /// enforced while building each object, using the same lookup required
+  /// to insert a key, so it does not add any pass over the input.
+  DuplicateKeys duplicate_keys = DuplicateKeys::last_wins;
+
+  /// memory_resource is where the parsed JSON allocates its nodes, as well
+  /// as the nodes added to it later. The default, nullptr, means the heap.
+  MemoryResource *memory_resource = nullptr;
+};
+
+/// ParseError describes where parsing failed.
+class ParseError {
+ public:
+  /// npos indicates that the offset is not known.
+  static constexpr size_t npos = (size_t)-1;
+
+  /// offset is the offset in bytes of where parsing failed within the
+  /// input, i.e., the bad byte for syntax errors and the closing quote of
+  /// the key when rejecting a duplicate key, or npos if not known.
+  size_t offset = npos;
+
+  /// pointer is the JSON pointer (RFC 6901) of the value that was being
+  /// parsed when parsing failed, e.g. "/results/3/rtt".
+  std::string pointer;
+
+  /// context contains the input bytes around the offset, if known.
+  std::string context;
+
+  /// line returns the 1-based line of the offset in @p input, which must be
+  /// the input that failed to parse, or zero if the offset is not known.
+  /// It scans @p input, hence we compute it only when requested.
+  size_t line(const std::string &input) const noexcept;
+
+  /// column is like line but returns the 1-based column in bytes.
+  size_t column(const std::string &input) const noexcept;
 };
 
+// View is a forward declaration to View.
+class View;
+
 /// JSON is a JSON value.
+///
+/// Each thread caches the object, array and string nodes, and the JSON
+/// instances, released by destroying a JSON or by the get_value_xxx methods
+/// with move semantics, and parse and the setters reuse them. Hence, once
+/// warmed up, a loop that parses arrays or moves values in and out does not
+/// allocate nodes. Parsing still allocates the scratch buffers of the
+/// nlohmann/json lexer and a map node for each object member, because
+/// std::map cannot reuse its nodes, and returning a std::vector or a
+/// std::string allocates its storage unless it is moved in from the caller.
 class JSON {
  public:
-  /// parse parses @p json_str and returns the result.
+  /// JSON constructs a null JSON that will allocate from @p resource, where
+  /// nullptr means the heap, like the default constructor does.
+  explicit JSON(MemoryResource *resource) noexcept;
+
+  /// memory_resource returns the resource where the JSON allocates.
+  MemoryResource *memory_resource() const noexcept;
+
+  /// parse parses @p json_str and returns the result. A document that is
+  /// just an array of int64, or of float64, is parsed into a packed array
+  /// (see set_value_array_float64), while nested arrays are not packed.
   static Result<JSON> parse(const std::string &json_str) noexcept;
 
+  /// parse is like parse but uses @p options.
+  static Result<JSON> parse(const std::string &json_str,
+                            const ParseOptions &options) noexcept;
+
+  /// parse is like parse but allocates the nodes from @p buffer, e.g. a
+  /// SmallJSON, which must outlive the result. Once the result is gone, the
+  /// buffer can be reused for parsing another document. Nodes that do not
+  /// fit into the buffer, as well as strings longer than the small string
+  /// optimization, are allocated on the heap.
+  static Result<JSON> parse(const std::string &json_str,
+                            BufferResource &buffer) noexcept;
+
+  /// parse is like parse but, on failure, also fills @p error.
+  static Result<JSON> parse(const std::string &json_str,
+                            const ParseOptions &options,
+                            ParseError &error) noexcept;
+
+  /// parse_fd parses the JSON read from @p fd until end of file. Reading
+  /// happens in a background thread, using two buffers, such that the
+  /// parser consumes a buffer while the next one is being filled. The
+  /// @p fd is not closed. See also JSONLReader.
+  ///
+  /// gzip and zstd compressed input is detected and decompressed on the
+  /// fly, in chunks, when compiled with MKJSON_HAVE_ZLIB (link with -lz) or
+  /// MKJSON_HAVE_ZSTD (link with -lzstd), respectively.
+  static Result<JSON> parse_fd(int fd) noexcept;
+
+  /// parse_fd is like parse_fd but uses @p options.
+  static Result<JSON> parse_fd(int fd, const ParseOptions &options) noexcept;
+
   /// dump serializes the JSON and returns the result.
   Result<std::string> dump() const noexcept;
 
+  /// dump_fd serializes the JSON and writes it to @p fd, compressing it with
+  /// @p compression. Serialized bytes are written as they are produced, using
+  /// bounded buffers. On failure, part of the output may have been written.
+  /// The @p fd is not closed. See also JSONLWriter.
+  Result<void> dump_fd(int fd, Compression compression) const noexcept;
+
+  /// load_snapshot loads a JSON from the @p size bytes snapshot at @p data,
+  /// e.g. a memory mapped file. It validates the header and the checksum,
+  /// then decodes the payload allocating the nodes, like parse does. The
+  /// snapshot is not usable in place, so loading it still takes time
+  /// proportional to the size of the document.
+  static Result<JSON> load_snapshot(const void *data, size_t size) noexcept;
+
+  /// dump_snapshot serializes the JSON in a compact binary encoding, i.e.,
+  /// CBOR preceded by a header containing a version and a checksum, that
+  /// can be written to disk and loaded with load_snapshot.
+  Result<std::string> dump_snapshot() const noexcept;
+
   /// JSON creates a new null JSON.
   JSON() noexcept;
 
@@ -80,16 +453,49 @@ class JSON {
   /// is_string tells you whether the JSON is a string.
   bool is_string() const noexcept;
 
+  /// Key is an object key meant to be constructed once, e.g., as a static
+  /// constant, and then used for many lookups. Objects are ordered maps,
+  /// thus lookups compare keys rather than hashing them. What a Key saves
+  /// is constructing, hence measuring and copying, a temporary std::string
+  /// from a literal at every lookup.
+  class Key {
+   public:
+    /// Key constructs a key equal to @p key.
+    explicit Key(std::string key) noexcept;
+
+    /// str returns the key.
+    const std::string &str() const noexcept;
+
+   private:
+    // key is the key.
+    std::string key;
+  };
+
   /// get_value_at assumes that the JSON is an object and removes the value
   /// currently at @p key, returning it. This method has move semantics; after
   /// it has successfully returned, no value will be at @p key anymore.
   Result<JSON> get_value_at(const std::string &key) noexcept;
 
+  /// get_value_at is like get_value_at but takes a Key.
+  Result<JSON> get_value_at(const Key &key) noexcept;
+
   /// get_value_array assumes that the JSON is an array and returns such
   /// array. This method has move semantics; after it successfully returns,
   /// the JSON will become empty.
   Result<std::vector<JSON>> get_value_array() noexcept;
 
+  /// get_value_array_float64 is like get_value_array but returns the array
+  /// as a vector of float64 and fails, leaving the JSON untouched, unless all
+  /// the elements are float64. This is much faster than calling
+  /// get_value_float64 for each element returned by get_value_array.
+  Result<std::vector<double>> get_value_array_float64() noexcept;
+
+  /// get_value_array_int64 is like get_value_array_float64 but for int64.
+  Result<std::vector<int64_t>> get_value_array_int64() noexcept;
+
+  /// get_value_array_string is like get_value_array_float64 but for string.
+  Result<std::vector<std::string>> get_value_array_string() noexcept;
+
   /// get_value_boolean is like get_value_array but for boolean.
   Result<bool> get_value_boolean() noexcept;
 
@@ -99,25 +505,136 @@ class JSON {
   /// get_value_int64 is like get_value_array but for int64.
   Result<int64_t> get_value_int64() noexcept;
 
+  /// get_value_object assumes that the JSON is an object and returns its
+  /// members. This method has move semantics, like get_value_array.
+  Result<std::map<std::string, JSON>> get_value_object() noexcept;
+
   /// get_value_string is like get_value_array but for string.
   Result<std::string> get_value_string() noexcept;
 
+  /// view returns a View referring to the JSON, for reading nested values
+  /// without moving them out of the JSON. It fails only if the JSON is a
+  /// packed array and we cannot allocate memory to convert it into nodes.
+  Result<View> view() noexcept;
+
+  /// get_value returns the JSON converted to @p Type as described by
+  /// Traits<Type>, e.g., get_value<uint16_t> fails unless the JSON is an
+  /// int64 in the range of uint16_t. Like get_value_array, this method has
+  /// move semantics. When converting a container fails, the JSON is left
+  /// untouched, unless the Traits of its elements do not define check.
+  template <typename Type>
+  Result<Type> get_value() noexcept;
+
+  /// append_value_string is like get_value_string except that it appends
+  /// the string to @p buffer, thus reusing its capacity.
+  Result<void> append_value_string(std::string &buffer) noexcept;
+
   /// set_value_at is the dual operation of get_value_at.
   Result<void> set_value_at(const std::string &key, JSON &&value) noexcept;
 
+  /// set_value_at is like set_value_at but takes a Key.
+  Result<void> set_value_at(const Key &key, JSON &&value) noexcept;
+
   /// set_value_array unconditionally sets the JSON value to be @p value. The
   /// previous content of the JSON will be wiped.
   void set_value_array(std::vector<JSON> &&value) noexcept;
 
+  /// set_value_array_float64 is the dual operation of
+  /// get_value_array_float64. The elements are stored packed, i.e., in
+  /// a contiguous buffer rather than as one node each, which uses less
+  /// memory and makes dump, get_value_array_float64 and append_array
+  /// faster. Only the root value of a JSON can be packed, though, since
+  /// nodes cannot contain a packed array: set_value_at and set_value_array
+  /// convert a packed array into nodes, like any other method needing them,
+  /// e.g. get_value_array and view, does.
+  void set_value_array_float64(std::vector<double> &&value) noexcept;
+
+  /// set_value_array_int64 is like set_value_array_float64 but for int64.
+  void set_value_array_int64(std::vector<int64_t> &&value) noexcept;
+
+  /// set_value_array_string is the dual operation of get_value_array_string.
+  /// Like set_value_string, it base64 encodes invalid UTF-8 strings.
+  void set_value_array_string(std::vector<std::string> &&value) noexcept;
+
+  /// set_value_boolean is like set_value_array but for boolean.
+  void set_value_boolean(bool value) noexcept;
+
   /// set_value_float64 is like set_value_array but for float64.
   void set_value_float64(double value) noexcept;
 
   /// set_value_int64 is like set_value_array but for int64.
   void set_value_int64(int64_t value) noexcept;
 
+  /// set_value_object is like set_value_array but for objects.
+  void set_value_object(std::map<std::string, JSON> &&value) noexcept;
+
   /// set_value_string is like set_value_array but for strings.
   void set_value_string(std::string &&value) noexcept;
 
+  /// set_value is the dual operation of get_value. It fails when @p value
+  /// cannot be represented, e.g., an uint64_t larger than INT64_MAX, in which
+  /// case the JSON is left untouched.
+  template <typename Type>
+  Result<void> set_value(Type value) noexcept;
+
+  /// append_array assumes that both the JSON and @p other are arrays and
+  /// moves the elements of @p other to the end of the JSON, leaving @p other
+  /// null. When the JSON is empty, this swaps the containers; otherwise, it
+  /// moves the elements after reserving room for them. Packed arrays of the
+  /// same type stay packed. On failure, both are unchanged.
+  Result<void> append_array(JSON &&other) noexcept;
+
+  /// merge_object assumes that both the JSON and @p other are objects and
+  /// moves the members of @p other into the JSON, replacing the members
+  /// with the same key, leaving @p other null. We insert the members of
+  /// the smaller object into the larger one, swapping them if needed, thus
+  /// only moving the members of the smaller object. On failure, which may
+  /// only happen if we cannot allocate memory, members may have been moved.
+  Result<void> merge_object(JSON &&other) noexcept;
+
+  /// sort_by assumes that the JSON is an array and sorts it in place, in
+  /// @p order, by the value that the JSON pointer (RFC 6901) @p pointer
+  /// refers to within each element, e.g., "/test_keys/rtt", or by the
+  /// elements themselves, if @p pointer is empty. Numbers come before
+  /// strings, which are compared bytewise. Elements where @p pointer refers
+  /// to no value, or to any other value, come last. The sort is stable. We
+  /// read the keys once, without changing the elements, then sort the keys,
+  /// in parallel for large arrays, and finally move each element once. On
+  /// failure, e.g., with an invalid pointer, the JSON is unchanged.
+  Result<void> sort_by(const std::string &pointer, SortOrder order) noexcept;
+
+  /// partial_sort_top_k is like sort_by but only keeps the first @p k
+  /// elements. This is faster than sorting when @p k is small.
+  Result<void> partial_sort_top_k(const std::string &pointer, SortOrder order,
+                                  size_t k) noexcept;
+
+  /// filter assumes that the JSON is an array and removes, in place, the
+  /// elements for which @p predicate, called with the View of each element,
+  /// returns false, preserving the order of the others. If @p predicate
+  /// throws, filter fails and the JSON is unchanged.
+  Result<void> filter(
+      const std::function<bool(const View &)> &predicate) noexcept;
+
+  /// memory_usage returns the number of bytes owned by the JSON, including
+  /// the nodes, the strings, the containers and their unused capacity.
+  size_t memory_usage() const noexcept;
+
+  /// shrink_to_fit releases the unused capacity of the strings and of the
+  /// arrays contained by the JSON. It is a non-binding request.
+  void shrink_to_fit() noexcept;
+
+  /// compact relocates all the nodes of the JSON, in depth-first order and
+  /// with exactly sized containers, into a single buffer sized from
+  /// memory_usage, then releases the original nodes. Use this after building
+  /// a document with many set_value_xxx calls to improve the locality of
+  /// later reads and dumps. The buffer comes from memory_resource, or from
+  /// the heap, and is freed at once when its last node is destroyed, even
+  /// if nodes have been moved into other JSONs meanwhile. Strings longer
+  /// than the small string optimization stay on the heap, and nodes point
+  /// to each other, hence the buffer cannot be copied with memcpy. On
+  /// failure, the JSON is left unchanged.
+  Result<void> compact() noexcept;
+
   /// ~JSON destroys the allocated resources.
   ~JSON() noexcept;
 
@@ -138,200 +655,6370 @@ class JSON {
   std::unique_ptr<Impl> impl;
 };
 
-}  // namespace json
-}  // namespace mk
+namespace detail {
 
-// MKJSON_INLINE_IMPL allows to inline the implementation.
-#ifdef MKJSON_INLINE_IMPL
+// all_members calls @p check with the view of each member of the object
+// referred to by @p view, stopping at the first failure, which it returns.
+Result<void> all_members(
+    const View &view,
+    const std::function<Result<void>(const View &)> &check) noexcept;
 
-#include <exception>
-#include <type_traits>
-#include <utility>
+}  // namespace detail
 
-#include "json.hpp"
-#include "mkdata.hpp"
+/// View is a read-only reference to a value contained by a JSON, which is
+/// as cheap to copy as a pointer. Use JSON::view to obtain the View of a
+/// JSON, then at to descend, e.g., chaining lookups with Result::and_then,
+/// without materializing the intermediate values. A View is invalidated by
+/// any change to, or the destruction of, the JSON it refers to.
+class View {
+ public:
+  /// View constructs a view referring to a null value.
+  View() noexcept;
 
-namespace mk {
-namespace json {
+  /// at assumes that the view refers to an object and returns the view of
+  /// the member at @p key.
+  Result<View> at(const std::string &key) const noexcept;
 
-// JSON::Impl is the concrete implementation of JSON.
-class JSON::Impl {
- public:
-  // nlohmann_json is the underlying nlohmann/json instance.
-  nlohmann::json nlohmann_json;
+  /// at is like at but takes a JSON::Key.
+  Result<View> at(const JSON::Key &key) const noexcept;
 
-  // Impl constructs the implementation from an existing JSON.
-  explicit Impl(nlohmann::json &&value) noexcept;
+  /// at assumes that the view refers to an array and returns the view of
+  /// the element at @p index.
+  Result<View> at(size_t index) const noexcept;
 
-  // Impl constructs an empty implementation.
-  Impl() noexcept;
-};
+  /// size returns the number of elements of an array or of members of an
+  /// object, or zero for any other value.
+  size_t size() const noexcept;
 
-/*explicit*/ JSON::Impl::Impl(nlohmann::json &&value) noexcept {
-  std::swap(value, nlohmann_json);
-}
+  /// is_array is like JSON::is_array.
+  bool is_array() const noexcept;
 
-JSON::Impl::Impl() noexcept {}
+  /// is_boolean is like JSON::is_boolean.
+  bool is_boolean() const noexcept;
 
-// JSON::Friend is the definition of the class friend of JSON.
-class JSON::Friend {
- public:
-  // unwrap allows to unwrap a JSON to get the inner nlohmann::json.
-  static nlohmann::json &unwrap(JSON &json) noexcept;
-};
+  /// is_float64 is like JSON::is_float64.
+  bool is_float64() const noexcept;
 
-/*static*/ nlohmann::json &JSON::Friend::unwrap(JSON &json) noexcept {
-  return json.impl->nlohmann_json;
-}
+  /// is_int64 is like JSON::is_int64.
+  bool is_int64() const noexcept;
 
-/*explicit*/ JSON::JSON(Impl &&other_impl) noexcept : JSON{} {
-  std::swap(other_impl, *impl);
-}
+  /// is_null is like JSON::is_null.
+  bool is_null() const noexcept;
 
-/*static*/ Result<JSON> JSON::parse(const std::string &json_str) noexcept {
-  Result<JSON> result;
-  try {
-    result.value.impl->nlohmann_json = nlohmann::json::parse(json_str);
-  } catch (const std::exception &exc) {
-    result.good = false;
-    result.failure = exc.what();
-  }
-  return result;
-}
+  /// is_object is like JSON::is_object.
+  bool is_object() const noexcept;
 
-Result<std::string> JSON::dump() const noexcept {
-  Result<std::string> result;
-  try {
-    result.value = impl->nlohmann_json.dump();
-  } catch (const std::exception &exc) {
-    result.good = false;
-    result.failure = exc.what();
-  }
-  return result;
-}
+  /// is_string is like JSON::is_string.
+  bool is_string() const noexcept;
 
-JSON::JSON() noexcept { impl.reset(new JSON::Impl); }
+  /// get_value_boolean is like JSON::get_value_boolean but copies.
+  Result<bool> get_value_boolean() const noexcept;
 
-JSON::JSON(JSON &&other) noexcept : JSON{} {
-  std::swap(impl, other.impl);
-}
+  /// get_value_float64 is like JSON::get_value_float64 but copies.
+  Result<double> get_value_float64() const noexcept;
 
-JSON &JSON::operator=(JSON &&other) noexcept {
-  std::swap(impl, other.impl);
-  return *this;
-}
+  /// get_value_int64 is like JSON::get_value_int64 but copies.
+  Result<int64_t> get_value_int64() const noexcept;
 
-bool JSON::is_array() const noexcept {
-  return impl->nlohmann_json.is_array();
-}
+  /// get_value_string is like JSON::get_value_string but copies.
+  Result<std::string> get_value_string() const noexcept;
 
-bool JSON::is_boolean() const noexcept {
-  return impl->nlohmann_json.is_boolean();
-}
+  /// append_value_string is like get_value_string except that it appends
+  /// the string to @p buffer, thus reusing its capacity.
+  Result<void> append_value_string(std::string &buffer) const noexcept;
 
-bool JSON::is_float64() const noexcept {
-  return impl->nlohmann_json.is_number_float();
-}
+  /// dump serializes the value referred to by the view.
+  Result<std::string> dump() const noexcept;
 
-bool JSON::is_int64() const noexcept {
-  return impl->nlohmann_json.is_number_integer();
-}
+  // JSON is a friend of us.
+  friend class JSON;
 
-bool JSON::is_null() const noexcept {
-  return impl->nlohmann_json.is_null();
+  // Query is a friend of us.
+  friend class Query;
+
+  // detail::all_members is a friend of us.
+  friend Result<void> detail::all_members(
+      const View &view,
+      const std::function<Result<void>(const View &)> &check) noexcept;
+
+ private:
+  // node is the nlohmann/json node we refer to, or nullptr for null.
+  const void *node = nullptr;
+};
+
+/// Traits tells JSON::get_value and JSON::set_value how to convert between
+/// JSON and @p Type. We specialize it for bool, integers, floating point
+/// numbers, std::string, std::vector and std::map with string keys of
+/// supported types, JSON itself and, since C++17, std::optional, which is
+/// null when empty. Specialize it for your types by defining:
+///
+///     static Result<Type> get(JSON &json) noexcept;
+///     static Result<void> set(JSON &json, Type &&value) noexcept;
+///
+/// where get has move semantics and may leave @p json null on failure, and
+/// set leaves @p json untouched on failure. Optionally, also define:
+///
+///     static Result<void> check(const View &view) noexcept;
+///
+/// which fails exactly when get would fail, without changing anything. The
+/// containers call it for each element before moving any of them, so that
+/// a failed conversion leaves the JSON untouched. All the Traits we define
+/// do that. Without check, converting a container of Type may leave the
+/// JSON null on failure.
+template <typename Type, typename Enable = void>
+class Traits;
+
+namespace detail {
+
+// forward_failure copies the failure of @p from, if any, into @p to and
+// returns whether @p from is good.
+template <typename Type, typename Other>
+bool forward_failure(const Result<Other> &from, Result<Type> &to) noexcept {
+  if (from.good) return true;
+  to.good = false;
+  to.failure = from.failure;
+  return false;
 }
 
-bool JSON::is_object() const noexcept {
-  return impl->nlohmann_json.is_object();
+// HasCheck tells whether Traits<Type> defines check.
+template <typename Type, typename Enable = void>
+class HasCheck : public std::false_type {};
+
+template <typename Type>
+class HasCheck<Type, decltype((void)Traits<Type>::check(
+                         std::declval<const View &>()))>
+    : public std::true_type {};
+
+// check calls Traits<Type>::check, if defined, and otherwise succeeds.
+template <typename Type>
+typename std::enable_if<HasCheck<Type>::value, Result<void>>::type check(
+    const View &view) noexcept {
+  return Traits<Type>::check(view);
 }
 
-bool JSON::is_string() const noexcept {
-  return impl->nlohmann_json.is_string();
+template <typename Type>
+typename std::enable_if<!HasCheck<Type>::value, Result<void>>::type check(
+    const View &) noexcept {
+  return Result<void>{};
 }
 
-Result<JSON> JSON::get_value_at(const std::string &key) noexcept {
-  Result<JSON> result;
-  try {
-    result.value.impl->nlohmann_json = std::move(impl->nlohmann_json.at(key));
-    impl->nlohmann_json.erase(key);
-  } catch (const std::exception &exc) {
+// check_each fails with @p failure unless @p view is an array whose
+// elements are all of the type tested by @p is_type.
+inline Result<void> check_each(const View &view,
+                               bool (View::*is_type)() const,
+                               const char *failure) noexcept {
+  Result<void> result;
+  bool valid = view.is_array();
+  for (size_t i = 0; i < view.size() && valid; ++i) {
+    Result<View> entry = view.at(i);
+    valid = entry.good && (entry.value.*is_type)();
+  }
+  if (!valid) {
     result.good = false;
-    result.failure = exc.what();
+    result.failure = failure;
   }
   return result;
 }
 
-Result<std::vector<JSON>> JSON::get_value_array() noexcept {
-  Result<std::vector<JSON>> result;
-  auto valuep = impl->nlohmann_json.get_ptr<std::vector<nlohmann::json> *>();
-  if (valuep == nullptr) {
-    result.good = false;
-    result.failure = "Not an array";
+}  // namespace detail
+
+// Traits<JSON> is the identity.
+template <>
+class Traits<JSON> {
+ public:
+  static Result<JSON> get(JSON &json) noexcept {
+    Result<JSON> result;
+    std::swap(result.value, json);
     return result;
   }
-  for (nlohmann::json &entry : *valuep) {
-    result.value.push_back(JSON{JSON::Impl{std::move(entry)}});
+
+  static Result<void> check(const View &) noexcept { return Result<void>{}; }
+
+  static Result<void> set(JSON &json, JSON &&value) noexcept {
+    std::swap(json, value);
+    return Result<void>{};
   }
-  impl->nlohmann_json = nullptr;
-  return result;
-}
+};
 
-Result<bool> JSON::get_value_boolean() noexcept {
-  Result<bool> result;
-  auto valuep = impl->nlohmann_json.get_ptr<bool *>();
-  if (valuep == nullptr) {
-    result.good = false;
-    result.failure = "Not a boolean";
+// Traits<bool> maps boolean.
+template <>
+class Traits<bool> {
+ public:
+  static Result<bool> get(JSON &json) noexcept {
+    return json.get_value_boolean();
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    Result<void> result;
+    if (!view.is_boolean()) {
+      result.good = false;
+      result.failure = "Not a boolean";
+    }
     return result;
   }
-  result.value = *valuep;
-  impl->nlohmann_json = nullptr;
-  return result;
-}
 
-Result<double> JSON::get_value_float64() noexcept {
+  static Result<void> set(JSON &json, bool &&value) noexcept {
+    json.set_value_boolean(value);
+    return Result<void>{};
+  }
+};
+
+// Traits<Type> maps integers of any width to int64 and checks the range.
+template <typename Type>
+class Traits<Type, typename std::enable_if<std::is_integral<Type>::value &&
+                                           !std::is_same<Type, bool>::value>::type> {
+ public:
+  static Result<Type> get(JSON &json) noexcept {
+    Result<Type> result;
+    Result<int64_t> value = json.get_value_int64();
+    if (!detail::forward_failure(value, result)) return result;
+    if (!fits(value.value)) {
+      result.good = false;
+      result.failure = "Value out of range";
+      return result;
+    }
+    result.value = static_cast<Type>(value.value);
+    return result;
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    Result<void> result;
+    Result<int64_t> value = view.get_value_int64();
+    if (!detail::forward_failure(value, result)) return result;
+    if (!fits(value.value)) {
+      result.good = false;
+      result.failure = "Value out of range";
+    }
+    return result;
+  }
+
+  static Result<void> set(JSON &json, Type &&value) noexcept {
+    Result<void> result;
+    if (std::is_unsigned<Type>::value &&
+        static_cast<uint64_t>(value) > INT64_MAX) {
+      result.good = false;
+      result.failure = "Value out of range";
+      return result;
+    }
+    json.set_value_int64(static_cast<int64_t>(value));
+    return result;
+  }
+
+ private:
+  // fits tells whether @p value is in the range of Type.
+  static bool fits(int64_t value) noexcept {
+    if (std::is_unsigned<Type>::value) {
+      return value >= 0 && static_cast<uint64_t>(value) <=
+                               static_cast<uint64_t>(
+                                   std::numeric_limits<Type>::max());
+    }
+    return value >= static_cast<int64_t>(std::numeric_limits<Type>::min()) &&
+           value <= static_cast<int64_t>(std::numeric_limits<Type>::max());
+  }
+};
+
+// Traits<Type> maps floating point numbers to float64.
+template <typename Type>
+class Traits<Type, typename std::enable_if<
+                       std::is_floating_point<Type>::value>::type> {
+ public:
+  static Result<Type> get(JSON &json) noexcept {
+    Result<Type> result;
+    Result<double> value = json.get_value_float64();
+    if (detail::forward_failure(value, result)) {
+      result.value = static_cast<Type>(value.value);
+    }
+    return result;
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    Result<void> result;
+    if (!view.is_float64()) {
+      result.good = false;
+      result.failure = "Not a float64";
+    }
+    return result;
+  }
+
+  static Result<void> set(JSON &json, Type &&value) noexcept {
+    json.set_value_float64(static_cast<double>(value));
+    return Result<void>{};
+  }
+};
+
+// Traits<std::string> maps string.
+template <>
+class Traits<std::string> {
+ public:
+  static Result<std::string> get(JSON &json) noexcept {
+    return json.get_value_string();
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    Result<void> result;
+    if (!view.is_string()) {
+      result.good = false;
+      result.failure = "Not a string";
+    }
+    return result;
+  }
+
+  static Result<void> set(JSON &json, std::string &&value) noexcept {
+    json.set_value_string(std::move(value));
+    return Result<void>{};
+  }
+};
+
+// Traits<std::vector<Type>> maps arrays, converting each element. We check
+// all the elements before moving any, so on failure the JSON is untouched.
+template <typename Type>
+class Traits<std::vector<Type>> {
+ public:
+  static Result<std::vector<Type>> get(JSON &json) noexcept {
+    Result<std::vector<Type>> result;
+    Result<View> view = json.view();
+    if (!detail::forward_failure(view, result)) return result;
+    Result<void> valid = check(view.value);
+    if (!detail::forward_failure(valid, result)) return result;
+    Result<std::vector<JSON>> entries = json.get_value_array();
+    if (!detail::forward_failure(entries, result)) return result;
+    try {
+      result.value.reserve(entries.value.size());
+      for (JSON &entry : entries.value) {
+        Result<Type> value = Traits<Type>::get(entry);
+        if (!detail::forward_failure(value, result)) return result;
+        result.value.push_back(std::move(value.value));
+      }
+    } catch (const std::exception &exc) {
+      result.good = false;
+      result.failure = exc.what();
+    }
+    return result;
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    Result<void> result;
+    if (!view.is_array()) {
+      result.good = false;
+      result.failure = "Not an array";
+      return result;
+    }
+    for (size_t i = 0; i < view.size() && result.good; ++i) {
+      Result<View> entry = view.at(i);
+      if (detail::forward_failure(entry, result)) {
+        result = detail::check<Type>(entry.value);
+      }
+    }
+    return result;
+  }
+
+  static Result<void> set(JSON &json, std::vector<Type> &&value) noexcept {
+    Result<void> result;
+    try {
+      std::vector<JSON> entries;
+      entries.reserve(value.size());
+      for (auto &&entry : value) {  // Also works for std::vector<bool>
+        Type element(std::move(entry));
+        entries.push_back(JSON{json.memory_resource()});
+        result = Traits<Type>::set(entries.back(), std::move(element));
+        if (!result.good) return result;
+      }
+      json.set_value_array(std::move(entries));
+    } catch (const std::exception &exc) {
+      result.good = false;
+      result.failure = exc.what();
+    }
+    return result;
+  }
+};
+
+// Traits<std::vector<double>> uses the bulk accessors.
+template <>
+class Traits<std::vector<double>> {
+ public:
+  static Result<std::vector<double>> get(JSON &json) noexcept {
+    return json.get_value_array_float64();
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    return detail::check_each(view, &View::is_float64,
+                              "Not an array of float64");
+  }
+
+  static Result<void> set(JSON &json, std::vector<double> &&value) noexcept {
+    json.set_value_array_float64(std::move(value));
+    return Result<void>{};
+  }
+};
+
+// Traits<std::vector<int64_t>> uses the bulk accessors.
+template <>
+class Traits<std::vector<int64_t>> {
+ public:
+  static Result<std::vector<int64_t>> get(JSON &json) noexcept {
+    return json.get_value_array_int64();
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    return detail::check_each(view, &View::is_int64, "Not an array of int64");
+  }
+
+  static Result<void> set(JSON &json, std::vector<int64_t> &&value) noexcept {
+    json.set_value_array_int64(std::move(value));
+    return Result<void>{};
+  }
+};
+
+// Traits<std::vector<std::string>> uses the bulk accessors.
+template <>
+class Traits<std::vector<std::string>> {
+ public:
+  static Result<std::vector<std::string>> get(JSON &json) noexcept {
+    return json.get_value_array_string();
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    return detail::check_each(view, &View::is_string,
+                              "Not an array of string");
+  }
+
+  static Result<void> set(JSON &json,
+                          std::vector<std::string> &&value) noexcept {
+    json.set_value_array_string(std::move(value));
+    return Result<void>{};
+  }
+};
+
+// Traits<std::map<std::string, Type>> maps objects, converting each member.
+// We check all the members before moving any, so on failure the JSON is
+// untouched.
+template <typename Type>
+class Traits<std::map<std::string, Type>> {
+ public:
+  static Result<std::map<std::string, Type>> get(JSON &json) noexcept {
+    Result<std::map<std::string, Type>> result;
+    Result<View> view = json.view();
+    if (!detail::forward_failure(view, result)) return result;
+    Result<void> valid = check(view.value);
+    if (!detail::forward_failure(valid, result)) return result;
+    Result<std::map<std::string, JSON>> members = json.get_value_object();
+    if (!detail::forward_failure(members, result)) return result;
+    try {
+      for (auto &member : members.value) {
+        Result<Type> value = Traits<Type>::get(member.second);
+        if (!detail::forward_failure(value, result)) return result;
+        result.value.emplace(member.first, std::move(value.value));
+      }
+    } catch (const std::exception &exc) {
+      result.good = false;
+      result.failure = exc.what();
+    }
+    return result;
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    Result<void> result;
+    if (!view.is_object()) {
+      result.good = false;
+      result.failure = "Not an object";
+      return result;
+    }
+    return detail::all_members(view, [](const View &member) noexcept {
+      return detail::check<Type>(member);
+    });
+  }
+
+  static Result<void> set(JSON &json,
+                          std::map<std::string, Type> &&value) noexcept {
+    Result<void> result;
+    try {
+      std::map<std::string, JSON> members;
+      for (auto &member : value) {
+        JSON &entry = members.emplace(member.first,
+                                      JSON{json.memory_resource()})
+                          .first->second;
+        result = Traits<Type>::set(entry, std::move(member.second));
+        if (!result.good) return result;
+      }
+      json.set_value_object(std::move(members));
+    } catch (const std::exception &exc) {
+      result.good = false;
+      result.failure = exc.what();
+    }
+    return result;
+  }
+};
+
+#if __cplusplus >= 201703L
+// Traits<std::optional<Type>> maps null to an empty optional.
+template <typename Type>
+class Traits<std::optional<Type>> {
+ public:
+  static Result<std::optional<Type>> get(JSON &json) noexcept {
+    Result<std::optional<Type>> result;
+    if (json.is_null()) return result;
+    Result<Type> value = Traits<Type>::get(json);
+    if (detail::forward_failure(value, result)) {
+      result.value = std::move(value.value);
+    }
+    return result;
+  }
+
+  static Result<void> check(const View &view) noexcept {
+    if (view.is_null()) return Result<void>{};
+    return detail::check<Type>(view);
+  }
+
+  static Result<void> set(JSON &json, std::optional<Type> &&value) noexcept {
+    if (!value) {
+      json = JSON{json.memory_resource()};
+      return Result<void>{};
+    }
+    return Traits<Type>::set(json, std::move(*value));
+  }
+};
+#endif
+
+template <typename Type>
+Result<Type> JSON::get_value() noexcept {
+  return Traits<Type>::get(*this);
+}
+
+template <typename Type>
+Result<void> JSON::set_value(Type value) noexcept {
+  return Traits<Type>::set(*this, std::move(value));
+}
+
+/// JSONLReader reads newline delimited JSON documents from a file
+/// descriptor or from files. It reads in the same way as JSON::parse_fd,
+/// including decompressing compressed input.
+class JSONLReader {
+ public:
+  /// JSONLReader creates a reader for @p fd. The @p fd is not owned.
+  explicit JSONLReader(int fd) noexcept;
+
+  /// JSONLReader creates a reader for the files at @p paths, which are read
+  /// in order as if they were a single file, except that a missing newline
+  /// at the end of a file does not merge its last line with the next file.
+  /// Each file may be compressed with a different format, or not at all.
+  /// Many reads are kept in flight using io_uring on Linux, when the kernel
+  /// headers define it and the kernel supports it, unless compiled with
+  /// MKJSON_NO_IO_URING or run with the MKJSON_NO_IO_URING environment
+  /// variable set. Otherwise, the files are read using pread (or read on
+  /// Windows).
+  explicit JSONLReader(const std::vector<std::string> &paths) noexcept;
+
+  /// JSONLReader is like JSONLReader but parses using @p options.
+  JSONLReader(int fd, const ParseOptions &options) noexcept;
+
+  /// JSONLReader is like JSONLReader but parses using @p options.
+  JSONLReader(const std::vector<std::string> &paths,
+              const ParseOptions &options) noexcept;
+
+  /// JSONLReader is not copy constructible.
+  JSONLReader(const JSONLReader &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  JSONLReader &operator=(const JSONLReader &) = delete;
+
+  /// JSONLReader is not move constructible.
+  JSONLReader(JSONLReader &&) = delete;
+
+  /// operator= is not allowed for move operations.
+  JSONLReader &operator=(JSONLReader &&) = delete;
+
+  /// read_next reads and parses the next document, skipping empty lines.
+  /// A failure to parse a line does not prevent reading the next lines.
+  /// When there are no more documents, it fails and eof becomes true.
+  Result<JSON> read_next() noexcept;
+
+  /// read_next is like read_next but, when a line fails to parse, also
+  /// fills @p error. The offset is relative to the beginning of the line.
+  Result<JSON> read_next(ParseError &error) noexcept;
+
+  /// eof tells you whether we've read all the documents.
+  bool eof() const noexcept;
+
+  /// ~JSONLReader waits for a pending read, if any, and returns.
+  ~JSONLReader() noexcept;
+
+ private:
+  // Impl is a forward declaration to the internal implementation.
+  class Impl;
+
+  // impl is a unique pointer to the internal implementation.
+  std::unique_ptr<Impl> impl;
+};
+
+/// JSONLWriter writes newline delimited JSON documents to a file descriptor,
+/// optionally compressing them. It writes in the same way as JSON::dump_fd.
+class JSONLWriter {
+ public:
+  /// JSONLWriter creates a writer for @p fd, compressing the output with
+  /// @p compression. The @p fd is not owned.
+  JSONLWriter(int fd, Compression compression) noexcept;
+
+  /// JSONLWriter is not copy constructible.
+  JSONLWriter(const JSONLWriter &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  JSONLWriter &operator=(const JSONLWriter &) = delete;
+
+  /// JSONLWriter is not move constructible.
+  JSONLWriter(JSONLWriter &&) = delete;
+
+  /// operator= is not allowed for move operations.
+  JSONLWriter &operator=(JSONLWriter &&) = delete;
+
+  /// write serializes @p json followed by a newline. On failure, part of
+  /// the document may have been written, and the writer is not usable.
+  Result<void> write(const JSON &json) noexcept;
+
+  /// close writes the buffered data and terminates the compressed stream,
+  /// if any. The writer is not usable after close.
+  Result<void> close() noexcept;
+
+  /// ~JSONLWriter closes the writer, if not already closed.
+  ~JSONLWriter() noexcept;
+
+ private:
+  // Impl is a forward declaration to the internal implementation.
+  class Impl;
+
+  // impl is a unique pointer to the internal implementation.
+  std::unique_ptr<Impl> impl;
+};
+
+/// Template is a JSON skeleton compiled once, e.g. at startup, such that
+/// its fixed parts, i.e., keys, punctuation and constant values, are already
+/// serialized and emitting a document only serializes its variable values.
+/// In the skeleton, each variable value, called slot, is a string of the
+/// form "${name}". The output is the same that dump would produce for the
+/// document with the slots replaced by their values. See TemplateWriter.
+class Template {
+ public:
+  /// Template constructs an empty template, without slots, which emits
+  /// the null document.
+  Template() noexcept;
+
+  /// compile compiles @p skeleton and returns the template.
+  static Result<Template> compile(const std::string &skeleton) noexcept;
+
+  /// Template is not copy constructible.
+  Template(const Template &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  Template &operator=(const Template &) = delete;
+
+  /// Template is move constructible.
+  Template(Template &&) noexcept;
+
+  /// operator= is allowed for move operations.
+  Template &operator=(Template &&) noexcept;
+
+  /// slots returns the names of the slots in the order in which they are
+  /// emitted, which is the order in which TemplateWriter fills them. Since
+  /// keys are emitted in lexicographic order, this is generally not the
+  /// order in which slots appear in the skeleton.
+  const std::vector<std::string> &slots() const noexcept;
+
+  /// ~Template destroys the allocated resources.
+  ~Template() noexcept;
+
+  // TemplateWriter is a friend of us.
+  friend class TemplateWriter;
+
+ private:
+  // Impl is a forward declaration to the internal implementation.
+  class Impl;
+
+  // impl is a unique pointer to the internal implementation.
+  std::unique_ptr<Impl> impl;
+};
+
+/// TemplateWriter emits a document based on a Template by appending it to
+/// an output string, directly serializing each value after the fixed part
+/// preceding it. The values must be written in the order of Template::slots.
+/// Strings that are not valid UTF-8 are base64 encoded, like set_value_string
+/// does. Errors are reported by finish.
+class TemplateWriter {
+ public:
+  /// TemplateWriter creates a writer appending a document based on @p tmpl,
+  /// which must outlive the writer, to @p output.
+  TemplateWriter(const Template &tmpl, std::string &output) noexcept;
+
+  /// TemplateWriter is not copy constructible.
+  TemplateWriter(const TemplateWriter &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  TemplateWriter &operator=(const TemplateWriter &) = delete;
+
+  /// TemplateWriter is not move constructible.
+  TemplateWriter(TemplateWriter &&) = delete;
+
+  /// operator= is not allowed for move operations.
+  TemplateWriter &operator=(TemplateWriter &&) = delete;
+
+  /// write_boolean writes @p value into the next slot.
+  void write_boolean(bool value) noexcept;
+
+  /// write_float64 is like write_boolean but for float64.
+  void write_float64(double value) noexcept;
+
+  /// write_int64 is like write_boolean but for int64.
+  void write_int64(int64_t value) noexcept;
+
+  /// write_json is like write_boolean but for any JSON.
+  void write_json(const JSON &value) noexcept;
+
+  /// write_null writes null into the next slot.
+  void write_null() noexcept;
+
+  /// write_string is like write_boolean but for strings.
+  void write_string(const std::string &value) noexcept;
+
+  /// finish writes the fixed part following the last slot. It fails if
+  /// writing any value failed or if the number of values differs from the
+  /// number of slots, in which case the output is not valid.
+  Result<void> finish() noexcept;
+
+  /// ~TemplateWriter destroys the allocated resources.
+  ~TemplateWriter() noexcept;
+
+ private:
+  // Impl is a forward declaration to the internal implementation.
+  class Impl;
+
+  // impl is a unique pointer to the internal implementation.
+  std::unique_ptr<Impl> impl;
+};
+
+/// Query is a compiled query selecting values using a subset of JSONPath:
+///
+/// - `$` is the root and must come first;
+/// - `.name` and `['name']` select the member of an object;
+/// - `[n]` selects an element of an array, counting from the end if `n`
+///   is negative;
+/// - `.*` and `[*]` select all the members or elements;
+/// - `[start:end:step]` selects a slice of an array, where all the parts
+///   are optional, negative bounds count from the end and the step must be
+///   positive;
+/// - `[?(@.path <op> literal)]` selects the members or elements for which
+///   the comparison holds, where `@` is the member or element, `.path` is an
+///   optional list of `.name` or `['name']`, `<op>` is one of `==`, `!=`,
+///   `<`, `<=`, `>` and `>=`, and `literal` is a number, a quoted string,
+///   `true`, `false` or `null`. Values of different types are only unequal.
+///   Without `<op> literal`, the filter checks that `@.path` exists.
+///
+/// Recursive descent, unions and script expressions are not supported.
+class Query {
+ public:
+  /// Query constructs the `$` query, which selects the root.
+  Query() noexcept;
+
+  /// compile compiles @p path and returns the query.
+  static Result<Query> compile(const std::string &path) noexcept;
+
+  /// Query is not copy constructible.
+  Query(const Query &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  Query &operator=(const Query &) = delete;
+
+  /// Query is move constructible.
+  Query(Query &&) noexcept;
+
+  /// operator= is allowed for move operations.
+  Query &operator=(Query &&) noexcept;
+
+  /// select evaluates the query over the value referred to by @p root and
+  /// returns the views of the matching values, without copying them. The
+  /// members of an object are visited in key order.
+  Result<std::vector<View>> select(const View &root) const noexcept;
+
+  /// stream parses @p input and calls @p on_match with each matching value
+  /// in document order, building only the matching values, and the members
+  /// or elements being filtered, rather than the whole document. Return
+  /// false from @p on_match to stop parsing early, which is not an error.
+  /// A query with negative indexes or bounds cannot be streamed, because we
+  /// don't know the length of an array before its end.
+  Result<void> stream(const std::string &input,
+                      const std::function<bool(JSON &&match)> &on_match)
+      const noexcept;
+
+  /// stream_fd is like stream except that it reads @p fd like
+  /// JSON::parse_fd does, without ever holding the whole input in memory.
+  Result<void> stream_fd(int fd,
+                         const std::function<bool(JSON &&match)> &on_match)
+      const noexcept;
+
+  /// ~Query destroys the allocated resources.
+  ~Query() noexcept;
+
+ private:
+  // Impl is a forward declaration to the internal implementation.
+  class Impl;
+
+  // impl is a unique pointer to the internal implementation.
+  std::unique_ptr<Impl> impl;
+};
+
+/// Store is an append-only on-disk store of JSON documents keyed by a string
+/// such as a measurement ID. Documents are stored as snapshots (see
+/// JSON::dump_snapshot) inside a single file. The index is kept in memory and
+/// rebuilt when opening the file, by reading only the records headers.
+class Store {
+ public:
+  /// Store creates a closed store.
+  Store() noexcept;
+
+  /// Store is not copy constructible.
+  Store(const Store &) = delete;
+
+  /// operator= is not allowed for copy operations.
+  Store &operator=(const Store &) = delete;
+
+  /// Store is not move constructible.
+  Store(Store &&) = delete;
+
+  /// operator= is not allowed for move operations.
+  Store &operator=(Store &&) = delete;
+
+  /// open opens the store at @p path, creating it if needed. A truncated
+  /// record at the end of the file, e.g. caused by a crash while writing,
+  /// is discarded.
+  Result<void> open(const std::string &path) noexcept;
+
+  /// put snapshots @p value and queues it for being stored under @p key,
+  /// replacing any previous document with the same @p key. Queued documents
+  /// are visible to get but only written when you call flush.
+  Result<void> put(const std::string &key, const JSON &value) noexcept;
+
+  /// flush appends all the queued documents to the file at once.
+  Result<void> flush() noexcept;
+
+  /// contains tells you whether there is a document stored under @p key.
+  bool contains(const std::string &key) const noexcept;
+
+  /// get loads the document stored under @p key. On systems supporting it,
+  /// the document is loaded directly from the memory mapped file.
+  Result<JSON> get(const std::string &key) noexcept;
+
+  /// size returns the number of distinct keys in the store.
+  size_t size() const noexcept;
+
+  /// ~Store flushes the queued documents and closes the store.
+  ~Store() noexcept;
+
+ private:
+  // Impl is a forward declaration to the internal implementation.
+  class Impl;
+
+  // impl is a unique pointer to the internal implementation.
+  std::unique_ptr<Impl> impl;
+};
+
+}  // namespace json
+}  // namespace mk
+
+// MKJSON_INLINE_IMPL allows to inline the implementation.
+#ifdef MKJSON_INLINE_IMPL
+
+#include <limits.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef MKJSON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef MKJSON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// We use io_uring when the Linux headers define it, unless you define
+// MKJSON_NO_IO_URING. Detecting it here, rather than in the build system,
+// means that the library and its users always agree. We only use system
+// calls, hence there is no library to link with. Setting the environment
+// variable MKJSON_NO_IO_URING disables io_uring at run time, e.g. where a
+// seccomp policy makes it misbehave, and lets tests cover the fallback.
+#if !defined(MKJSON_HAVE_IO_URING) && !defined(MKJSON_NO_IO_URING) && \
+    defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MKJSON_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef MKJSON_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <istream>
+#include <ostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+
+#include "json.hpp"
+#include "mkdata.hpp"
+
+namespace mk {
+namespace json {
+
+MemoryResource::~MemoryResource() noexcept {}
+
+BufferResource::BufferResource(void *buffer, size_t size) noexcept
+    : base{static_cast<char *>(buffer)}, capacity{size} {}
+
+void *BufferResource::allocate(size_t size, size_t alignment) {
+  // The buffer is aligned to 16 and alignment is a power of two.
+  size_t begin = (alignment > 0) ? (offset + alignment - 1) & ~(alignment - 1)
+                                 : offset;
+  if (begin < offset || begin > capacity || size > capacity - begin) {
+    spilled += 1;
+    return ::operator new(size);
+  }
+  offset = begin + size;
+  live += 1;
+  return base + begin;
+}
+
+void BufferResource::deallocate(void *ptr, size_t, size_t) noexcept {
+  char *p = static_cast<char *>(ptr);
+  if (p < base || p >= base + capacity) {
+    ::operator delete(ptr);
+    return;
+  }
+  if (--live == 0) offset = 0;
+}
+
+size_t BufferResource::spills() const noexcept { return spilled; }
+
+BufferResource::~BufferResource() noexcept {}
+
+// MemoryScope selects the MemoryResource used by Allocator in the current
+// thread for its lifetime. Scopes may be nested.
+class MemoryScope {
+ public:
+  // MemoryScope selects @p resource, where nullptr means the heap.
+  explicit MemoryScope(MemoryResource *resource) noexcept;
+
+  // MemoryScope is not copy constructible.
+  MemoryScope(const MemoryScope &) = delete;
+
+  // operator= is not allowed for copy operations.
+  MemoryScope &operator=(const MemoryScope &) = delete;
+
+  // MemoryScope is not move constructible.
+  MemoryScope(MemoryScope &&) = delete;
+
+  // operator= is not allowed for move operations.
+  MemoryScope &operator=(MemoryScope &&) = delete;
+
+  // current returns the selected resource.
+  static MemoryResource *current() noexcept;
+
+  // ~MemoryScope selects again the previous resource.
+  ~MemoryScope() noexcept;
+
+ private:
+  // selected returns the selected resource of this thread.
+  static MemoryResource *&selected() noexcept;
+
+  // previous is the previously selected resource.
+  MemoryResource *previous = nullptr;
+};
+
+/*explicit*/ MemoryScope::MemoryScope(MemoryResource *resource) noexcept
+    : previous{selected()} {
+  selected() = resource;
+}
+
+/*static*/ MemoryResource *MemoryScope::current() noexcept {
+  return selected();
+}
+
+MemoryScope::~MemoryScope() noexcept { selected() = previous; }
+
+/*static*/ MemoryResource *&MemoryScope::selected() noexcept {
+  static thread_local MemoryResource *resource = nullptr;
+  return resource;
+}
+
+// global_hooks returns the hooks set with set_allocator_hooks.
+static std::atomic<const AllocatorHooks *> &global_hooks() noexcept {
+  static std::atomic<const AllocatorHooks *> hooks{nullptr};
+  return hooks;
+}
+
+// thread_hooks returns the hooks set with set_thread_allocator_hooks.
+static const AllocatorHooks *&thread_hooks() noexcept {
+  static thread_local const AllocatorHooks *hooks = nullptr;
+  return hooks;
+}
+
+void set_allocator_hooks(const AllocatorHooks *hooks) noexcept {
+  global_hooks().store(hooks);
+}
+
+void set_thread_allocator_hooks(const AllocatorHooks *hooks) noexcept {
+  thread_hooks() = hooks;
+}
+
+// AllocatorBase contains the code of Allocator not depending on the type.
+class AllocatorBase {
+ public:
+  // header_size is the size of the header preceding each allocation, which
+  // records the resource or the hooks that own the allocation, so that
+  // deallocation does not depend on those selected when deallocating. It
+  // is also the alignment of the allocations, which suffices for all the
+  // types that nlohmann/json allocates.
+  static constexpr size_t header_size = 8;
+
+  // allocate allocates @p size bytes, preceded by the header, from the
+  // currently selected resource.
+  static void *allocate(size_t size);
+
+  // allocate allocates @p size bytes, preceded by the header, from
+  // @p resource or, if nullptr, using the current hooks.
+  static void *allocate(MemoryResource *resource, size_t size);
+
+  // deallocate deallocates @p ptr, returned by allocate with @p size.
+  static void deallocate(void *ptr, size_t size) noexcept;
+
+  // hooks returns the hooks of the calling thread, or nullptr.
+  static const AllocatorHooks *hooks() noexcept;
+
+  // poolable returns true if @p ptr, which must have been returned by
+  // allocate, is heap memory obtained with the current hooks, hence the
+  // calling thread can cache and reuse it.
+  static bool poolable(const void *ptr) noexcept;
+
+ private:
+  // hooks_tag is set in the header when it points to hooks rather than
+  // to a resource. Both are aligned, hence the lowest bit is free.
+  static constexpr uintptr_t hooks_tag = 1;
+
+  // Header is the content of the header.
+  class Header {
+   public:
+    // resource is the resource that allocated the memory, if any.
+    MemoryResource *resource = nullptr;
+
+    // hooks are the hooks that allocated the memory, if any.
+    const AllocatorHooks *hooks = nullptr;
+  };
+
+  // header returns the header of @p ptr, returned by allocate.
+  static Header header(const void *ptr) noexcept;
+};
+
+/*static*/ constexpr size_t AllocatorBase::header_size;
+/*static*/ constexpr uintptr_t AllocatorBase::hooks_tag;
+
+/*static*/ void *AllocatorBase::allocate(size_t size) {
+  return allocate(MemoryScope::current(), size);
+}
+
+/*static*/ void *AllocatorBase::allocate(MemoryResource *resource,
+                                        size_t size) {
+  static_assert(sizeof(uintptr_t) <= header_size, "header too small");
+  static_assert(alignof(MemoryResource) > hooks_tag &&
+                    alignof(AllocatorHooks) > hooks_tag,
+                "cannot tag the header");
+  if (size > SIZE_MAX - header_size) throw std::bad_alloc{};
+  uintptr_t owner = 0;
+  void *base = nullptr;
+  const AllocatorHooks *h = nullptr;
+  if (resource != nullptr) {
+    owner = (uintptr_t)resource;
+    base = resource->allocate(size + header_size, header_size);
+  } else if ((h = hooks()) != nullptr) {
+    owner = (uintptr_t)h | hooks_tag;
+    base = h->allocate(size + header_size, header_size, h->opaque);
+    if (base == nullptr) throw std::bad_alloc{};
+  } else {
+    base = ::operator new(size + header_size);
+  }
+  memcpy(base, &owner, sizeof(owner));
+  return (char *)base + header_size;
+}
+
+/*static*/ void AllocatorBase::deallocate(void *ptr, size_t size) noexcept {
+  void *base = (char *)ptr - header_size;
+  Header h = header(ptr);
+  if (h.resource != nullptr) {
+    h.resource->deallocate(base, size + header_size, header_size);
+  } else if (h.hooks != nullptr) {
+    h.hooks->deallocate(base, size + header_size, header_size, h.hooks->opaque);
+  } else {
+    ::operator delete(base);
+  }
+}
+
+/*static*/ const AllocatorHooks *AllocatorBase::hooks() noexcept {
+  const AllocatorHooks *h = thread_hooks();
+  return (h != nullptr) ? h : global_hooks().load();
+}
+
+/*static*/ bool AllocatorBase::poolable(const void *ptr) noexcept {
+  Header h = header(ptr);
+  return h.resource == nullptr && h.hooks == hooks();
+}
+
+/*static*/ AllocatorBase::Header AllocatorBase::header(
+    const void *ptr) noexcept {
+  uintptr_t owner = 0;
+  memcpy(&owner, (const char *)ptr - header_size, sizeof(owner));
+  Header h;
+  if ((owner & hooks_tag) != 0) {
+    h.hooks = (const AllocatorHooks *)(owner & ~hooks_tag);
+  } else {
+    h.resource = (MemoryResource *)owner;
+  }
+  return h;
+}
+
+// Allocator is the allocator of the nlohmann/json nodes and containers.
+// Since nlohmann/json default constructs allocators, it allocates from
+// the resource selected with MemoryScope.
+template <typename Type>
+class Allocator {
+ public:
+  // value_type is the type we allocate.
+  using value_type = Type;
+
+  // Allocator constructs an allocator.
+  Allocator() noexcept {}
+
+  // Allocator constructs an allocator from an allocator of another type.
+  template <typename Other>
+  Allocator(const Allocator<Other> &) noexcept {}
+
+  // allocate allocates @p count instances of Type.
+  Type *allocate(size_t count) {
+    if (count > SIZE_MAX / sizeof(Type)) throw std::bad_alloc{};
+    static_assert(alignof(Type) <= AllocatorBase::header_size,
+                  "Type is overaligned");
+    return static_cast<Type *>(AllocatorBase::allocate(count * sizeof(Type)));
+  }
+
+  // deallocate deallocates @p count instances of Type at @p ptr.
+  void deallocate(Type *ptr, size_t count) noexcept {
+    AllocatorBase::deallocate(ptr, count * sizeof(Type));
+  }
+};
+
+// Allocators are always equal, since deallocation does not depend on them.
+template <typename Type, typename Other>
+bool operator==(const Allocator<Type> &, const Allocator<Other> &) noexcept {
+  return true;
+}
+
+// Allocators are always equal, since deallocation does not depend on them.
+template <typename Type, typename Other>
+bool operator!=(const Allocator<Type> &, const Allocator<Other> &) noexcept {
+  return false;
+}
+
+// Value is the nlohmann/json type we use, allocating with Allocator.
+using Value = nlohmann::basic_json<std::map, std::vector, std::string, bool,
+                                   int64_t, uint64_t, double, Allocator>;
+
+// We append values to strings using the nlohmann/json serializer, which
+// is not part of its public API, to avoid creating a temporary string per
+// value. Hence, we only do that for the versions whose serializer we know,
+// i.e., from v3.5.0, which we download, to v3.11. Otherwise, or if you
+// define MKJSON_NO_NLOHMANN_SERIALIZER, we use the public dump.
+#if defined(NLOHMANN_JSON_VERSION_MAJOR) && \
+    defined(NLOHMANN_JSON_VERSION_MINOR) && \
+    NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR >= 5 && \
+    NLOHMANN_JSON_VERSION_MINOR <= 11 && \
+    !defined(MKJSON_NO_NLOHMANN_SERIALIZER)
+#define MKJSON_HAVE_NLOHMANN_SERIALIZER
+#endif
+
+// dump_value appends the serialization of @p value to @p out.
+static void dump_value(const Value &value, std::string &out) {
+#ifdef MKJSON_HAVE_NLOHMANN_SERIALIZER
+  nlohmann::detail::serializer<Value> serializer{
+      nlohmann::detail::output_adapter<char>(out), ' '};
+  serializer.dump(value, false, false, 0);
+#else
+  out += value.dump();
+#endif
+}
+
+/*static*/ constexpr size_t ParseError::npos;
+
+size_t ParseError::line(const std::string &input) const noexcept {
+  if (offset == npos) return 0;
+  size_t end = std::min(offset, input.size());
+  return 1 + (size_t)std::count(input.begin(), input.begin() + (ptrdiff_t)end,
+                                '\n');
+}
+
+size_t ParseError::column(const std::string &input) const noexcept {
+  if (offset == npos) return 0;
+  size_t end = std::min(offset, input.size());
+  size_t newline = (end > 0) ? input.rfind('\n', end - 1) : std::string::npos;
+  return (newline == std::string::npos) ? end + 1 : end - newline;
+}
+
+// JSON::Impl is the concrete implementation of JSON.
+class JSON::Impl {
+ public:
+  // Arena is the resource holding the nodes relocated by compact.
+  class Arena;
+
+  // ArenaRelease is the deleter of arena.
+  class ArenaRelease {
+   public:
+    // operator() releases @p arena, which is deleted with its last node.
+    void operator()(Arena *arena) const noexcept;
+  };
+
+  // arena is set after compact. It is declared before nlohmann_json so that
+  // it is released after the nodes it contains have been destroyed.
+  std::unique_ptr<Arena, ArenaRelease> arena;
+
+  // nlohmann_json is the underlying nlohmann/json instance.
+  Value nlohmann_json;
+
+  // resource is where we allocate new nodes. Nodes added to nlohmann_json
+  // may have been allocated elsewhere, since each allocation records its
+  // owner, for deallocating it correctly.
+  MemoryResource *resource = nullptr;
+
+  // Packed is an array whose elements are all int64 or all float64.
+  class Packed;
+
+  // packed is set when the value is a packed array, i.e., when the elements
+  // are stored contiguously rather than as nlohmann nodes. In such case
+  // nlohmann_json is null. Methods that need nodes call value(), which
+  // converts the packed array into a regular array.
+  std::unique_ptr<Packed> packed;
+
+  // value returns nlohmann_json after converting a packed array, if any.
+  Value &value();
+
+  // unpacked returns a copy of the value with a packed array converted.
+  Value unpacked() const;
+
+  // reset clears the value, recycling its nodes.
+  void reset() noexcept;
+
+  // pack sets the value to be a packed array of int64 made of @p elements.
+  void pack(std::vector<int64_t> &&elements);
+
+  // pack sets the value to be a packed array of float64.
+  void pack(std::vector<double> &&elements);
+
+  // packed_elements returns the elements if the value is a packed array of
+  // int64, and nullptr otherwise.
+  std::vector<int64_t> *packed_elements(int64_t *) noexcept;
+
+  // packed_elements is like packed_elements but for float64.
+  std::vector<double> *packed_elements(double *) noexcept;
+
+  // packed_elements always returns nullptr since we don't pack strings.
+  std::vector<std::string> *packed_elements(std::string *) noexcept;
+
+  // dump appends the serialized value to @p out.
+  void dump(std::string &out) const;
+
+  // dump_packed appends to @p out the elements of the packed array in
+  // [@p begin, @p end), each preceded by a comma unless it's the first.
+  void dump_packed(std::string &out, size_t begin, size_t end) const;
+
+  // write serializes the value to @p stream.
+  void write(std::ostream &stream) const;
+
+  // format_int64 formats @p value into the buffer ending at @p end, which
+  // must have room for at least 20 chars, and returns the first char.
+  static char *format_int64(int64_t value, char *end) noexcept;
+
+  // parse_packed parses [@p begin, @p end) as a packed array, if it only
+  // contains a nonempty array of int64 or of float64, and returns true.
+  // Otherwise, including for invalid input, it returns false without
+  // modifying the value, and the caller should use parse instead.
+  bool parse_packed(const char *begin, const char *end);
+
+  // Impl constructs the implementation from an existing JSON.
+  explicit Impl(Value &&value) noexcept;
+
+  // Impl constructs an empty implementation.
+  Impl() noexcept;
+
+  // operator new allocates an Impl, reusing memory from the pool.
+  static void *operator new(size_t size);
+
+  // operator delete returns the memory of an Impl to the pool.
+  static void operator delete(void *ptr, size_t size) noexcept;
+
+  // Pool is a cache of emptied nodes whose storage can be reused.
+  class Pool;
+
+  // Builder is a SAX consumer building a value using pooled nodes.
+  class Builder;
+
+  // pool_size is the maximum number of entries in each list of a Pool.
+  static constexpr size_t pool_size = 256;
+
+  // pool_max_capacity is the maximum capacity in bytes of a string or of
+  // an array that we keep in a Pool, so to bound the cached memory.
+  static constexpr size_t pool_max_capacity = 4096;
+
+  // recycle_max_depth is the nesting depth after which recycle simply
+  // frees nodes. It bounds the recursion depth of recycle.
+  static constexpr size_t recycle_max_depth = 64;
+
+  // pool returns the Pool of this thread, or nullptr if it's been already
+  // destroyed because the thread is exiting. If the allocator hooks of the
+  // thread changed, it first flushes the memory cached with the old hooks.
+  static Pool *pool() noexcept;
+
+  // recycle moves @p value, including its children, to the pool of this
+  // thread and leaves @p value null. Nodes are freed when the pool is full.
+  static void recycle(Value &value, size_t depth = 0) noexcept;
+
+  // append_packed appends the packed array of @p other to ours and returns
+  // true, if both are packed arrays of the same type. Otherwise, it returns
+  // false without changing anything.
+  bool append_packed(const Impl &other);
+
+  // SortKey is the key of an element sorted by sort_by.
+  class SortKey;
+
+  // parallel_sort_threshold is the number of keys per thread from which
+  // sort_keys sorts using many threads.
+  static constexpr size_t parallel_sort_threshold = 1 << 16;
+
+  // split_pointer splits the JSON pointer @p pointer into its unescaped
+  // reference tokens. It throws if @p pointer is not valid.
+  static std::vector<std::string> split_pointer(const std::string &pointer);
+
+  // resolve returns the value that @p tokens refer to within @p node, or
+  // nullptr if there is no such value.
+  static const Value *resolve(const Value &node,
+                              const std::vector<std::string> &tokens) noexcept;
+
+  // sort sorts our array like sort_by and keeps the first @p count elements.
+  void sort(const std::string &pointer, SortOrder order, size_t count);
+
+  // sort_keys sorts @p keys, in parallel if there are many of them.
+  template <typename Compare>
+  static void sort_keys(std::vector<SortKey> &keys, Compare compare);
+
+  // run_tasks runs @p tasks, each in a thread, and waits for them. Tasks
+  // for which we cannot create a thread run in the calling thread.
+  static void run_tasks(const std::vector<std::function<void()>> &tasks);
+
+  // permute reorders @p elements such that the element at each position i
+  // is the one that was at keys[i].index. It also changes @p keys.
+  template <typename Container>
+  static void permute(Container &elements,
+                      std::vector<SortKey> &keys) noexcept;
+
+  // retain removes from our array the elements whose flag in @p keep is zero.
+  void retain(const std::vector<char> &keep) noexcept;
+
+  // compact moves to the beginning of @p elements, in order, the elements
+  // whose flag in @p keep is not zero, and returns their number.
+  template <typename Container>
+  static size_t compact(Container &elements,
+                        const std::vector<char> &keep) noexcept;
+
+  // merge moves the members of @p from into @p into. Members of @p from
+  // replace the members of @p into with the same key when @p replace is
+  // true and are otherwise discarded.
+  static void merge(Value::object_t &into, Value::object_t &from,
+                    bool replace);
+
+  // make returns an empty node of @p type, which must be object, array or
+  // string, reusing a node from the pool of this thread if possible.
+  static Value make(Value::value_t type);
+
+  // make_string returns a string node containing @p value, reusing a node
+  // from the pool of this thread, and its capacity, if possible.
+  static Value make_string(std::string &&value);
+
+  // make_value returns a node containing @p value.
+  static Value make_value(double value) noexcept;
+
+  // make_value returns a node containing @p value.
+  static Value make_value(int64_t value) noexcept;
+
+  // make_value returns a string node containing @p value, or its base64
+  // encoding, if @p value is not valid UTF-8.
+  static Value make_value(std::string &&value);
+
+  // get_value_array_of implements get_value_array_xxx for @p Type. The
+  // @p type_failure is the error when an element is not a @p Type.
+  template <typename Type>
+  static Result<std::vector<Type>> get_value_array_of(
+      Impl &impl, const char *type_failure) noexcept;
+
+  // set_value_array_of implements set_value_array_xxx for @p Type.
+  template <typename Type>
+  static void set_value_array_of(Impl &impl, std::vector<Type> &&array);
+
+  // parse parses @p input, which may be anything accepted by sax_parse,
+  // into @p value using pooled nodes and @p options. It throws on failure
+  // after filling the offset and the pointer of @p error, if not nullptr.
+  template <typename... Input>
+  static void parse(Value &value, const ParseOptions &options,
+                    ParseError *error, Input &&... input);
+
+  // locate fills the offset of @p error, when parsing [@p begin, @p end)
+  // with @p options rejected a duplicate key, by parsing again the input
+  // up to the rejected key, this time knowing how many bytes we read.
+  static void locate(ParseError &error, const ParseOptions &options,
+                     const char *begin, const char *end);
+
+  // locate does nothing for inputs other than memory, e.g. streams, which
+  // we cannot read twice.
+  template <typename... Input>
+  static void locate(ParseError &, const ParseOptions &, Input &&...) {}
+
+  // describe fills the context of @p error using the input [@p begin,
+  // @p end) and clamps the offset to the input size.
+  static void describe(ParseError &error, const char *begin,
+                       const char *end);
+
+  // escape appends @p key to @p pointer escaped as a JSON pointer token.
+  static void escape(const std::string &key, std::string &pointer);
+
+  // memory_usage returns the heap bytes owned by @p value, not including
+  // the size of @p value itself, which is owned by its container.
+  static size_t memory_usage(const Value &value) noexcept;
+
+  // memory_usage returns the heap bytes owned by @p str, which is zero when
+  // the string is stored inline using the small string optimization.
+  static size_t memory_usage(const std::string &str) noexcept;
+
+  // shrink_to_fit recursively releases unused capacity inside @p value.
+  static void shrink_to_fit(Value &value);
+
+  // snapshot_magic identifies snapshots. The last byte is the version.
+  static constexpr char snapshot_magic[8] = {'M', 'K', 'J', 'S', 'N', 'A', 'P', 2};
+
+  // snapshot_header_size is the size of the header preceding the payload,
+  // i.e. the magic, the payload size and the payload checksum.
+  static constexpr size_t snapshot_header_size = 24;
+
+  // checksum returns a 64 bit hash of @p size bytes at @p data. It applies
+  // FNV-1a to little endian 64 bit words, using four independent lanes so
+  // the multiplications overlap, then hashes the lanes and the last bytes.
+  static uint64_t checksum(const uint8_t *data, size_t size) noexcept;
+
+  // relocate returns a deep copy of @p value whose nodes have been allocated
+  // in depth-first order, with exactly sized containers and strings.
+  static Value relocate(const Value &value);
+};
+
+/*explicit*/ JSON::Impl::Impl(Value &&value) noexcept {
+  std::swap(value, nlohmann_json);
+}
+
+JSON::Impl::Impl() noexcept {}
+
+// JSON::Impl::Arena allocates the nodes relocated by compact from a single
+// buffer. Since nodes may be moved out of the compacted JSON, the arena
+// counts its live allocations plus one reference held by the JSON, and it
+// deletes itself once the count drops to zero.
+class JSON::Impl::Arena : public MemoryResource {
+ public:
+  // Arena creates an arena with a buffer of @p size bytes allocated from
+  // @p resource or, if nullptr, using the current hooks.
+  Arena(MemoryResource *resource, size_t size);
+
+  // allocate implements MemoryResource::allocate.
+  void *allocate(size_t size, size_t alignment) override;
+
+  // deallocate implements MemoryResource::deallocate.
+  void deallocate(void *ptr, size_t size,
+                  size_t alignment) noexcept override;
+
+  // release drops the reference held by the JSON.
+  void release() noexcept;
+
+  // ~Arena frees the buffer.
+  ~Arena() noexcept override;
+
+ private:
+  // storage is the buffer.
+  char *storage = nullptr;
+
+  // size is the size of the buffer.
+  size_t size = 0;
+
+  // buffer allocates from storage, spilling to the heap when it is full.
+  BufferResource buffer;
+
+  // references is the number of live allocations plus one for the JSON.
+  std::atomic<size_t> references{1};
+};
+
+JSON::Impl::Arena::Arena(MemoryResource *resource, size_t n)
+    : storage{static_cast<char *>(AllocatorBase::allocate(resource, n))},
+      size{n},
+      buffer{storage, n} {}
+
+void *JSON::Impl::Arena::allocate(size_t n, size_t alignment) {
+  void *ptr = buffer.allocate(n, alignment);
+  references += 1;
+  return ptr;
+}
+
+void JSON::Impl::Arena::deallocate(void *ptr, size_t, size_t) noexcept {
+  // Buffer memory is reclaimed all at once, hence we only free the spills,
+  // which BufferResource::allocate got using operator new.
+  char *p = static_cast<char *>(ptr);
+  if (p < storage || p >= storage + size) ::operator delete(ptr);
+  release();
+}
+
+void JSON::Impl::Arena::release() noexcept {
+  if (--references == 0) delete this;
+}
+
+JSON::Impl::Arena::~Arena() noexcept {
+  AllocatorBase::deallocate(storage, size);
+}
+
+void JSON::Impl::ArenaRelease::operator()(Arena *arena) const noexcept {
+  arena->release();
+}
+
+// JSON::Impl::Packed is the definition of Packed.
+class JSON::Impl::Packed {
+ public:
+  // type is either number_integer or number_float.
+  Value::value_t type = Value::value_t::number_integer;
+
+  // int64 contains the elements when type is number_integer.
+  std::vector<int64_t> int64;
+
+  // float64 contains the elements when type is number_float.
+  std::vector<double> float64;
+
+  // size returns the number of elements.
+  size_t size() const noexcept;
+};
+
+size_t JSON::Impl::Packed::size() const noexcept {
+  return (type == Value::value_t::number_integer) ? int64.size()
+                                                          : float64.size();
+}
+
+Value &JSON::Impl::value() {
+  if (packed) {
+    Value array = unpacked();
+    packed.reset();
+    std::swap(array, nlohmann_json);
+  }
+  return nlohmann_json;
+}
+
+Value JSON::Impl::unpacked() const {
+  if (!packed) return nlohmann_json;
+  Value array = make(Value::value_t::array);
+  auto arrayp = array.get_ptr<Value::array_t *>();
+  arrayp->reserve(packed->size());
+  if (packed->type == Value::value_t::number_integer) {
+    for (int64_t entry : packed->int64) arrayp->push_back(Value(entry));
+  } else {
+    for (double entry : packed->float64) arrayp->push_back(Value(entry));
+  }
+  return array;
+}
+
+void JSON::Impl::reset() noexcept {
+  recycle(nlohmann_json);
+  packed.reset();
+}
+
+bool JSON::Impl::append_packed(const Impl &other) {
+  if (!packed || !other.packed || packed->type != other.packed->type) {
+    return false;
+  }
+  if (packed->type == Value::value_t::number_integer) {
+    packed->int64.insert(packed->int64.end(), other.packed->int64.begin(),
+                         other.packed->int64.end());
+  } else {
+    packed->float64.insert(packed->float64.end(),
+                           other.packed->float64.begin(),
+                           other.packed->float64.end());
+  }
+  return true;
+}
+
+// JSON::Impl::SortKey is the definition of SortKey.
+class JSON::Impl::SortKey {
+ public:
+  // rank is 0 for numbers, 1 for strings and 2 for anything else.
+  int rank = 2;
+
+  // integer tells whether the number is int64 rather than float64.
+  bool integer = false;
+
+  // int64 is the number when integer is true.
+  int64_t int64 = 0;
+
+  // float64 is the number when integer is false.
+  double float64 = 0.0;
+
+  // string is the string, if rank is 1.
+  const std::string *string = nullptr;
+
+  // index is the index of the element within the array.
+  size_t index = 0;
+
+  // set sets the key from @p value, which may be nullptr.
+  void set(const Value *value) noexcept;
+
+  // compare returns a negative number, zero or a positive number if @p a
+  // is, respectively, less than, equal to or greater than @p b, ignoring
+  // the index and assuming that both have the same rank.
+  static int compare(const SortKey &a, const SortKey &b) noexcept;
+};
+
+void JSON::Impl::SortKey::set(const Value *value) noexcept {
+  if (value == nullptr) return;
+  if (value->is_number_integer()) {
+    rank = 0;
+    integer = true;
+    int64 = *value->get_ptr<const int64_t *>();
+  } else if (value->is_number_float()) {
+    float64 = *value->get_ptr<const double *>();
+    rank = (std::isnan(float64)) ? 2 : 0;  // NaN is not ordered
+  } else if (value->is_string()) {
+    rank = 1;
+    string = value->get_ptr<const std::string *>();
+  }
+}
+
+/*static*/ int JSON::Impl::SortKey::compare(const SortKey &a,
+                                           const SortKey &b) noexcept {
+  if (a.rank == 1) return a.string->compare(*b.string);
+  if (a.rank != 0) return 0;
+  if (a.integer && b.integer) {
+    return (a.int64 < b.int64) ? -1 : (a.int64 > b.int64) ? 1 : 0;
+  }
+  double x = (a.integer) ? (double)a.int64 : a.float64;
+  double y = (b.integer) ? (double)b.int64 : b.float64;
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/*static*/ constexpr size_t JSON::Impl::parallel_sort_threshold;
+
+/*static*/ std::vector<std::string> JSON::Impl::split_pointer(
+    const std::string &pointer) {
+  std::vector<std::string> tokens;
+  if (pointer.empty()) return tokens;
+  if (pointer[0] != '/') throw std::runtime_error("Invalid JSON pointer");
+  for (size_t i = 0; i < pointer.size(); ++i) {
+    if (pointer[i] == '/') {
+      tokens.push_back(std::string{});
+    } else if (pointer[i] != '~') {
+      tokens.back() += pointer[i];
+    } else if (i + 1 < pointer.size() && pointer[i + 1] == '0') {
+      tokens.back() += '~';
+      ++i;
+    } else if (i + 1 < pointer.size() && pointer[i + 1] == '1') {
+      tokens.back() += '/';
+      ++i;
+    } else {
+      throw std::runtime_error("Invalid JSON pointer");
+    }
+  }
+  return tokens;
+}
+
+/*static*/ const Value *JSON::Impl::resolve(
+    const Value &node, const std::vector<std::string> &tokens) noexcept {
+  const Value *current = &node;
+  for (const std::string &token : tokens) {
+    if (current->is_object()) {
+      auto objectp = current->get_ptr<const Value::object_t *>();
+      auto it = objectp->find(token);
+      if (it == objectp->end()) return nullptr;
+      current = &it->second;
+    } else if (current->is_array()) {
+      // An index is made of digits, without leading zeros.
+      if (token.empty() || token.size() > 19 ||
+          (token[0] == '0' && token.size() > 1) ||
+          token.find_first_not_of("0123456789") != std::string::npos) {
+        return nullptr;
+      }
+      auto arrayp = current->get_ptr<const Value::array_t *>();
+      size_t index = (size_t)strtoull(token.c_str(), nullptr, 10);
+      if (index >= arrayp->size()) return nullptr;
+      current = &(*arrayp)[index];
+    } else {
+      return nullptr;
+    }
+  }
+  return current;
+}
+
+void JSON::Impl::sort(const std::string &pointer, SortOrder order,
+                      size_t count) {
+  std::vector<std::string> tokens = split_pointer(pointer);
+  std::vector<SortKey> keys;
+  if (packed) {
+    keys.resize(packed->size());
+    Value node;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      keys[i].index = i;
+      if (!tokens.empty()) continue;  // Numbers do not contain values
+      if (packed->type == Value::value_t::number_integer) {
+        node = packed->int64[i];
+      } else {
+        node = packed->float64[i];
+      }
+      keys[i].set(&node);
+    }
+  } else {
+    auto &elements = *nlohmann_json.get_ptr<Value::array_t *>();
+    keys.resize(elements.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      keys[i].index = i;
+      keys[i].set(resolve(elements[i], tokens));
+    }
+  }
+  // Comparing the indexes last makes the sort stable, also when using
+  // partial_sort or sorting in parallel, which are not stable.
+  bool descending = order == SortOrder::descending;
+  auto less = [descending](const SortKey &a, const SortKey &b) {
+    if (a.rank != b.rank) return a.rank < b.rank;
+    int result = SortKey::compare(a, b);
+    if (result != 0) return (descending) ? result > 0 : result < 0;
+    return a.index < b.index;
+  };
+  if (count < keys.size()) {
+    std::partial_sort(keys.begin(), keys.begin() + (ptrdiff_t)count,
+                      keys.end(), less);
+  } else {
+    count = keys.size();
+    sort_keys(keys, less);
+  }
+  // From now on, nothing throws, thus the JSON is changed only on success.
+  if (packed && packed->type == Value::value_t::number_integer) {
+    permute(packed->int64, keys);
+    packed->int64.resize(count);
+    return;
+  }
+  if (packed) {
+    permute(packed->float64, keys);
+    packed->float64.resize(count);
+    return;
+  }
+  auto &elements = *nlohmann_json.get_ptr<Value::array_t *>();
+  permute(elements, keys);
+  for (size_t i = count; i < elements.size(); ++i) recycle(elements[i]);
+  elements.erase(elements.begin() + (ptrdiff_t)count, elements.end());
+}
+
+template <typename Compare>
+/*static*/ void JSON::Impl::sort_keys(std::vector<SortKey> &keys,
+                                     Compare compare) {
+  size_t chunks = std::min((size_t)std::thread::hardware_concurrency(),
+                           keys.size() / parallel_sort_threshold);
+  if (chunks < 2) {
+    std::sort(keys.begin(), keys.end(), compare);
+    return;
+  }
+  // Sort the chunks in parallel, then merge pairs of adjacent chunks, also
+  // in parallel, until there is a single chunk.
+  using Iterator = std::vector<SortKey>::iterator;
+  std::vector<Iterator> bounds;
+  for (size_t i = 0; i <= chunks; ++i) {
+    bounds.push_back(keys.begin() + (ptrdiff_t)(keys.size() * i / chunks));
+  }
+  std::vector<std::function<void()>> tasks;
+  for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+    Iterator first = bounds[i], last = bounds[i + 1];
+    tasks.push_back([first, last, compare]() {
+      std::sort(first, last, compare);
+    });
+  }
+  run_tasks(tasks);
+  while (bounds.size() > 2) {
+    std::vector<Iterator> merged;
+    tasks.clear();
+    for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+      Iterator first = bounds[i], middle = bounds[i + 1], last = bounds[i + 2];
+      tasks.push_back([first, middle, last, compare]() {
+        std::inplace_merge(first, middle, last, compare);
+      });
+      merged.push_back(first);
+    }
+    if (bounds.size() % 2 == 0) merged.push_back(bounds[bounds.size() - 2]);
+    merged.push_back(bounds.back());
+    run_tasks(tasks);
+    std::swap(bounds, merged);
+  }
+}
+
+/*static*/ void JSON::Impl::run_tasks(
+    const std::vector<std::function<void()>> &tasks) {
+  std::vector<std::thread> threads;
+  threads.reserve(tasks.size());
+  size_t i = 0;
+  for (; i < tasks.size(); ++i) {
+    try {
+      threads.emplace_back(tasks[i]);
+    } catch (const std::exception &) {
+      break;
+    }
+  }
+  for (; i < tasks.size(); ++i) tasks[i]();
+  for (std::thread &thread : threads) thread.join();
+}
+
+template <typename Container>
+/*static*/ void JSON::Impl::permute(Container &elements,
+                                   std::vector<SortKey> &keys) noexcept {
+  // Follow each cycle of the permutation, moving each element once, and
+  // mark the positions already filled by setting their index to themselves.
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (keys[i].index == i) continue;
+    auto saved = std::move(elements[i]);
+    size_t j = i;
+    while (keys[j].index != i) {
+      size_t next = keys[j].index;
+      elements[j] = std::move(elements[next]);
+      keys[j].index = j;
+      j = next;
+    }
+    elements[j] = std::move(saved);
+    keys[j].index = j;
+  }
+}
+
+void JSON::Impl::retain(const std::vector<char> &keep) noexcept {
+  if (packed && packed->type == Value::value_t::number_integer) {
+    packed->int64.resize(compact(packed->int64, keep));
+    return;
+  }
+  if (packed) {
+    packed->float64.resize(compact(packed->float64, keep));
+    return;
+  }
+  auto &elements = *nlohmann_json.get_ptr<Value::array_t *>();
+  size_t count = compact(elements, keep);
+  for (size_t i = count; i < elements.size(); ++i) recycle(elements[i]);
+  elements.erase(elements.begin() + (ptrdiff_t)count, elements.end());
+}
+
+template <typename Container>
+/*static*/ size_t JSON::Impl::compact(Container &elements,
+                                     const std::vector<char> &keep) noexcept {
+  size_t count = 0;
+  for (size_t i = 0; i < elements.size() && i < keep.size(); ++i) {
+    if (!keep[i]) continue;
+    if (count != i) std::swap(elements[count], elements[i]);
+    ++count;
+  }
+  return count;
+}
+
+/*static*/ void JSON::Impl::merge(Value::object_t &into, Value::object_t &from,
+                                 bool replace) {
+  for (auto &entry : from) {
+    // The position found by lower_bound is the correct hint for inserting,
+    // thus we look up each key once.
+    auto it = into.lower_bound(entry.first);
+    if (it != into.end() && !into.key_comp()(entry.first, it->first)) {
+      if (replace) {
+        recycle(it->second);
+        it->second = std::move(entry.second);
+      }
+      continue;
+    }
+    into.emplace_hint(it, entry.first, std::move(entry.second));
+  }
+}
+
+void JSON::Impl::pack(std::vector<int64_t> &&elements) {
+  std::unique_ptr<Packed> p{new Packed};
+  p->type = Value::value_t::number_integer;
+  std::swap(p->int64, elements);
+  reset();
+  std::swap(packed, p);
+}
+
+void JSON::Impl::pack(std::vector<double> &&elements) {
+  std::unique_ptr<Packed> p{new Packed};
+  p->type = Value::value_t::number_float;
+  std::swap(p->float64, elements);
+  reset();
+  std::swap(packed, p);
+}
+
+std::vector<int64_t> *JSON::Impl::packed_elements(int64_t *) noexcept {
+  return (packed && packed->type == Value::value_t::number_integer)
+             ? &packed->int64
+             : nullptr;
+}
+
+std::vector<double> *JSON::Impl::packed_elements(double *) noexcept {
+  return (packed && packed->type == Value::value_t::number_float)
+             ? &packed->float64
+             : nullptr;
+}
+
+std::vector<std::string> *JSON::Impl::packed_elements(std::string *) noexcept {
+  return nullptr;
+}
+
+void JSON::Impl::dump(std::string &out) const {
+  if (packed) {
+    out += '[';
+    dump_packed(out, 0, packed->size());
+    out += ']';
+    return;
+  }
+  dump_value(nlohmann_json, out);
+}
+
+void JSON::Impl::dump_packed(std::string &out, size_t begin,
+                             size_t end) const {
+  if (packed->type == Value::value_t::number_integer) {
+    char buffer[24];
+    char *buffer_end = buffer + sizeof(buffer);
+    for (size_t i = begin; i < end; ++i) {
+      if (i > 0) out += ',';
+      char *first = format_int64(packed->int64[i], buffer_end);
+      out.append(first, (size_t)(buffer_end - first));
+    }
+    return;
+  }
+  // We use the nlohmann serializer, so the output is the same as for the
+  // unpacked array, on batches of elements, so that the cost of setting it
+  // up is amortized, and without allocating nodes for float64 elements.
+  constexpr size_t batch_size = 256;
+  Value batch = Value::array();
+  auto batchp = batch.get_ptr<Value::array_t *>();
+  batchp->reserve(batch_size);
+  std::string scratch;
+  for (size_t i = begin; i < end; i += batch_size) {
+    batchp->clear();
+    for (size_t j = i; j < end && j - i < batch_size; ++j) {
+      batchp->emplace_back(packed->float64[j]);
+    }
+    scratch.clear();
+    dump_value(batch, scratch);
+    if (i > 0) out += ',';
+    out.append(scratch, 1, scratch.size() - 2);  // Without the brackets
+  }
+}
+
+/*static*/ char *JSON::Impl::format_int64(int64_t value, char *end) noexcept {
+  // Generating two digits at a time halves the number of divisions.
+  static const char digits[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+  uint64_t magnitude = (value < 0) ? 0 - (uint64_t)value : (uint64_t)value;
+  char *p = end;
+  while (magnitude >= 100) {
+    size_t index = (size_t)(magnitude % 100) * 2;
+    magnitude /= 100;
+    *--p = digits[index + 1];
+    *--p = digits[index];
+  }
+  if (magnitude >= 10) {
+    size_t index = (size_t)magnitude * 2;
+    *--p = digits[index + 1];
+    *--p = digits[index];
+  } else {
+    *--p = (char)('0' + magnitude);
+  }
+  if (value < 0) *--p = '-';
+  return p;
+}
+
+bool JSON::Impl::parse_packed(const char *begin, const char *end) {
+  auto skip_whitespace = [end](const char *p) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+      ++p;
+    }
+    return p;
+  };
+  auto skip_digits = [end](const char *p) {
+    while (p < end && *p >= '0' && *p <= '9') ++p;
+    return p;
+  };
+  const char *p = skip_whitespace(begin);
+  if (p >= end || *p != '[') return false;
+  p = skip_whitespace(p + 1);
+  if (p >= end || *p == ']') return false;
+  std::vector<int64_t> int64;
+  std::vector<double> float64;
+  for (;;) {
+    // Scan a number using the JSON grammar.
+    const char *number = p;
+    bool negative = (*p == '-');
+    if (negative) ++p;
+    if (p >= end || *p < '0' || *p > '9') return false;
+    p = (*p == '0') ? p + 1 : skip_digits(p);
+    const char *integer_end = p;
+    if (p < end && *p == '.') {
+      ++p;
+      if (p >= end || *p < '0' || *p > '9') return false;
+      p = skip_digits(p);
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      if (p < end && (*p == '+' || *p == '-')) ++p;
+      if (p >= end || *p < '0' || *p > '9') return false;
+      p = skip_digits(p);
+    }
+    if (p == integer_end) {
+      if (!float64.empty()) return false;  // Mixed arrays are not packed
+      uint64_t magnitude = 0;
+      for (const char *q = number + negative; q < p; ++q) {
+        uint64_t digit = (uint64_t)(*q - '0');
+        if (magnitude > (UINT64_MAX - digit) / 10) return false;
+        magnitude = magnitude * 10 + digit;
+      }
+      // Numbers not fitting an int64 are uint64 or float64 for nlohmann.
+      constexpr uint64_t int64_max = (uint64_t)INT64_MAX;
+      if (magnitude > int64_max + negative) return false;
+      if (!negative) {
+        int64.push_back((int64_t)magnitude);
+      } else if (magnitude > int64_max) {
+        int64.push_back(INT64_MIN);
+      } else {
+        int64.push_back(-(int64_t)magnitude);
+      }
+    } else {
+      if (!int64.empty()) return false;  // Mixed arrays are not packed
+      // strtod needs a terminated string and the C locale decimal point.
+      char buffer[64];
+      size_t size = (size_t)(p - number);
+      const char *point = localeconv()->decimal_point;
+      if (size >= sizeof(buffer) || point == nullptr || strcmp(point, ".")) {
+        return false;
+      }
+      memcpy(buffer, number, size);
+      buffer[size] = '\0';
+      char *endp = nullptr;
+      double value = strtod(buffer, &endp);
+      // Let the slow path report overflows as nlohmann would.
+      if (endp != buffer + size || !std::isfinite(value)) return false;
+      float64.push_back(value);
+    }
+    p = skip_whitespace(p);
+    if (p >= end) return false;
+    if (*p == ']') break;
+    if (*p != ',') return false;
+    p = skip_whitespace(p + 1);
+    if (p >= end) return false;
+  }
+  if (skip_whitespace(p + 1) != end) return false;
+  if (!int64.empty()) {
+    pack(std::move(int64));
+  } else {
+    pack(std::move(float64));
+  }
+  return true;
+}
+
+void JSON::Impl::write(std::ostream &stream) const {
+  if (!packed) {
+    stream << nlohmann_json;
+    return;
+  }
+  // Serialize in batches so we don't need a copy of the whole array.
+  constexpr size_t batch_size = 4096;
+  std::string out;
+  stream << '[';
+  for (size_t i = 0; i < packed->size(); i += batch_size) {
+    out.clear();
+    dump_packed(out, i, std::min(i + batch_size, packed->size()));
+    stream.write(out.data(), (std::streamsize)out.size());
+  }
+  stream << ']';
+}
+
+// JSON::Impl::Pool is the definition of Pool. Each thread has its own.
+class JSON::Impl::Pool {
+ public:
+  // strings contains empty string nodes.
+  std::vector<Value> strings;
+
+  // arrays contains empty array nodes.
+  std::vector<Value> arrays;
+
+  // objects contains empty object nodes.
+  std::vector<Value> objects;
+
+  // impls contains memory for allocating Impl instances.
+  std::vector<void *> impls;
+
+  // parents is the stack used by Builder, kept here to reuse its memory.
+  std::vector<Value *> parents;
+
+  // keys is like parents but for the keys stack used by Builder.
+  std::vector<const std::string *> keys;
+
+  // destroyed is set to true by the destructor.
+  bool *destroyed = nullptr;
+
+  // hooks are the allocator hooks of the cached memory.
+  const AllocatorHooks *hooks = nullptr;
+
+  // Pool constructs an empty pool.
+  explicit Pool(bool *destroyed) noexcept;
+
+  // put moves @p value to @p nodes, if not full, and returns true. Otherwise
+  // it returns false and leaves @p value untouched.
+  static bool put(std::vector<Value> &nodes,
+                  Value &value) noexcept;
+
+  // flush frees the cached memory.
+  void flush() noexcept;
+
+  // ~Pool frees the cached memory and sets destroyed to true.
+  ~Pool() noexcept;
+};
+
+/*explicit*/ JSON::Impl::Pool::Pool(bool *d) noexcept : destroyed{d} {}
+
+/*static*/ bool JSON::Impl::Pool::put(std::vector<Value> &nodes,
+                                      Value &value) noexcept {
+  try {
+    if (nodes.capacity() < pool_size) nodes.reserve(pool_size);
+  } catch (const std::exception &) {
+    return false;
+  }
+  if (nodes.size() >= pool_size) return false;
+  nodes.push_back(std::move(value));  // Cannot throw; moving leaves null
+  return true;
+}
+
+void JSON::Impl::Pool::flush() noexcept {
+  strings.clear();
+  arrays.clear();
+  objects.clear();
+  for (void *ptr : impls) AllocatorBase::deallocate(ptr, sizeof(Impl));
+  impls.clear();
+}
+
+JSON::Impl::Pool::~Pool() noexcept {
+  flush();
+  *destroyed = true;
+}
+
+/*static*/ constexpr size_t JSON::Impl::pool_size;
+/*static*/ constexpr size_t JSON::Impl::pool_max_capacity;
+/*static*/ constexpr size_t JSON::Impl::recycle_max_depth;
+
+/*static*/ JSON::Impl::Pool *JSON::Impl::pool() noexcept {
+  // The flag is trivially destructible, thus we can still read it after
+  // the pool is gone, e.g., when destroying a JSON at thread exit.
+  static thread_local bool destroyed = false;
+  static thread_local Pool instance{&destroyed};
+  if (destroyed) return nullptr;
+  const AllocatorHooks *hooks = AllocatorBase::hooks();
+  if (instance.hooks != hooks) {
+    instance.flush();
+    instance.hooks = hooks;
+  }
+  return &instance;
+}
+
+/*static*/ void *JSON::Impl::operator new(size_t size) {
+  Pool *p = pool();
+  if (p == nullptr || p->impls.empty() || size != sizeof(Impl)) {
+    return AllocatorBase::allocate(nullptr, size);
+  }
+  void *ptr = p->impls.back();
+  p->impls.pop_back();
+  return ptr;
+}
+
+/*static*/ void JSON::Impl::operator delete(void *ptr, size_t size) noexcept {
+  if (ptr == nullptr) return;
+  Pool *p = pool();
+  if (p != nullptr && size == sizeof(Impl) && AllocatorBase::poolable(ptr)) {
+    try {
+      if (p->impls.capacity() < pool_size) p->impls.reserve(pool_size);
+      if (p->impls.size() < pool_size) {
+        p->impls.push_back(ptr);
+        return;
+      }
+    } catch (const std::exception &) {
+      // FALLTHROUGH
+    }
+  }
+  AllocatorBase::deallocate(ptr, size);
+}
+
+/*static*/ void JSON::Impl::recycle(Value &value,
+                                   size_t depth) noexcept {
+  Pool *p = (depth < recycle_max_depth) ? pool() : nullptr;
+  if (p == nullptr) {
+    value = nullptr;
+    return;
+  }
+  switch (value.type()) {
+    case Value::value_t::object: {
+      auto objectp = value.get_ptr<Value::object_t *>();
+      for (auto &entry : *objectp) {
+        recycle(entry.second, depth + 1);
+      }
+      objectp->clear();  // Map nodes cannot be reused, only the map itself
+      if (AllocatorBase::poolable(objectp) &&
+          Pool::put(p->objects, value)) {
+        return;
+      }
+      break;
+    }
+    case Value::value_t::array: {
+      auto arrayp = value.get_ptr<Value::array_t *>();
+      for (auto &entry : *arrayp) {
+        recycle(entry, depth + 1);
+      }
+      arrayp->clear();
+      // The pool only contains heap memory, which outlives any resource,
+      // allocated with the hooks of this thread.
+      if (arrayp->capacity() * sizeof(Value) <= pool_max_capacity &&
+          AllocatorBase::poolable(arrayp) &&
+          (arrayp->capacity() <= 0 ||
+           AllocatorBase::poolable(arrayp->data())) &&
+          Pool::put(p->arrays, value)) {
+        return;
+      }
+      break;
+    }
+    case Value::value_t::string: {
+      auto stringp = value.get_ptr<std::string *>();
+      stringp->clear();
+      if (stringp->capacity() <= pool_max_capacity &&
+          AllocatorBase::poolable(stringp) &&
+          Pool::put(p->strings, value)) {
+        return;
+      }
+      break;
+    }
+    default:
+      break;  // Scalars do not own any memory
+  }
+  value = nullptr;
+}
+
+/*static*/ Value JSON::Impl::make(Value::value_t type) {
+  // Pooled nodes are on the heap, thus we can only use them for the heap.
+  Pool *p = (MemoryScope::current() == nullptr) ? pool() : nullptr;
+  std::vector<Value> *nodes = nullptr;
+  if (p != nullptr) {
+    switch (type) {
+      case Value::value_t::object:
+        nodes = &p->objects;
+        break;
+      case Value::value_t::array:
+        nodes = &p->arrays;
+        break;
+      case Value::value_t::string:
+        nodes = &p->strings;
+        break;
+      default:
+        break;
+    }
+  }
+  if (nodes == nullptr || nodes->empty()) return Value(type);
+  Value node = std::move(nodes->back());
+  nodes->pop_back();
+  return node;
+}
+
+/*static*/ Value JSON::Impl::make_string(std::string &&value) {
+  Value node = make(Value::value_t::string);
+  std::swap(*node.get_ptr<std::string *>(), value);
+  return node;
+}
+
+/*static*/ Value JSON::Impl::make_value(double value) noexcept {
+  return Value(value);
+}
+
+/*static*/ Value JSON::Impl::make_value(int64_t value) noexcept {
+  return Value(value);
+}
+
+/*static*/ Value JSON::Impl::make_value(std::string &&value) {
+  if (!mk::data::contains_valid_utf8(value)) {
+    value = mk::data::base64_encode(std::move(value));
+  }
+  return make_string(std::move(value));
+}
+
+template <typename Type>
+/*static*/ Result<std::vector<Type>> JSON::Impl::get_value_array_of(
+    Impl &impl, const char *type_failure) noexcept {
+  Result<std::vector<Type>> result;
+  MemoryScope scope{impl.resource};
+  std::vector<Type> *elementsp = impl.packed_elements((Type *)nullptr);
+  if (elementsp != nullptr) {
+    std::swap(result.value, *elementsp);
+    impl.reset();
+    return result;
+  }
+  Value *valuep = nullptr;
+  try {
+    valuep = &impl.value();
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  Value &value = *valuep;
+  auto arrayp = value.get_ptr<Value::array_t *>();
+  if (arrayp == nullptr) {
+    result.good = false;
+    result.failure = "Not an array";
+    return result;
+  }
+  // Check all the types first, so on failure the JSON is untouched.
+  for (Value &entry : *arrayp) {
+    if (entry.get_ptr<Type *>() == nullptr) {
+      result.good = false;
+      result.failure = type_failure;
+      return result;
+    }
+  }
+  try {
+    result.value.reserve(arrayp->size());
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  for (Value &entry : *arrayp) {
+    result.value.push_back(std::move(*entry.get_ptr<Type *>()));
+  }
+  recycle(value);
+  return result;
+}
+
+template <typename Type>
+/*static*/ void JSON::Impl::set_value_array_of(Impl &impl,
+                                               std::vector<Type> &&array) {
+  MemoryScope scope{impl.resource};
+  Value node = make(Value::value_t::array);
+  auto arrayp = node.get_ptr<Value::array_t *>();
+  arrayp->reserve(array.size());
+  for (Type &entry : array) {
+    arrayp->push_back(make_value(std::move(entry)));
+  }
+  impl.reset();
+  impl.nlohmann_json = std::move(node);
+}
+
+/*static*/ void JSON::Impl::describe(ParseError &error, const char *begin,
+                                     const char *end) {
+  constexpr size_t context_size = 16;
+  if (error.offset == ParseError::npos) return;
+  size_t size = (size_t)(end - begin);
+  error.offset = std::min(error.offset, size);
+  size_t first = (error.offset > context_size) ? error.offset - context_size
+                                               : 0;
+  size_t last = std::min(error.offset + context_size, size);
+  error.context.assign(begin + first, begin + last);
+}
+
+/*static*/ void JSON::Impl::escape(const std::string &key,
+                                   std::string &pointer) {
+  for (char c : key) {
+    if (c == '~') {
+      pointer += "~0";
+    } else if (c == '/') {
+      pointer += "~1";
+    } else {
+      pointer += c;
+    }
+  }
+}
+
+// MemoryStreamBuf is a std::streambuf reading from memory, which tells how
+// many bytes we have read so far.
+class MemoryStreamBuf : public std::streambuf {
+ public:
+  // MemoryStreamBuf creates a stream buffer reading [@p begin, @p end).
+  MemoryStreamBuf(const char *begin, const char *end) noexcept;
+
+  // offset returns the number of bytes read so far.
+  size_t offset() const noexcept;
+};
+
+MemoryStreamBuf::MemoryStreamBuf(const char *begin, const char *end) noexcept {
+  setg(const_cast<char *>(begin), const_cast<char *>(begin),
+       const_cast<char *>(end));
+}
+
+size_t MemoryStreamBuf::offset() const noexcept {
+  return (size_t)(gptr() - eback());
+}
+
+// JSON::Impl::Builder is the definition of Builder. It follows the SAX
+// interface of nlohmann/json and mimics its DOM builder.
+class JSON::Impl::Builder {
+ public:
+  // failure is the error that occurred, if any.
+  std::string failure;
+
+  // Builder creates a builder that stores the parsed value into @p root
+  // and handles duplicate keys according to @p options.
+  Builder(Value &root, const ParseOptions &options) noexcept;
+
+  // The following methods implement the SAX interface.
+
+  bool null();
+  bool boolean(bool value);
+  bool number_integer(int64_t value);
+  bool number_unsigned(uint64_t value);
+  bool number_float(double value, const std::string &);
+  bool string(std::string &value);
+  bool start_object(size_t);
+  bool key(std::string &value);
+  bool end_object();
+  bool start_array(size_t);
+  bool end_array();
+
+  // binary is only required by newer versions of nlohmann/json. It is
+  // never called when parsing JSON.
+  template <typename Binary>
+  bool binary(Binary &) {
+    return false;
+  }
+
+  template <typename Exception>
+  bool parse_error(size_t position, const std::string &,
+                   const Exception &exc) {
+    failure = exc.what();
+    if (error != nullptr) {
+      // The position counts the bytes read, including the bad one.
+      error->offset = (position > 0) ? position - 1 : 0;
+      error->pointer = pointer();
+    }
+    return false;
+  }
+
+  // error is where to store the details of a failure, if not nullptr.
+  ParseError *error = nullptr;
+
+  // position is where to read the offset from when rejecting a duplicate
+  // key, if not nullptr. See JSON::Impl::locate.
+  const MemoryStreamBuf *position = nullptr;
+
+  // ~Builder returns the parents stack to the pool.
+  ~Builder() noexcept;
+
+ private:
+  // pointer returns the JSON pointer of the value being parsed.
+  std::string pointer() const;
+
+  // insert inserts @p value into the current container and pushes it onto
+  // parents when @p container is true.
+  bool insert(Value &&value, bool container = false);
+
+  // root is where we store the parsed value.
+  Value &root;
+
+  // parents is the stack of the containers being built.
+  std::vector<Value *> parents;
+
+  // slot is where we store the next value of the current object.
+  Value *slot = nullptr;
+
+  // duplicate_keys is the policy for duplicate keys.
+  DuplicateKeys duplicate_keys = DuplicateKeys::last_wins;
+
+  // keys contains, for each container in parents, the key being parsed,
+  // or nullptr for arrays and for objects before their first key.
+  std::vector<const std::string *> keys;
+
+  // discard_next is set when the next value belongs to an ignored
+  // duplicate key and we must not build it.
+  bool discard_next = false;
+
+  // discarded_depth is the number of open containers we are not building
+  // because they belong to an ignored duplicate key.
+  size_t discarded_depth = 0;
+
+  // collected contains the slots of the open objects that we have already
+  // turned into arrays collecting the values of duplicate keys.
+  std::unordered_set<const Value *> collected;
+
+  // collected_owners contains the pairs of object and slot in collected,
+  // in the order in which we collected them, such that end_object can drop
+  // the slots of the object it closes, which are always the last ones.
+  std::vector<std::pair<const Value *, const Value *>> collected_owners;
+};
+
+JSON::Impl::Builder::Builder(Value &r,
+                             const ParseOptions &options) noexcept
+    : root{r}, duplicate_keys{options.duplicate_keys} {
+  Pool *p = pool();
+  if (p != nullptr) {
+    std::swap(parents, p->parents);
+    std::swap(keys, p->keys);
+  }
+}
+
+bool JSON::Impl::Builder::null() { return insert(nullptr); }
+
+bool JSON::Impl::Builder::boolean(bool value) {
+  return insert(Value(value));
+}
+
+bool JSON::Impl::Builder::number_integer(int64_t value) {
+  return insert(Value(value));
+}
+
+bool JSON::Impl::Builder::number_unsigned(uint64_t value) {
+  return insert(Value(value));
+}
+
+bool JSON::Impl::Builder::number_float(double value, const std::string &) {
+  return insert(Value(value));
+}
+
+bool JSON::Impl::Builder::string(std::string &value) {
+  // Swapping gives the parser the capacity of the pooled string.
+  return insert(make_string(std::move(value)));
+}
+
+bool JSON::Impl::Builder::start_object(size_t) {
+  return insert(make(Value::value_t::object), true);
+}
+
+bool JSON::Impl::Builder::key(std::string &value) {
+  if (discarded_depth > 0) return true;
+  auto objectp = parents.back()->get_ptr<Value::object_t *>();
+  auto inserted = objectp->emplace(value, nullptr);
+  slot = &inserted.first->second;
+  keys.back() = &inserted.first->first;
+  if (inserted.second) return true;
+  switch (duplicate_keys) {
+    case DuplicateKeys::last_wins:
+      break;
+    case DuplicateKeys::first_wins:
+      discard_next = true;
+      break;
+    case DuplicateKeys::reject:
+      failure = "Duplicate key: " + value;
+      if (error != nullptr) {
+        error->pointer = pointer();
+        // We have just read the closing quote of the key.
+        if (position != nullptr) error->offset = position->offset() - 1;
+      }
+      return false;
+    case DuplicateKeys::collect: {
+      if (collected.insert(slot).second) {
+        Value array = make(Value::value_t::array);
+        array.get_ptr<Value::array_t *>()->push_back(
+            std::move(*slot));
+        *slot = std::move(array);
+        collected_owners.emplace_back(parents.back(), slot);
+      }
+      auto arrayp = slot->get_ptr<Value::array_t *>();
+      arrayp->push_back(nullptr);
+      slot = &arrayp->back();
+      break;
+    }
+  }
+  return true;
+}
+
+bool JSON::Impl::Builder::end_object() {
+  if (discarded_depth > 0) {
+    --discarded_depth;
+    return true;
+  }
+  while (!collected_owners.empty() &&
+         collected_owners.back().first == parents.back()) {
+    collected.erase(collected_owners.back().second);
+    collected_owners.pop_back();
+  }
+  parents.pop_back();
+  keys.pop_back();
+  return true;
+}
+
+bool JSON::Impl::Builder::start_array(size_t) {
+  return insert(make(Value::value_t::array), true);
+}
+
+bool JSON::Impl::Builder::end_array() {
+  if (discarded_depth > 0) {
+    --discarded_depth;
+    return true;
+  }
+  parents.pop_back();
+  keys.pop_back();
+  return true;
+}
+
+bool JSON::Impl::Builder::insert(Value &&value, bool container) {
+  if (discard_next || discarded_depth > 0) {
+    // We skip the whole value, including nested duplicate keys.
+    discard_next = false;
+    if (container) ++discarded_depth;
+    recycle(value);
+    return true;
+  }
+  Value *target = nullptr;
+  if (parents.empty()) {
+    target = &root;
+    *target = std::move(value);
+  } else if (parents.back()->is_array()) {
+    auto arrayp = parents.back()->get_ptr<Value::array_t *>();
+    arrayp->push_back(std::move(value));
+    target = &arrayp->back();
+  } else {
+    target = slot;
+    *target = std::move(value);
+  }
+  if (container) {
+    parents.push_back(target);
+    keys.push_back(nullptr);
+  }
+  return true;
+}
+
+std::string JSON::Impl::Builder::pointer() const {
+  std::string result;
+  for (size_t i = 0; i < parents.size(); ++i) {
+    if (parents[i]->is_array()) {
+      auto arrayp = parents[i]->get_ptr<const Value::array_t *>();
+      // The innermost array is parsing the element after the last one.
+      bool innermost = (i + 1 >= parents.size());
+      size_t index = innermost ? arrayp->size()
+                               : (size_t)(parents[i + 1] - arrayp->data());
+      result += '/';
+      result += std::to_string(index);
+      continue;
+    }
+    // There is no key when we have not parsed the first one yet.
+    if (keys[i] == nullptr) break;
+    result += '/';
+    escape(*keys[i], result);
+  }
+  return result;
+}
+
+JSON::Impl::Builder::~Builder() noexcept {
+  Pool *p = pool();
+  if (p != nullptr && p->parents.capacity() < parents.capacity()) {
+    parents.clear();
+    std::swap(parents, p->parents);
+  }
+  if (p != nullptr && p->keys.capacity() < keys.capacity()) {
+    keys.clear();
+    std::swap(keys, p->keys);
+  }
+}
+
+/*static*/ void JSON::Impl::locate(ParseError &error,
+                                   const ParseOptions &options,
+                                   const char *begin, const char *end) {
+  // We only reach this point when rejecting a duplicate key, since syntax
+  // errors already tell the offset. Reading a streambuf is slower than
+  // reading memory directly, hence we do this only on failure.
+  MemoryStreamBuf streambuf{begin, end};
+  std::istream stream{&streambuf};
+  Value root;
+  Builder builder{root, options};
+  builder.position = &streambuf;
+  ParseError located;
+  builder.error = &located;
+  if (!Value::sax_parse(stream, &builder)) error.offset = located.offset;
+  recycle(root);
+}
+
+template <typename... Input>
+/*static*/ void JSON::Impl::parse(Value &value,
+                                 const ParseOptions &options,
+                                 ParseError *error, Input &&... input) {
+  MemoryScope scope{options.memory_resource};
+  Value root;
+  Builder builder{root, options};
+  builder.error = error;
+  if (!Value::sax_parse(std::forward<Input>(input)..., &builder)) {
+    recycle(root);
+    if (error != nullptr && error->offset == ParseError::npos) {
+      locate(*error, options, input...);
+    }
+    throw std::runtime_error{builder.failure};
+  }
+  recycle(value);
+  std::swap(value, root);
+}
+
+/*static*/ size_t JSON::Impl::memory_usage(const std::string &str) noexcept {
+  static const size_t inline_capacity = std::string{}.capacity();
+  return (str.capacity() > inline_capacity) ? str.capacity() + 1 : 0;
+}
+
+/*static*/ size_t JSON::Impl::memory_usage(
+    const Value &value) noexcept {
+  // Each std::map node also contains the red-black tree links and color.
+  constexpr size_t map_node_overhead = 4 * sizeof(void *);
+  // Each allocation made through Allocator is preceded by its header.
+  constexpr size_t header = AllocatorBase::header_size;
+  size_t total = 0;
+  switch (value.type()) {
+    case Value::value_t::object: {
+      auto objectp = value.get_ptr<const Value::object_t *>();
+      total += header + sizeof(*objectp);
+      for (auto &entry : *objectp) {
+        total += header + sizeof(entry) + map_node_overhead;
+        total += memory_usage(entry.first);
+        total += memory_usage(entry.second);
+      }
+      break;
+    }
+    case Value::value_t::array: {
+      auto arrayp = value.get_ptr<const Value::array_t *>();
+      total += header + sizeof(*arrayp);
+      if (arrayp->capacity() > 0) {
+        total += header + arrayp->capacity() * sizeof(Value);
+      }
+      for (auto &entry : *arrayp) {
+        total += memory_usage(entry);
+      }
+      break;
+    }
+    case Value::value_t::string: {
+      auto stringp = value.get_ptr<const std::string *>();
+      total += header + sizeof(*stringp) + memory_usage(*stringp);
+      break;
+    }
+    default:
+      break;  // Scalars are stored inline
+  }
+  return total;
+}
+
+/*static*/ void JSON::Impl::shrink_to_fit(Value &value) {
+  switch (value.type()) {
+    case Value::value_t::object:
+      // Keys are const inside std::map, hence we only shrink the values.
+      for (auto &entry : *value.get_ptr<Value::object_t *>()) {
+        shrink_to_fit(entry.second);
+      }
+      break;
+    case Value::value_t::array: {
+      auto arrayp = value.get_ptr<Value::array_t *>();
+      arrayp->shrink_to_fit();
+      for (auto &entry : *arrayp) {
+        shrink_to_fit(entry);
+      }
+      break;
+    }
+    case Value::value_t::string:
+      value.get_ptr<std::string *>()->shrink_to_fit();
+      break;
+    default:
+      break;
+  }
+}
+
+// JSON::Friend is the definition of the class friend of JSON.
+class JSON::Friend {
+ public:
+  // unwrap allows to unwrap a JSON to get the inner Value.
+  static Value &unwrap(JSON &json) noexcept;
+
+  // write allows to use JSON::Impl::write.
+  static void write(const JSON &json, std::ostream &stream);
+
+  // dump allows to use JSON::Impl::dump.
+  static void dump(const JSON &json, std::string &out);
+
+  // format_int64 allows to use JSON::Impl::format_int64.
+  static char *format_int64(int64_t value, char *end) noexcept;
+
+  // Builder allows to use JSON::Impl::Builder.
+  using Builder = JSON::Impl::Builder;
+
+  // parse allows to use JSON::Impl::parse_packed and JSON::Impl::parse
+  // for parsing [@p begin, @p end) into @p json using @p options. On
+  // failure, it fills @p error, if not nullptr, and throws.
+  static void parse(JSON &json, const char *begin, const char *end,
+                    const ParseOptions &options, ParseError *error);
+};
+
+/*static*/ void JSON::Friend::parse(JSON &json, const char *begin,
+                                   const char *end,
+                                   const ParseOptions &options,
+                                   ParseError *error) {
+  json.impl->resource = options.memory_resource;
+  if (json.impl->parse_packed(begin, end)) return;
+  try {
+    JSON::Impl::parse(json.impl->nlohmann_json, options, error, begin, end);
+  } catch (const std::exception &) {
+    if (error != nullptr) JSON::Impl::describe(*error, begin, end);
+    throw;
+  }
+}
+
+/*static*/ Value &JSON::Friend::unwrap(JSON &json) noexcept {
+  MemoryScope scope{json.impl->resource};
+  return json.impl->value();
+}
+
+/*static*/ void JSON::Friend::write(const JSON &json, std::ostream &stream) {
+  json.impl->write(stream);
+}
+
+/*static*/ void JSON::Friend::dump(const JSON &json, std::string &out) {
+  json.impl->dump(out);
+}
+
+/*static*/ char *JSON::Friend::format_int64(int64_t value, char *end) noexcept {
+  return JSON::Impl::format_int64(value, end);
+}
+
+/*explicit*/ JSON::JSON(Impl &&other_impl) noexcept : JSON{} {
+  std::swap(other_impl, *impl);
+}
+
+/*static*/ Result<JSON> JSON::parse(const std::string &json_str) noexcept {
+  return parse(json_str, ParseOptions{});
+}
+
+/*static*/ Result<JSON> JSON::parse(const std::string &json_str,
+                                   const ParseOptions &options) noexcept {
+  Result<JSON> result;
+  result.value.impl->resource = options.memory_resource;
+  try {
+    if (!result.value.impl->parse_packed(
+            json_str.data(), json_str.data() + json_str.size())) {
+      JSON::Impl::parse(result.value.impl->nlohmann_json, options, nullptr,
+                        json_str);
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+/*static*/ Result<JSON> JSON::parse(const std::string &json_str,
+                                   BufferResource &buffer) noexcept {
+  ParseOptions options;
+  options.memory_resource = &buffer;
+  return parse(json_str, options);
+}
+
+/*static*/ Result<JSON> JSON::parse(const std::string &json_str,
+                                   const ParseOptions &options,
+                                   ParseError &error) noexcept {
+  Result<JSON> result;
+  result.value.impl->resource = options.memory_resource;
+  error = ParseError{};
+  const char *begin = json_str.data();
+  const char *end = begin + json_str.size();
+  try {
+    if (!result.value.impl->parse_packed(begin, end)) {
+      try {
+        JSON::Impl::parse(result.value.impl->nlohmann_json, options, &error,
+                          begin, end);
+      } catch (const std::exception &) {
+        JSON::Impl::describe(error, begin, end);
+        throw;
+      }
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<std::string> JSON::dump() const noexcept {
+  Result<std::string> result;
+  try {
+    impl->dump(result.value);
+  } catch (const std::exception &exc) {
+    result.value.clear();
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+/*static*/ Result<JSON> JSON::load_snapshot(const void *data,
+                                           size_t size) noexcept {
+  Result<JSON> result;
+  auto base = static_cast<const uint8_t *>(data);
+  if (base == nullptr || size < JSON::Impl::snapshot_header_size ||
+      memcmp(base, JSON::Impl::snapshot_magic,
+             sizeof(JSON::Impl::snapshot_magic)) != 0) {
+    result.good = false;
+    result.failure = "Not a snapshot";
+    return result;
+  }
+  uint64_t payload_size = 0;
+  uint64_t payload_checksum = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    payload_size |= uint64_t{base[8 + i]} << (8 * i);
+    payload_checksum |= uint64_t{base[16 + i]} << (8 * i);
+  }
+  const uint8_t *payload = base + JSON::Impl::snapshot_header_size;
+  if (payload_size != size - JSON::Impl::snapshot_header_size ||
+      payload_checksum != JSON::Impl::checksum(payload, (size_t)payload_size)) {
+    result.good = false;
+    result.failure = "Corrupt snapshot";
+    return result;
+  }
+  try {
+    result.value.impl->nlohmann_json = Value::from_cbor(
+        payload, payload + payload_size);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<std::string> JSON::dump_snapshot() const noexcept {
+  Result<std::string> result;
+  try {
+    result.value.append(JSON::Impl::snapshot_magic,
+                        sizeof(JSON::Impl::snapshot_magic));
+    result.value.append(16, '\0');  // Filled below
+    if (impl->packed) {
+      Value::to_cbor(impl->unpacked(), result.value);
+    } else {
+      Value::to_cbor(impl->nlohmann_json, result.value);
+    }
+    size_t payload_size = result.value.size() - JSON::Impl::snapshot_header_size;
+    uint64_t payload_checksum = JSON::Impl::checksum(
+        (const uint8_t *)result.value.data() + JSON::Impl::snapshot_header_size,
+        payload_size);
+    for (size_t i = 0; i < 8; ++i) {
+      result.value[8 + i] = (char)(uint8_t)(uint64_t{payload_size} >> (8 * i));
+      result.value[16 + i] = (char)(uint8_t)(payload_checksum >> (8 * i));
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    result.value.clear();
+  }
+  return result;
+}
+
+JSON::JSON() noexcept { impl.reset(new JSON::Impl); }
+
+/*explicit*/ JSON::Key::Key(std::string k) noexcept : key{std::move(k)} {}
+
+const std::string &JSON::Key::str() const noexcept { return key; }
+
+/*explicit*/ JSON::JSON(MemoryResource *resource) noexcept : JSON{} {
+  impl->resource = resource;
+}
+
+MemoryResource *JSON::memory_resource() const noexcept {
+  return impl->resource;
+}
+
+JSON::JSON(JSON &&other) noexcept : JSON{} {
+  std::swap(impl, other.impl);
+}
+
+JSON &JSON::operator=(JSON &&other) noexcept {
+  std::swap(impl, other.impl);
+  return *this;
+}
+
+bool JSON::is_array() const noexcept {
+  return impl->packed || impl->nlohmann_json.is_array();
+}
+
+bool JSON::is_boolean() const noexcept {
+  return impl->nlohmann_json.is_boolean();
+}
+
+bool JSON::is_float64() const noexcept {
+  return impl->nlohmann_json.is_number_float();
+}
+
+bool JSON::is_int64() const noexcept {
+  return impl->nlohmann_json.is_number_integer();
+}
+
+bool JSON::is_null() const noexcept {
+  return !impl->packed && impl->nlohmann_json.is_null();
+}
+
+bool JSON::is_object() const noexcept {
+  return impl->nlohmann_json.is_object();
+}
+
+bool JSON::is_string() const noexcept {
+  return impl->nlohmann_json.is_string();
+}
+
+Result<JSON> JSON::get_value_at(const std::string &key) noexcept {
+  Result<JSON> result;
+  MemoryScope scope{impl->resource};
+  result.value.impl->resource = impl->resource;
+  try {
+    // Use the iterator for erasing, to avoid looking up the key twice.
+    auto objectp = impl->value().get_ptr<Value::object_t *>();
+    if (objectp == nullptr) {
+      result.good = false;
+      result.failure = "Not an object";
+      return result;
+    }
+    auto it = objectp->find(key);
+    if (it == objectp->end()) {
+      result.good = false;
+      result.failure = "No such key: " + key;
+      return result;
+    }
+    result.value.impl->nlohmann_json = std::move(it->second);
+    objectp->erase(it);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<JSON> JSON::get_value_at(const Key &key) noexcept {
+  return get_value_at(key.str());
+}
+
+Result<std::vector<JSON>> JSON::get_value_array() noexcept {
+  Result<std::vector<JSON>> result;
+  MemoryScope scope{impl->resource};
+  Value::array_t *valuep = nullptr;
+  try {
+    valuep = impl->value().get_ptr<Value::array_t *>();
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not an array";
+    return result;
+  }
+  try {
+    result.value.reserve(valuep->size());
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  for (Value &entry : *valuep) {
+    result.value.push_back(JSON{JSON::Impl{std::move(entry)}});
+    result.value.back().impl->resource = impl->resource;
+  }
+  JSON::Impl::recycle(impl->nlohmann_json);
+  return result;
+}
+
+Result<std::vector<double>> JSON::get_value_array_float64() noexcept {
+  return JSON::Impl::get_value_array_of<double>(*impl,
+                                                "Not an array of float64");
+}
+
+Result<std::vector<int64_t>> JSON::get_value_array_int64() noexcept {
+  return JSON::Impl::get_value_array_of<int64_t>(*impl,
+                                                 "Not an array of int64");
+}
+
+Result<std::vector<std::string>> JSON::get_value_array_string() noexcept {
+  return JSON::Impl::get_value_array_of<std::string>(
+      *impl, "Not an array of string");
+}
+
+Result<bool> JSON::get_value_boolean() noexcept {
+  Result<bool> result;
+  auto valuep = impl->nlohmann_json.get_ptr<bool *>();
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not a boolean";
+    return result;
+  }
+  result.value = *valuep;
+  impl->nlohmann_json = nullptr;
+  return result;
+}
+
+Result<double> JSON::get_value_float64() noexcept {
+  Result<double> result;
+  auto valuep = impl->nlohmann_json.get_ptr<double *>();
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not a float64";
+    return result;
+  }
+  result.value = *valuep;
+  impl->nlohmann_json = nullptr;
+  return result;
+}
+
+Result<int64_t> JSON::get_value_int64() noexcept {
+  Result<int64_t> result;
+  auto valuep = impl->nlohmann_json.get_ptr<int64_t *>();
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not an int64";
+    return result;
+  }
+  result.value = *valuep;
+  impl->nlohmann_json = nullptr;
+  return result;
+}
+
+Result<std::map<std::string, JSON>> JSON::get_value_object() noexcept {
+  Result<std::map<std::string, JSON>> result;
+  MemoryScope scope{impl->resource};
+  Value::object_t *valuep = nullptr;
+  try {
+    valuep = impl->value().get_ptr<Value::object_t *>();
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not an object";
+    return result;
+  }
+  for (auto &entry : *valuep) {
+    JSON &member = result.value[entry.first];
+    member.impl->nlohmann_json = std::move(entry.second);
+    member.impl->resource = impl->resource;
+  }
+  JSON::Impl::recycle(impl->nlohmann_json);
+  return result;
+}
+
+Result<std::string> JSON::get_value_string() noexcept {
+  Result<std::string> result;
+  auto valuep = impl->nlohmann_json.get_ptr<std::string *>();
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not a string";
+    return result;
+  }
+  std::swap(result.value, *valuep);
+  JSON::Impl::recycle(impl->nlohmann_json);
+  return result;
+}
+
+Result<void> JSON::append_value_string(std::string &buffer) noexcept {
+  Result<void> result;
+  auto valuep = impl->nlohmann_json.get_ptr<std::string *>();
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not a string";
+    return result;
+  }
+  try {
+    buffer.append(*valuep);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  JSON::Impl::recycle(impl->nlohmann_json);
+  return result;
+}
+
+Result<void> JSON::set_value_at(const std::string &key, JSON &&value) noexcept {
+  Result<void> result;
+  MemoryScope scope{impl->resource};
+  try {
+    std::swap(value.impl->value(), impl->value()[key]);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<void> JSON::set_value_at(const Key &key, JSON &&value) noexcept {
+  return set_value_at(key.str(), std::move(value));
+}
+
+void JSON::set_value_array(std::vector<JSON> &&value) noexcept {
+  MemoryScope scope{impl->resource};
+  Value array = JSON::Impl::make(Value::value_t::array);
+  auto arrayp = array.get_ptr<Value::array_t *>();
+  arrayp->reserve(value.size());
+  for (JSON &entry : value) {
+    arrayp->push_back(std::move(entry.impl->value()));
+  }
+  impl->reset();
+  impl->nlohmann_json = std::move(array);
+}
+
+void JSON::set_value_array_float64(std::vector<double> &&value) noexcept {
+  impl->pack(std::move(value));
+}
+
+void JSON::set_value_array_int64(std::vector<int64_t> &&value) noexcept {
+  impl->pack(std::move(value));
+}
+
+void JSON::set_value_array_string(std::vector<std::string> &&value) noexcept {
+  JSON::Impl::set_value_array_of(*impl, std::move(value));
+}
+
+void JSON::set_value_boolean(bool value) noexcept {
+  impl->reset();
+  impl->nlohmann_json = value;
+}
+
+void JSON::set_value_float64(double value) noexcept {
+  impl->reset();
+  impl->nlohmann_json = value;
+}
+
+void JSON::set_value_int64(int64_t value) noexcept {
+  impl->reset();
+  impl->nlohmann_json = value;
+}
+
+void JSON::set_value_object(std::map<std::string, JSON> &&value) noexcept {
+  MemoryScope scope{impl->resource};
+  Value object = JSON::Impl::make(Value::value_t::object);
+  auto objectp = object.get_ptr<Value::object_t *>();
+  for (auto &entry : value) {
+    (*objectp)[entry.first] = std::move(entry.second.impl->value());
+  }
+  impl->reset();
+  impl->nlohmann_json = std::move(object);
+}
+
+void JSON::set_value_string(std::string &&value) noexcept {
+  MemoryScope scope{impl->resource};
+  impl->reset();
+  impl->nlohmann_json = JSON::Impl::make_value(std::move(value));
+}
+
+/*static*/ constexpr char JSON::Impl::snapshot_magic[8];
+
+/*static*/ uint64_t JSON::Impl::checksum(const uint8_t *data,
+                                         size_t size) noexcept {
+  constexpr uint64_t basis = 14695981039346656037ULL;
+  constexpr uint64_t prime = 1099511628211ULL;
+  uint64_t lanes[4] = {basis, basis, basis, basis};
+  size_t offset = 0;
+  for (; size - offset >= sizeof(lanes); offset += sizeof(lanes)) {
+    for (size_t i = 0; i < 4; ++i) {
+      uint64_t word = 0;
+      memcpy(&word, data + offset + i * sizeof(word), sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      lanes[i] = (lanes[i] ^ word) * prime;
+    }
+  }
+  uint64_t hash = basis;
+  for (uint64_t lane : lanes) hash = (hash ^ lane) * prime;
+  for (; offset < size; ++offset) hash = (hash ^ data[offset]) * prime;
+  return hash;
+}
+
+/*static*/ Value JSON::Impl::relocate(const Value &value) {
+  switch (value.type()) {
+    case Value::value_t::object: {
+      Value result = Value::object();
+      auto objectp = result.get_ptr<Value::object_t *>();
+      for (auto &entry : *value.get_ptr<const Value::object_t *>()) {
+        objectp->emplace_hint(objectp->end(), entry.first,
+                              relocate(entry.second));
+      }
+      return result;
+    }
+    case Value::value_t::array: {
+      Value result = Value::array();
+      auto arrayp = result.get_ptr<Value::array_t *>();
+      auto &entries = *value.get_ptr<const Value::array_t *>();
+      arrayp->reserve(entries.size());
+      for (auto &entry : entries) {
+        arrayp->push_back(relocate(entry));
+      }
+      return result;
+    }
+    case Value::value_t::string:
+      return Value(std::string{*value.get_ptr<const std::string *>()});
+    default:
+      return value;  // Scalars do not own any heap memory
+  }
+}
+
+size_t JSON::memory_usage() const noexcept {
+  size_t total = sizeof(JSON::Impl);
+  if (impl->packed) {
+    total += sizeof(JSON::Impl::Packed);
+    total += impl->packed->int64.capacity() * sizeof(int64_t);
+    total += impl->packed->float64.capacity() * sizeof(double);
+  }
+  return total + JSON::Impl::memory_usage(impl->nlohmann_json);
+}
+
+void JSON::shrink_to_fit() noexcept {
+  try {
+    if (impl->packed) {
+      impl->packed->int64.shrink_to_fit();
+      impl->packed->float64.shrink_to_fit();
+    }
+    JSON::Impl::shrink_to_fit(impl->nlohmann_json);
+  } catch (const std::exception &) {
+    // Shrinking reallocates and may fail; the JSON is still valid.
+  }
+}
+
+Result<void> JSON::compact() noexcept {
+  Result<void> result;
+  try {
+    // The nodes fit into memory_usage bytes, which also counts the unused
+    // capacity and the strings, which std::string allocates on its own.
+    size_t size = JSON::Impl::memory_usage(impl->nlohmann_json);
+    if (size > 0) {
+      std::unique_ptr<JSON::Impl::Arena, JSON::Impl::ArenaRelease> arena{
+          new JSON::Impl::Arena{impl->resource, size}};
+      // Only replace the tree once the copy is complete, so that a failure
+      // midway leaves the original tree untouched.
+      Value relocated;
+      {
+        MemoryScope scope{arena.get()};
+        relocated = JSON::Impl::relocate(impl->nlohmann_json);
+      }
+      std::swap(relocated, impl->nlohmann_json);
+      std::swap(arena, impl->arena);
+    }
+    if (impl->packed) {
+      // Packed arrays are already contiguous and just need exact sizing.
+      std::vector<int64_t>{impl->packed->int64}.swap(impl->packed->int64);
+      std::vector<double>{impl->packed->float64}.swap(impl->packed->float64);
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+JSON::~JSON() noexcept {
+  if (impl != nullptr) JSON::Impl::recycle(impl->nlohmann_json);
+}
+
+Result<void> JSON::append_array(JSON &&other) noexcept {
+  Result<void> result;
+  if (!is_array() || !other.is_array()) {
+    result.good = false;
+    result.failure = "Not an array";
+    return result;
+  }
+  MemoryScope scope{impl->resource};
+  try {
+    size_t size = (impl->packed) ? impl->packed->size()
+                                 : impl->nlohmann_json.size();
+    if (size <= 0) {
+      std::swap(impl->nlohmann_json, other.impl->nlohmann_json);
+      std::swap(impl->packed, other.impl->packed);
+    } else if (!impl->append_packed(*other.impl)) {
+      Value::array_t &mine = *impl->value().get_ptr<Value::array_t *>();
+      const JSON::Impl::Packed *theirs_packed = other.impl->packed.get();
+      if (theirs_packed != nullptr) {
+        // Create the nodes directly into our array.
+        mine.reserve(mine.size() + theirs_packed->size());
+        for (int64_t entry : theirs_packed->int64) mine.push_back(Value(entry));
+        for (double entry : theirs_packed->float64) mine.push_back(Value(entry));
+      } else {
+        Value::array_t &theirs =
+            *other.impl->nlohmann_json.get_ptr<Value::array_t *>();
+        mine.reserve(mine.size() + theirs.size());
+        for (Value &entry : theirs) mine.push_back(std::move(entry));
+      }
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  other.impl->reset();
+  return result;
+}
+
+Result<void> JSON::merge_object(JSON &&other) noexcept {
+  Result<void> result;
+  auto minep = impl->nlohmann_json.get_ptr<Value::object_t *>();
+  auto theirsp = other.impl->nlohmann_json.get_ptr<Value::object_t *>();
+  if (minep == nullptr || theirsp == nullptr) {
+    result.good = false;
+    result.failure = "Not an object";
+    return result;
+  }
+  MemoryScope scope{impl->resource};
+  try {
+    if (minep->size() < theirsp->size()) {
+      std::swap(*minep, *theirsp);
+      JSON::Impl::merge(*minep, *theirsp, false);
+    } else {
+      JSON::Impl::merge(*minep, *theirsp, true);
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  other.impl->reset();
+  return result;
+}
+
+Result<void> JSON::sort_by(const std::string &pointer,
+                           SortOrder order) noexcept {
+  return partial_sort_top_k(pointer, order, SIZE_MAX);
+}
+
+Result<void> JSON::partial_sort_top_k(const std::string &pointer,
+                                      SortOrder order, size_t k) noexcept {
+  Result<void> result;
+  if (!is_array()) {
+    result.good = false;
+    result.failure = "Not an array";
+    return result;
+  }
+  try {
+    impl->sort(pointer, order, k);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<void> JSON::filter(
+    const std::function<bool(const View &)> &predicate) noexcept {
+  Result<void> result;
+  if (!is_array()) {
+    result.good = false;
+    result.failure = "Not an array";
+    return result;
+  }
+  std::vector<char> keep;
+  try {
+    View view;
+    if (impl->packed) {
+      // Give the predicate a scalar node for each element, rather than
+      // converting the packed array into nodes.
+      Value node;
+      view.node = &node;
+      keep.reserve(impl->packed->size());
+      for (int64_t entry : impl->packed->int64) {
+        node = entry;
+        keep.push_back(predicate(view));
+      }
+      for (double entry : impl->packed->float64) {
+        node = entry;
+        keep.push_back(predicate(view));
+      }
+    } else {
+      auto &elements = *impl->nlohmann_json.get_ptr<Value::array_t *>();
+      keep.reserve(elements.size());
+      for (const Value &entry : elements) {
+        view.node = &entry;
+        keep.push_back(predicate(view));
+      }
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  impl->retain(keep);
+  return result;
+}
+
+Result<View> JSON::view() noexcept {
+  Result<View> result;
+  MemoryScope scope{impl->resource};
+  try {
+    result.value.node = &impl->value();
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+View::View() noexcept {}
+
+Result<View> View::at(const std::string &key) const noexcept {
+  Result<View> result;
+  auto objectp = (node != nullptr)
+                     ? static_cast<const Value *>(node)
+                           ->get_ptr<const Value::object_t *>()
+                     : nullptr;
+  if (objectp == nullptr) {
+    result.good = false;
+    result.failure = "Not an object";
+    return result;
+  }
+  auto it = objectp->find(key);
+  if (it == objectp->end()) {
+    result.good = false;
+    result.failure = "No such key: " + key;
+    return result;
+  }
+  result.value.node = &it->second;
+  return result;
+}
+
+Result<View> View::at(const JSON::Key &key) const noexcept {
+  return at(key.str());
+}
+
+Result<View> View::at(size_t index) const noexcept {
+  Result<View> result;
+  auto arrayp = (node != nullptr)
+                    ? static_cast<const Value *>(node)
+                          ->get_ptr<const Value::array_t *>()
+                    : nullptr;
+  if (arrayp == nullptr) {
+    result.good = false;
+    result.failure = "Not an array";
+    return result;
+  }
+  if (index >= arrayp->size()) {
+    result.good = false;
+    result.failure = "Index out of range";
+    return result;
+  }
+  result.value.node = &(*arrayp)[index];
+  return result;
+}
+
+Result<void> detail::all_members(
+    const View &view,
+    const std::function<Result<void>(const View &)> &check) noexcept {
+  Result<void> result;
+  auto objectp = (view.node != nullptr)
+                     ? static_cast<const Value *>(view.node)
+                           ->get_ptr<const Value::object_t *>()
+                     : nullptr;
+  if (objectp == nullptr) {
+    result.good = false;
+    result.failure = "Not an object";
+    return result;
+  }
+  try {
+    for (auto &entry : *objectp) {
+      View member;
+      member.node = &entry.second;
+      result = check(member);
+      if (!result.good) break;
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+size_t View::size() const noexcept {
+  if (node == nullptr) return 0;
+  auto valuep = static_cast<const Value *>(node);
+  return (valuep->is_array() || valuep->is_object()) ? valuep->size() : 0;
+}
+
+bool View::is_array() const noexcept {
+  return node != nullptr && static_cast<const Value *>(node)->is_array();
+}
+
+bool View::is_boolean() const noexcept {
+  return node != nullptr && static_cast<const Value *>(node)->is_boolean();
+}
+
+bool View::is_float64() const noexcept {
+  return node != nullptr &&
+         static_cast<const Value *>(node)->is_number_float();
+}
+
+bool View::is_int64() const noexcept {
+  return node != nullptr &&
+         static_cast<const Value *>(node)->is_number_integer();
+}
+
+bool View::is_null() const noexcept {
+  return node == nullptr || static_cast<const Value *>(node)->is_null();
+}
+
+bool View::is_object() const noexcept {
+  return node != nullptr && static_cast<const Value *>(node)->is_object();
+}
+
+bool View::is_string() const noexcept {
+  return node != nullptr && static_cast<const Value *>(node)->is_string();
+}
+
+Result<bool> View::get_value_boolean() const noexcept {
+  Result<bool> result;
+  auto valuep = (node != nullptr)
+                    ? static_cast<const Value *>(node)->get_ptr<const bool *>()
+                    : nullptr;
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not a boolean";
+    return result;
+  }
+  result.value = *valuep;
+  return result;
+}
+
+Result<double> View::get_value_float64() const noexcept {
   Result<double> result;
-  auto valuep = impl->nlohmann_json.get_ptr<double *>();
+  auto valuep = (node != nullptr) ? static_cast<const Value *>(node)
+                                        ->get_ptr<const double *>()
+                                  : nullptr;
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not a float64";
+    return result;
+  }
+  result.value = *valuep;
+  return result;
+}
+
+Result<int64_t> View::get_value_int64() const noexcept {
+  Result<int64_t> result;
+  auto valuep = (node != nullptr) ? static_cast<const Value *>(node)
+                                        ->get_ptr<const int64_t *>()
+                                  : nullptr;
+  if (valuep == nullptr) {
+    result.good = false;
+    result.failure = "Not an int64";
+    return result;
+  }
+  result.value = *valuep;
+  return result;
+}
+
+Result<std::string> View::get_value_string() const noexcept {
+  Result<std::string> result;
+  Result<void> appended = append_value_string(result.value);
+  result.good = appended.good;
+  std::swap(result.failure, appended.failure);
+  return result;
+}
+
+Result<void> View::append_value_string(std::string &buffer) const noexcept {
+  Result<void> result;
+  auto valuep = (node != nullptr) ? static_cast<const Value *>(node)
+                                        ->get_ptr<const std::string *>()
+                                  : nullptr;
   if (valuep == nullptr) {
     result.good = false;
-    result.failure = "Not a float64";
-    return result;
+    result.failure = "Not a string";
+    return result;
+  }
+  try {
+    buffer.append(*valuep);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<std::string> View::dump() const noexcept {
+  Result<std::string> result;
+  try {
+    result.value = (node != nullptr) ? static_cast<const Value *>(node)->dump()
+                                     : "null";
+  } catch (const std::exception &exc) {
+    result.value.clear();
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+// Chunk is a chunk of data returned by a ChunkReader.
+class Chunk {
+ public:
+  // data is the beginning of the data.
+  const char *data = nullptr;
+
+  // size is the size of the data.
+  size_t size = 0;
+
+  // stream is the index of the stream containing the data. For example, the
+  // index of the file, when reading many files. Each stream is a complete
+  // (and possibly compressed) JSONL document.
+  size_t stream = 0;
+};
+
+// ChunkReader is the interface of the readers used by JSONLReader.
+class ChunkReader {
+ public:
+  // next returns the next chunk of data, which is valid until the next call
+  // of next. Returns false on end of file or error (see failed).
+  virtual bool next(Chunk &chunk) noexcept = 0;
+
+  // failed tells you whether reading failed with an error.
+  virtual bool failed() const noexcept = 0;
+
+  // ~ChunkReader destroys the allocated resources.
+  virtual ~ChunkReader() noexcept;
+};
+
+ChunkReader::~ChunkReader() noexcept {}
+
+// FdReader reads from a file descriptor using two buffers. While the caller
+// is consuming one buffer, a background thread fills the other one.
+class FdReader : public ChunkReader {
+ public:
+  // buffer_size is the size of each buffer.
+  static constexpr size_t buffer_size = 1 << 20;
+
+  // buffer_alignment is the alignment of each buffer.
+  static constexpr size_t buffer_alignment = 4096;
+
+  // FdReader creates a reader for @p fd, which is not owned.
+  explicit FdReader(int fd) noexcept;
+
+  // next implements ChunkReader::next.
+  bool next(Chunk &chunk) noexcept override;
+
+  // failed implements ChunkReader::failed.
+  bool failed() const noexcept override;
+
+  // ~FdReader waits for the background thread to terminate.
+  ~FdReader() noexcept override;
+
+ private:
+  // read_once reads once into the buffer at @p index.
+  void read_once(size_t index) noexcept;
+
+  // loop is the main loop of the background thread.
+  void loop() noexcept;
+
+  // fd is the file descriptor.
+  int fd = -1;
+
+  // storage contains both buffers plus space for aligning them.
+  std::unique_ptr<char[]> storage;
+
+  // buffers are the aligned buffers.
+  char *buffers[2] = {nullptr, nullptr};
+
+  // sizes are the number of bytes in each buffer.
+  size_t sizes[2] = {0, 0};
+
+  // filled tells whether each buffer is ready to be consumed.
+  bool filled[2] = {false, false};
+
+  // current is the index of the next buffer to consume.
+  size_t current = 0;
+
+  // consuming tells whether the caller holds a buffer.
+  bool consuming = false;
+
+  // done tells whether we've reached end of file or an error.
+  bool done = false;
+
+  // error tells whether we've got an error.
+  bool error = false;
+
+  // stop tells the background thread to stop.
+  bool stop = false;
+
+  // mutex protects the fields shared with the background thread.
+  mutable std::mutex mutex;
+
+  // cond is used to wait for a buffer to be filled or released.
+  std::condition_variable cond;
+
+  // thread is the background thread, if we could start it.
+  std::thread thread;
+};
+
+/*static*/ constexpr size_t FdReader::buffer_size;
+/*static*/ constexpr size_t FdReader::buffer_alignment;
+
+/*explicit*/ FdReader::FdReader(int fd_) noexcept : fd{fd_} {
+  try {
+    storage.reset(new char[2 * buffer_size + buffer_alignment]);
+  } catch (const std::exception &) {
+    done = error = true;
+    return;
+  }
+  auto base = reinterpret_cast<uintptr_t>(storage.get());
+  base = (base + buffer_alignment - 1) & ~uintptr_t{buffer_alignment - 1};
+  buffers[0] = reinterpret_cast<char *>(base);
+  buffers[1] = buffers[0] + buffer_size;
+#if defined __linux__
+  // Just a hint. Fails with ESPIPE for pipes and sockets, which is fine.
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  try {
+    thread = std::thread{&FdReader::loop, this};
+  } catch (const std::exception &) {
+    // We will read synchronously in next().
+  }
+}
+
+void FdReader::read_once(size_t index) noexcept {
+  for (;;) {
+#ifdef _WIN32
+    int n = _read(fd, buffers[index], (unsigned int)buffer_size);
+#else
+    ssize_t n = read(fd, buffers[index], buffer_size);
+    if (n < 0 && errno == EINTR) continue;
+#endif
+    std::unique_lock<std::mutex> lock{mutex};
+    sizes[index] = (n > 0) ? (size_t)n : 0;
+    filled[index] = true;
+    error = (n < 0);
+    done = (n <= 0);
+    cond.notify_all();
+    return;
+  }
+}
+
+void FdReader::loop() noexcept {
+  for (size_t index = 0;; index ^= 1) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      cond.wait(lock, [&]() { return stop || !filled[index]; });
+      if (stop || done) return;
+    }
+    read_once(index);
+  }
+}
+
+bool FdReader::next(Chunk &chunk) noexcept {
+  if (buffers[0] == nullptr) return false;
+  std::unique_lock<std::mutex> lock{mutex};
+  if (consuming) {
+    // Release the buffer consumed by the caller so it can be filled again.
+    filled[current] = false;
+    sizes[current] = 0;
+    current ^= 1;
+    consuming = false;
+    cond.notify_all();
+  }
+  if (!thread.joinable() && !done) {
+    lock.unlock();
+    read_once(current);
+    lock.lock();
+  }
+  cond.wait(lock, [&]() { return filled[current]; });
+  if (!filled[current] || sizes[current] <= 0) return false;
+  chunk.data = buffers[current];
+  chunk.size = sizes[current];
+  chunk.stream = 0;
+  consuming = true;
+  return true;
+}
+
+bool FdReader::failed() const noexcept {
+  std::unique_lock<std::mutex> lock{mutex};
+  return error;
+}
+
+FdReader::~FdReader() noexcept {
+  if (thread.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      stop = true;
+      cond.notify_all();
+    }
+    thread.join();
+  }
+}
+
+// FilesReader reads a list of files in order. Each file is a distinct stream
+// (see Chunk::stream). Files are read in chunks
+// into a ring of slots. With io_uring, reads for all the slots are in flight
+// while the caller consumes the oldest slot. Otherwise, each slot is read
+// synchronously when the caller needs it.
+class FilesReader : public ChunkReader {
+ public:
+  // queue_depth is the number of slots, i.e. the maximum number of reads
+  // that are in flight at any given time.
+  static constexpr size_t queue_depth = 32;
+
+  // chunk_size is the size of each slot.
+  static constexpr size_t chunk_size = 256 << 10;
+
+  // FilesReader creates a reader for the files at @p paths.
+  explicit FilesReader(const std::vector<std::string> &paths) noexcept;
+
+  // next implements ChunkReader::next.
+  bool next(Chunk &chunk) noexcept override;
+
+  // failed implements ChunkReader::failed.
+  bool failed() const noexcept override;
+
+  // uses_io_uring tells whether the files are read using io_uring.
+  bool uses_io_uring() const noexcept;
+
+  // ~FilesReader waits for the reads in flight and closes all files.
+  ~FilesReader() noexcept override;
+
+ private:
+  // File is a file to read.
+  class File {
+   public:
+    // path is the file path.
+    std::string path;
+
+    // fd is the file descriptor, or -1 if the file is not open.
+    int fd = -1;
+
+    // size is the size of the file.
+    uint64_t size = 0;
+  };
+
+  // Slot is a chunk of a file being read.
+  class Slot {
+   public:
+    // file is the index of the file.
+    size_t file = 0;
+
+    // offset is the offset of the chunk within the file.
+    uint64_t offset = 0;
+
+    // size is the size of the chunk.
+    size_t size = 0;
+
+    // result is the number of bytes read or a negative errno value.
+    int64_t result = 0;
+
+    // completed tells whether the read has completed.
+    bool completed = false;
+
+#ifdef MKJSON_HAVE_IO_URING
+    // iov is the vector used for reading with io_uring.
+    struct iovec iov = {};
+#endif
+  };
+
+  // open opens @p file if needed and returns whether it's open.
+  static bool open(File &file) noexcept;
+
+  // close closes @p file if it's open.
+  static void close(File &file) noexcept;
+
+  // buffer returns the buffer of the slot at @p index.
+  char *buffer(size_t index) noexcept;
+
+  // schedule assigns the free slots to the next chunks to read.
+  bool schedule() noexcept;
+
+  // complete waits for the read of the slot at @p index to complete.
+  bool complete(size_t index) noexcept;
+
+  // read_rest synchronously reads what's left of the slot at @p index.
+  bool read_rest(size_t index) noexcept;
+
+  // files contains all the files.
+  std::vector<File> files;
+
+  // slots is the ring of slots.
+  Slot slots[queue_depth];
+
+  // storage contains the buffers of all the slots.
+  std::unique_ptr<char[]> storage;
+
+  // head is the index of the oldest slot in use.
+  size_t head = 0;
+
+  // count is the number of slots in use.
+  size_t count = 0;
+
+  // next_file is the index of the next file to schedule.
+  size_t next_file = 0;
+
+  // next_offset is the offset of the next chunk of next_file to schedule.
+  uint64_t next_offset = 0;
+
+  // consuming tells whether the caller holds the head slot.
+  bool consuming = false;
+
+  // error tells whether we've got an error.
+  bool error = false;
+
+#ifdef MKJSON_HAVE_IO_URING
+  // setup_ring creates the io_uring. Returns false if not available.
+  bool setup_ring() noexcept;
+
+  // submit submits the read for the slot at @p index.
+  void submit(size_t index) noexcept;
+
+  // enter calls io_uring_enter to submit the pending reads and to wait
+  // for @p min_complete reads to complete.
+  bool enter(unsigned min_complete) noexcept;
+
+  // reap processes all the available completions.
+  void reap() noexcept;
+
+  // teardown_ring waits for the reads in flight and destroys the io_uring.
+  void teardown_ring() noexcept;
+
+  // ring_fd is the io_uring file descriptor, or -1 if not available.
+  int ring_fd = -1;
+
+  // sq_ring is the mapped submission queue ring.
+  void *sq_ring = MAP_FAILED;
+
+  // sq_ring_size is the size of sq_ring.
+  size_t sq_ring_size = 0;
+
+  // cq_ring is the mapped completion queue ring.
+  void *cq_ring = MAP_FAILED;
+
+  // cq_ring_size is the size of cq_ring.
+  size_t cq_ring_size = 0;
+
+  // sqes is the mapped array of submission queue entries.
+  struct io_uring_sqe *sqes = nullptr;
+
+  // sqes_size is the size of sqes.
+  size_t sqes_size = 0;
+
+  // params contains the offsets of the ring fields.
+  struct io_uring_params params = {};
+
+  // to_submit is the number of entries queued but not submitted.
+  unsigned to_submit = 0;
+
+  // inflight is the number of reads submitted but not completed.
+  size_t inflight = 0;
+#endif
+};
+
+/*static*/ constexpr size_t FilesReader::queue_depth;
+/*static*/ constexpr size_t FilesReader::chunk_size;
+
+/*explicit*/ FilesReader::FilesReader(
+    const std::vector<std::string> &paths) noexcept {
+  try {
+    for (const std::string &path : paths) {
+      File file;
+      file.path = path;
+      files.push_back(std::move(file));
+    }
+    storage.reset(new char[queue_depth * chunk_size]);
+  } catch (const std::exception &) {
+    error = true;
+    return;
+  }
+#ifdef MKJSON_HAVE_IO_URING
+  if (!setup_ring()) teardown_ring();  // Fall back to pread
+#endif
+}
+
+/*static*/ bool FilesReader::open(File &file) noexcept {
+  if (file.fd != -1) return true;
+#ifdef _WIN32
+  file.fd = _open(file.path.c_str(), _O_RDONLY | _O_BINARY);
+  __int64 size = (file.fd != -1) ? _lseeki64(file.fd, 0, SEEK_END) : -1;
+#else
+  file.fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat sb {};
+  off_t size = (file.fd != -1 && fstat(file.fd, &sb) == 0) ? sb.st_size : -1;
+#endif
+  if (size < 0) {
+    close(file);
+    return false;
+  }
+  file.size = (uint64_t)size;
+  return true;
+}
+
+/*static*/ void FilesReader::close(File &file) noexcept {
+  if (file.fd != -1) {
+#ifdef _WIN32
+    (void)_close(file.fd);
+#else
+    (void)::close(file.fd);
+#endif
+    file.fd = -1;
+  }
+}
+
+char *FilesReader::buffer(size_t index) noexcept {
+  return storage.get() + index * chunk_size;
+}
+
+bool FilesReader::schedule() noexcept {
+  while (count < queue_depth && next_file < files.size()) {
+    File &file = files[next_file];
+    if (!open(file)) {
+      // Report the failure only after consuming the previous files.
+      if (count <= 0) return false;
+      break;
+    }
+    if (next_offset >= file.size) {
+      // Files not having any slot in use can be closed right away.
+      if (count == 0 || slots[(head + count - 1) % queue_depth].file != next_file) {
+        close(file);
+      }
+      next_file += 1;
+      next_offset = 0;
+      continue;
+    }
+    size_t index = (head + count) % queue_depth;
+    Slot &slot = slots[index];
+    slot.file = next_file;
+    slot.offset = next_offset;
+    slot.size = (size_t)std::min<uint64_t>(chunk_size, file.size - next_offset);
+    slot.result = 0;
+    slot.completed = false;
+    next_offset += slot.size;
+    count += 1;
+#ifdef MKJSON_HAVE_IO_URING
+    if (ring_fd != -1) submit(index);
+#endif
+  }
+#ifdef MKJSON_HAVE_IO_URING
+  if (ring_fd != -1 && to_submit > 0) return enter(0);
+#endif
+  return true;
+}
+
+bool FilesReader::read_rest(size_t index) noexcept {
+  Slot &slot = slots[index];
+  const File &file = files[slot.file];
+  size_t nread = (size_t)slot.result;
+  char *base = buffer(index);
+#ifdef _WIN32
+  if (_lseeki64(file.fd, (__int64)(slot.offset + nread), SEEK_SET) < 0) {
+    return false;
+  }
+#endif
+  while (nread < slot.size) {
+#ifdef _WIN32
+    int n = _read(file.fd, base + nread, (unsigned int)(slot.size - nread));
+#else
+    ssize_t n = pread(file.fd, base + nread, slot.size - nread,
+                      (off_t)(slot.offset + nread));
+    if (n < 0 && errno == EINTR) continue;
+#endif
+    if (n < 0) return false;
+    if (n == 0) break;  // The file has been truncated after we opened it
+    nread += (size_t)n;
+  }
+  slot.result = (int64_t)nread;
+  slot.completed = true;
+  return true;
+}
+
+bool FilesReader::complete(size_t index) noexcept {
+  Slot &slot = slots[index];
+#ifdef MKJSON_HAVE_IO_URING
+  while (ring_fd != -1 && !slot.completed) {
+    if (!enter(1)) return false;
+  }
+  if (slot.result < 0) return false;
+#endif
+  // Also handles short reads, which we don't expect for regular files.
+  return (slot.completed && (size_t)slot.result >= slot.size) || read_rest(index);
+}
+
+bool FilesReader::next(Chunk &chunk) noexcept {
+  if (error) return false;
+  if (consuming) {
+    consuming = false;
+    Slot &slot = slots[head];
+    File &file = files[slot.file];
+    if (slot.offset + slot.size >= file.size) close(file);
+    head = (head + 1) % queue_depth;
+    count -= 1;
+  }
+  if (!schedule() || (count > 0 && !complete(head))) {
+    error = true;
+    return false;
+  }
+  if (count <= 0) return false;
+  chunk.data = buffer(head);
+  chunk.size = (size_t)slots[head].result;
+  chunk.stream = slots[head].file;
+  consuming = true;
+  return true;
+}
+
+bool FilesReader::failed() const noexcept { return error; }
+
+bool FilesReader::uses_io_uring() const noexcept {
+#ifdef MKJSON_HAVE_IO_URING
+  return ring_fd != -1;
+#else
+  return false;
+#endif
+}
+
+#ifdef MKJSON_HAVE_IO_URING
+bool FilesReader::setup_ring() noexcept {
+  if (std::getenv("MKJSON_NO_IO_URING") != nullptr) return false;
+  ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned)queue_depth, &params);
+  if (ring_fd < 0) {
+    ring_fd = -1;
+    return false;
+  }
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) return false;
+  cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  if (cq_ring == MAP_FAILED) return false;
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *p = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (p == MAP_FAILED) return false;
+  sqes = static_cast<struct io_uring_sqe *>(p);
+  return true;
+}
+
+void FilesReader::submit(size_t index) noexcept {
+  auto sq = static_cast<char *>(sq_ring);
+  auto tailp = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  auto mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  auto array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  unsigned tail = *tailp;  // We're the only producer
+  unsigned entry = tail & mask;
+  Slot &slot = slots[index];
+  slot.iov.iov_base = buffer(index);
+  slot.iov.iov_len = slot.size;
+  struct io_uring_sqe *sqe = &sqes[entry];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = files[slot.file].fd;
+  sqe->off = slot.offset;
+  sqe->addr = (uint64_t)(uintptr_t)&slot.iov;
+  sqe->len = 1;
+  sqe->user_data = index;
+  array[entry] = entry;
+  __atomic_store_n(tailp, tail + 1, __ATOMIC_RELEASE);
+  to_submit += 1;
+  inflight += 1;
+}
+
+bool FilesReader::enter(unsigned min_complete) noexcept {
+  for (;;) {
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    long rv = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                      flags, nullptr, 0);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) return false;
+    to_submit -= (unsigned)rv;
+    reap();
+    return true;
+  }
+}
+
+void FilesReader::reap() noexcept {
+  auto cq = static_cast<char *>(cq_ring);
+  auto headp = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  auto tailp = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  auto mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  auto cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  unsigned cq_head = *headp;  // We're the only consumer
+  unsigned cq_tail = __atomic_load_n(tailp, __ATOMIC_ACQUIRE);
+  for (; cq_head != cq_tail; ++cq_head) {
+    const struct io_uring_cqe &cqe = cqes[cq_head & mask];
+    Slot &slot = slots[cqe.user_data % queue_depth];
+    slot.result = cqe.res;
+    slot.completed = true;
+    inflight -= 1;
+  }
+  __atomic_store_n(headp, cq_head, __ATOMIC_RELEASE);
+}
+
+void FilesReader::teardown_ring() noexcept {
+  // The kernel may still be writing into the buffers of the reads in flight.
+  while (ring_fd != -1 && inflight > 0 && enter(1)) {
+  }
+  if (sqes != nullptr) (void)munmap(sqes, sqes_size);
+  if (cq_ring != MAP_FAILED) (void)munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED) (void)munmap(sq_ring, sq_ring_size);
+  if (ring_fd != -1) (void)::close(ring_fd);
+  sqes = nullptr;
+  cq_ring = sq_ring = MAP_FAILED;
+  ring_fd = -1;
+}
+#endif
+
+FilesReader::~FilesReader() noexcept {
+#ifdef MKJSON_HAVE_IO_URING
+  teardown_ring();
+#endif
+  for (File &file : files) {
+    close(file);
+  }
+}
+
+// Decoder is the interface of decompressors.
+class Decoder {
+ public:
+  // decode decompresses the @p *in_size bytes at @p *in into the @p *out_size
+  // bytes at @p out. On return, @p *in and @p *in_size are updated to refer
+  // to the input not consumed yet and @p *out_size contains the number of
+  // bytes written. Call decode with empty input to flush the output that
+  // did not fit. Returns false on error.
+  virtual bool decode(const char **in, size_t *in_size, char *out,
+                      size_t *out_size) noexcept = 0;
+
+  // finished tells whether the input ends at a frame boundary, i.e. the
+  // compressed input is not truncated.
+  virtual bool finished() const noexcept = 0;
+
+  // ~Decoder destroys the allocated resources.
+  virtual ~Decoder() noexcept;
+};
+
+Decoder::~Decoder() noexcept {}
+
+#ifdef MKJSON_HAVE_ZLIB
+// GzipDecoder decompresses gzip data, including many concatenated members.
+class GzipDecoder : public Decoder {
+ public:
+  // GzipDecoder creates a decoder. Check good before using it.
+  GzipDecoder() noexcept;
+
+  // good tells whether the decoder was successfully initialized.
+  bool good = false;
+
+  // decode implements Decoder::decode.
+  bool decode(const char **in, size_t *in_size, char *out,
+              size_t *out_size) noexcept override;
+
+  // finished implements Decoder::finished.
+  bool finished() const noexcept override;
+
+  // ~GzipDecoder destroys the allocated resources.
+  ~GzipDecoder() noexcept override;
+
+ private:
+  // stream is the zlib stream.
+  z_stream stream = {};
+
+  // in_member tells whether we're in the middle of a gzip member.
+  bool in_member = false;
+};
+
+GzipDecoder::GzipDecoder() noexcept {
+  good = inflateInit2(&stream, 15 + 16) == Z_OK;  // Expect a gzip header
+}
+
+bool GzipDecoder::decode(const char **in, size_t *in_size, char *out,
+                         size_t *out_size) noexcept {
+  stream.next_in = (Bytef *)*in;
+  stream.avail_in = (uInt)std::min<size_t>(*in_size, UINT_MAX);
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = (uInt)std::min<size_t>(*out_size, UINT_MAX);
+  uInt avail_in = stream.avail_in;
+  uInt avail_out = stream.avail_out;
+  int rv = inflate(&stream, Z_NO_FLUSH);
+  *in += avail_in - stream.avail_in;
+  *in_size -= avail_in - stream.avail_in;
+  *out_size = avail_out - stream.avail_out;
+  in_member = in_member || avail_in != stream.avail_in;
+  if (rv == Z_STREAM_END) {
+    // There may be more members after this one.
+    in_member = false;
+    return inflateReset(&stream) == Z_OK;
+  }
+  return rv == Z_OK || rv == Z_BUF_ERROR;  // Z_BUF_ERROR means no progress
+}
+
+bool GzipDecoder::finished() const noexcept { return !in_member; }
+
+GzipDecoder::~GzipDecoder() noexcept {
+  if (good) (void)inflateEnd(&stream);
+}
+#endif
+
+#ifdef MKJSON_HAVE_ZSTD
+// ZstdDecoder decompresses zstd data, including many concatenated frames.
+class ZstdDecoder : public Decoder {
+ public:
+  // ZstdDecoder creates a decoder. Check good before using it.
+  ZstdDecoder() noexcept;
+
+  // good tells whether the decoder was successfully initialized.
+  bool good = false;
+
+  // decode implements Decoder::decode.
+  bool decode(const char **in, size_t *in_size, char *out,
+              size_t *out_size) noexcept override;
+
+  // finished implements Decoder::finished.
+  bool finished() const noexcept override;
+
+  // ~ZstdDecoder destroys the allocated resources.
+  ~ZstdDecoder() noexcept override;
+
+ private:
+  // dctx is the zstd decompression context.
+  ZSTD_DCtx *dctx = nullptr;
+
+  // in_frame tells whether we're in the middle of a zstd frame.
+  bool in_frame = false;
+};
+
+ZstdDecoder::ZstdDecoder() noexcept {
+  dctx = ZSTD_createDCtx();
+  good = dctx != nullptr;
+}
+
+bool ZstdDecoder::decode(const char **in, size_t *in_size, char *out,
+                         size_t *out_size) noexcept {
+  ZSTD_inBuffer input = {*in, *in_size, 0};
+  ZSTD_outBuffer output = {out, *out_size, 0};
+  size_t rv = ZSTD_decompressStream(dctx, &output, &input);
+  *in += input.pos;
+  *in_size -= input.pos;
+  *out_size = output.pos;
+  if (ZSTD_isError(rv)) return false;
+  // Zero means that a frame is complete and its output fully flushed. We
+  // ignore calls not making progress, which return a hint > 0 even after
+  // the end of a frame.
+  if (input.pos > 0 || output.pos > 0) in_frame = (rv != 0);
+  return true;
+}
+
+bool ZstdDecoder::finished() const noexcept { return !in_frame; }
+
+ZstdDecoder::~ZstdDecoder() noexcept {
+  if (dctx != nullptr) (void)ZSTD_freeDCtx(dctx);
+}
+#endif
+
+// DecompressReader is a ChunkReader that transparently decompresses the
+// streams of another ChunkReader. The compression format of each stream is
+// detected from the stream's first bytes. Uncompressed streams are passed
+// through without copying.
+class DecompressReader : public ChunkReader {
+ public:
+  // buffer_size is the size of the buffer for decompressed data.
+  static constexpr size_t buffer_size = 256 << 10;
+
+  // magic_size is the number of bytes needed to detect any format.
+  static constexpr size_t magic_size = 4;
+
+  // DecompressReader creates a reader decompressing @p source.
+  explicit DecompressReader(std::unique_ptr<ChunkReader> source) noexcept;
+
+  // next implements ChunkReader::next.
+  bool next(Chunk &chunk) noexcept override;
+
+  // failed implements ChunkReader::failed.
+  bool failed() const noexcept override;
+
+ private:
+  // start starts the stream whose first chunk is pending. It makes input
+  // refer to at least magic_size bytes, unless the stream is shorter, by
+  // copying short chunks into head, and selects the decoder accordingly.
+  bool start() noexcept;
+
+  // select selects the decoder for a stream starting with the @p size
+  // bytes at @p data.
+  bool select(const char *data, size_t size) noexcept;
+
+  // source is the underlying reader.
+  std::unique_ptr<ChunkReader> source;
+
+  // input is the input not consumed yet.
+  Chunk input;
+
+  // pending is the next chunk, read from the source while flushing.
+  Chunk pending;
+
+  // pending_good tells whether pending contains a chunk.
+  bool pending_good = false;
+
+  // source_eof tells whether the source has no more chunks.
+  bool source_eof = false;
+
+  // started tells whether we've read the first chunk.
+  bool started = false;
+
+  // flushing tells whether we're flushing the output of the current stream
+  // because the stream has ended.
+  bool flushing = false;
+
+  // decoder is the decoder for the current stream, if compressed.
+  std::unique_ptr<Decoder> decoder;
+
+  // buffer contains the decompressed data.
+  std::unique_ptr<char[]> buffer;
+
+  // head contains the first bytes of a stream whose first chunk is
+  // shorter than magic_size, e.g., when reading from a pipe.
+  char head[magic_size] = {};
+
+  // error tells whether we've got an error.
+  bool error = false;
+};
+
+/*static*/ constexpr size_t DecompressReader::buffer_size;
+/*static*/ constexpr size_t DecompressReader::magic_size;
+
+/*explicit*/ DecompressReader::DecompressReader(
+    std::unique_ptr<ChunkReader> source_) noexcept
+    : source{std::move(source_)} {}
+
+bool DecompressReader::start() noexcept {
+  if (pending.size >= magic_size) {
+    input = pending;
+    pending_good = false;
+    return select(input.data, input.size);
+  }
+  size_t stream = pending.stream;
+  size_t head_size = 0;
+  for (;;) {
+    size_t count = std::min(magic_size - head_size, pending.size);
+    memcpy(head + head_size, pending.data, count);
+    head_size += count;
+    pending.data += count;
+    pending.size -= count;
+    if (head_size >= magic_size) break;
+    pending_good = source->next(pending);
+    source_eof = !pending_good;
+    if (!pending_good || pending.stream != stream) break;
+  }
+  // The rest of the last chunk, if any, is still pending.
+  if (pending_good && pending.stream == stream && pending.size == 0) {
+    pending_good = false;
+  }
+  input.data = head;
+  input.size = head_size;
+  input.stream = stream;
+  return select(input.data, input.size);
+}
+
+bool DecompressReader::select(const char *data, size_t size) noexcept {
+  decoder.reset();
+  auto magic = [&](const char *bytes, size_t count) {
+    return size >= count && memcmp(data, bytes, count) == 0;
+  };
+  if (magic("\x1f\x8b", 2)) {
+#ifdef MKJSON_HAVE_ZLIB
+    auto gzip = new (std::nothrow) GzipDecoder;
+    decoder.reset(gzip);
+    if (gzip == nullptr || !gzip->good) return false;
+#else
+    return false;  // Not compiled in
+#endif
+  } else if (magic("\x28\xb5\x2f\xfd", 4)) {
+#ifdef MKJSON_HAVE_ZSTD
+    auto zstd = new (std::nothrow) ZstdDecoder;
+    decoder.reset(zstd);
+    if (zstd == nullptr || !zstd->good) return false;
+#else
+    return false;  // Not compiled in
+#endif
+  } else {
+    return true;  // Not compressed
+  }
+  if (!buffer) buffer.reset(new (std::nothrow) char[buffer_size]);
+  return buffer != nullptr;
+}
+
+bool DecompressReader::next(Chunk &chunk) noexcept {
+  while (!error) {
+    if (decoder && (input.size > 0 || flushing)) {
+      chunk.data = buffer.get();
+      chunk.size = buffer_size;
+      chunk.stream = input.stream;
+      size_t before = input.size;
+      if (!decoder->decode(&input.data, &input.size, buffer.get(), &chunk.size)) {
+        error = true;
+        break;
+      }
+      if (chunk.size > 0) return true;
+      if (input.size > 0) {
+        error = (input.size == before);  // Avoid looping without progress
+        continue;
+      }
+      if (flushing) {
+        // We've flushed all the output, so check for truncated input.
+        error = !decoder->finished();
+        decoder.reset();
+        flushing = false;
+      }
+    } else if (!decoder && input.size > 0) {
+      chunk = input;
+      input.size = 0;
+      return true;
+    }
+    if (error) break;
+    if (!pending_good && !source_eof) {
+      pending_good = source->next(pending);
+      source_eof = !pending_good;
+    }
+    if (decoder && (source_eof || pending.stream != input.stream)) {
+      flushing = true;  // Flush the current stream before the next one
+      continue;
+    }
+    if (source_eof) break;
+    if (!started || pending.stream != input.stream) {
+      started = true;
+      error = !start();
+      continue;
+    }
+    input = pending;
+    pending_good = false;
+  }
+  return false;
+}
+
+bool DecompressReader::failed() const noexcept {
+  return error || source->failed();
+}
+
+// ChunkStreamBuf is a std::streambuf reading from a ChunkReader.
+class ChunkStreamBuf : public std::streambuf {
+ public:
+  // ChunkStreamBuf creates a stream buffer reading from @p reader.
+  explicit ChunkStreamBuf(std::unique_ptr<ChunkReader> reader) noexcept;
+
+  // reader is the underlying reader.
+  std::unique_ptr<ChunkReader> reader;
+
+ protected:
+  // underflow makes the next chunk available to the stream.
+  int_type underflow() override;
+};
+
+/*explicit*/ ChunkStreamBuf::ChunkStreamBuf(
+    std::unique_ptr<ChunkReader> reader_) noexcept
+    : reader{std::move(reader_)} {}
+
+ChunkStreamBuf::int_type ChunkStreamBuf::underflow() {
+  Chunk chunk;
+  if (!reader->next(chunk)) return traits_type::eof();
+  char *base = const_cast<char *>(chunk.data);
+  setg(base, base, base + chunk.size);
+  return traits_type::to_int_type(*gptr());
+}
+
+/*static*/ Result<JSON> JSON::parse_fd(int fd) noexcept {
+  return parse_fd(fd, ParseOptions{});
+}
+
+/*static*/ Result<JSON> JSON::parse_fd(int fd,
+                                      const ParseOptions &options) noexcept {
+  Result<JSON> result;
+  result.value.impl->resource = options.memory_resource;
+  try {
+    std::unique_ptr<ChunkReader> reader{new FdReader{fd}};
+    ChunkStreamBuf streambuf{
+        std::unique_ptr<ChunkReader>{new DecompressReader{std::move(reader)}}};
+    std::istream stream{&streambuf};
+    try {
+      JSON::Impl::parse(result.value.impl->nlohmann_json, options, nullptr,
+                        stream);
+    } catch (const std::exception &) {
+      if (!streambuf.reader->failed()) throw;
+      result.good = false;
+      result.failure = "Cannot read input";
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+// JSONLReader::Impl is the concrete implementation of JSONLReader.
+class JSONLReader::Impl {
+ public:
+  // reader is the underlying reader.
+  std::unique_ptr<ChunkReader> reader;
+
+  // chunk is the part of the current chunk not consumed yet.
+  Chunk chunk;
+
+  // partial contains a line spanning more than one chunk.
+  std::string partial;
+
+  // eof tells whether we've read all the documents.
+  bool eof = false;
+
+  // options contains the options for parsing.
+  ParseOptions options;
+
+  // parse parses [@p begin, @p end) unless it's only whitespace, in which
+  // case it returns false. On failure, it also fills @p error, if set.
+  bool parse(const char *begin, const char *end, Result<JSON> &result,
+             ParseError *error) const;
+
+  // read_next implements JSONLReader::read_next.
+  Result<JSON> read_next(ParseError *error) noexcept;
+};
+
+bool JSONLReader::Impl::parse(const char *begin, const char *end,
+                              Result<JSON> &result, ParseError *error) const {
+  if (std::all_of(begin, end, [](char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+      })) {
+    return false;
+  }
+  try {
+    JSON::Friend::parse(result.value, begin, end, options, error);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return true;
+}
+
+/*explicit*/ JSONLReader::JSONLReader(int fd) noexcept
+    : JSONLReader{fd, ParseOptions{}} {}
+
+/*explicit*/ JSONLReader::JSONLReader(
+    const std::vector<std::string> &paths) noexcept
+    : JSONLReader{paths, ParseOptions{}} {}
+
+JSONLReader::JSONLReader(int fd, const ParseOptions &options) noexcept {
+  impl.reset(new JSONLReader::Impl);
+  impl->options = options;
+  std::unique_ptr<ChunkReader> reader{new FdReader{fd}};
+  impl->reader.reset(new DecompressReader{std::move(reader)});
+}
+
+JSONLReader::JSONLReader(const std::vector<std::string> &paths,
+                         const ParseOptions &options) noexcept {
+  impl.reset(new JSONLReader::Impl);
+  impl->options = options;
+  std::unique_ptr<ChunkReader> reader{new FilesReader{paths}};
+  impl->reader.reset(new DecompressReader{std::move(reader)});
+}
+
+Result<JSON> JSONLReader::Impl::read_next(ParseError *error) noexcept {
+  Result<JSON> result;
+  try {
+    while (!eof) {
+      if (chunk.size <= 0) {
+        size_t stream = chunk.stream;
+        eof = !reader->next(chunk);
+        if (eof || chunk.stream != stream) {
+          // The last line of a stream may not be terminated by a newline.
+          const char *begin = partial.data();
+          bool parsed = parse(begin, begin + partial.size(), result, error);
+          partial.clear();
+          if (parsed) return result;
+          continue;
+        }
+      }
+      auto newline = (const char *)memchr(chunk.data, '\n', chunk.size);
+      if (newline == nullptr) {
+        partial.append(chunk.data, chunk.size);
+        chunk.size = 0;
+        continue;
+      }
+      const char *begin = chunk.data;
+      const char *end = newline;
+      chunk.size -= (size_t)(newline + 1 - chunk.data);
+      chunk.data = newline + 1;
+      if (!partial.empty()) {
+        partial.append(begin, end);
+        begin = partial.data();
+        end = begin + partial.size();
+      }
+      bool parsed = parse(begin, end, result, error);
+      partial.clear();
+      if (parsed) return result;
+    }
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  result.good = false;
+  result.failure = reader->failed() ? "Cannot read input" : "End of file";
+  return result;
+}
+
+Result<JSON> JSONLReader::read_next() noexcept {
+  return impl->read_next(nullptr);
+}
+
+Result<JSON> JSONLReader::read_next(ParseError &error) noexcept {
+  error = ParseError{};
+  return impl->read_next(&error);
+}
+
+bool JSONLReader::eof() const noexcept { return impl->eof; }
+
+JSONLReader::~JSONLReader() noexcept {}
+
+// ChunkWriter is the interface of the writers used by JSON::dump_fd and
+// by JSONLWriter.
+class ChunkWriter {
+ public:
+  // write writes the @p size bytes at @p data. Returns false on error.
+  virtual bool write(const char *data, size_t size) noexcept = 0;
+
+  // finish terminates the output, e.g. writing the compression trailer.
+  virtual bool finish() noexcept = 0;
+
+  // ~ChunkWriter destroys the allocated resources.
+  virtual ~ChunkWriter() noexcept;
+};
+
+ChunkWriter::~ChunkWriter() noexcept {}
+
+// FdWriter is a ChunkWriter writing to a file descriptor.
+class FdWriter : public ChunkWriter {
+ public:
+  // FdWriter creates a writer for @p fd, which is not owned.
+  explicit FdWriter(int fd_) noexcept : fd{fd_} {}
+
+  // write implements ChunkWriter::write.
+  bool write(const char *data, size_t size) noexcept override;
+
+  // finish implements ChunkWriter::finish.
+  bool finish() noexcept override;
+
+ private:
+  // fd is the file descriptor.
+  int fd = -1;
+};
+
+bool FdWriter::write(const char *data, size_t size) noexcept {
+  while (size > 0) {
+#ifdef _WIN32
+    int n = _write(fd, data, (unsigned int)std::min<size_t>(size, INT_MAX));
+#else
+    ssize_t n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+#endif
+    if (n <= 0) return false;
+    data += n, size -= (size_t)n;
+  }
+  return true;
+}
+
+bool FdWriter::finish() noexcept { return true; }
+
+// Encoder is the interface of compressors.
+class Encoder {
+ public:
+  // encode compresses the @p *in_size bytes at @p *in into the @p *out_size
+  // bytes at @p out. On return, @p *in and @p *in_size are updated to refer
+  // to the input not consumed yet and @p *out_size contains the number of
+  // bytes written. Returns false on error.
+  virtual bool encode(const char **in, size_t *in_size, char *out,
+                      size_t *out_size) noexcept = 0;
+
+  // finish writes into the @p *out_size bytes at @p out what's left of the
+  // compressed stream, setting @p *out_size to the number of bytes written.
+  // Call finish until @p *done is true. Returns false on error.
+  virtual bool finish(char *out, size_t *out_size, bool *done) noexcept = 0;
+
+  // ~Encoder destroys the allocated resources.
+  virtual ~Encoder() noexcept;
+};
+
+Encoder::~Encoder() noexcept {}
+
+#ifdef MKJSON_HAVE_ZLIB
+// GzipEncoder compresses data as a gzip member.
+class GzipEncoder : public Encoder {
+ public:
+  // GzipEncoder creates an encoder. Check good before using it.
+  GzipEncoder() noexcept;
+
+  // good tells whether the encoder was successfully initialized.
+  bool good = false;
+
+  // encode implements Encoder::encode.
+  bool encode(const char **in, size_t *in_size, char *out,
+              size_t *out_size) noexcept override;
+
+  // finish implements Encoder::finish.
+  bool finish(char *out, size_t *out_size, bool *done) noexcept override;
+
+  // ~GzipEncoder destroys the allocated resources.
+  ~GzipEncoder() noexcept override;
+
+ private:
+  // deflate runs deflate with @p flush on the given buffers.
+  int deflate(const char **in, size_t *in_size, char *out, size_t *out_size,
+              int flush) noexcept;
+
+  // stream is the zlib stream.
+  z_stream stream = {};
+};
+
+GzipEncoder::GzipEncoder() noexcept {
+  good = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK;  // Write a gzip header
+}
+
+int GzipEncoder::deflate(const char **in, size_t *in_size, char *out,
+                         size_t *out_size, int flush) noexcept {
+  stream.next_in = (Bytef *)*in;
+  stream.avail_in = (uInt)std::min<size_t>(*in_size, UINT_MAX);
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = (uInt)std::min<size_t>(*out_size, UINT_MAX);
+  uInt avail_in = stream.avail_in;
+  uInt avail_out = stream.avail_out;
+  int rv = ::deflate(&stream, flush);
+  *in += avail_in - stream.avail_in;
+  *in_size -= avail_in - stream.avail_in;
+  *out_size = avail_out - stream.avail_out;
+  return rv;
+}
+
+bool GzipEncoder::encode(const char **in, size_t *in_size, char *out,
+                         size_t *out_size) noexcept {
+  int rv = deflate(in, in_size, out, out_size, Z_NO_FLUSH);
+  return rv == Z_OK || rv == Z_BUF_ERROR;  // Z_BUF_ERROR means no progress
+}
+
+bool GzipEncoder::finish(char *out, size_t *out_size, bool *done) noexcept {
+  const char *in = nullptr;
+  size_t in_size = 0;
+  int rv = deflate(&in, &in_size, out, out_size, Z_FINISH);
+  *done = (rv == Z_STREAM_END);
+  return rv == Z_OK || rv == Z_STREAM_END || rv == Z_BUF_ERROR;
+}
+
+GzipEncoder::~GzipEncoder() noexcept {
+  if (good) (void)deflateEnd(&stream);
+}
+#endif
+
+#ifdef MKJSON_HAVE_ZSTD
+// ZstdEncoder compresses data as a zstd frame.
+class ZstdEncoder : public Encoder {
+ public:
+  // ZstdEncoder creates an encoder. Check good before using it.
+  ZstdEncoder() noexcept;
+
+  // good tells whether the encoder was successfully initialized.
+  bool good = false;
+
+  // encode implements Encoder::encode.
+  bool encode(const char **in, size_t *in_size, char *out,
+              size_t *out_size) noexcept override;
+
+  // finish implements Encoder::finish.
+  bool finish(char *out, size_t *out_size, bool *done) noexcept override;
+
+  // ~ZstdEncoder destroys the allocated resources.
+  ~ZstdEncoder() noexcept override;
+
+ private:
+  // compress runs ZSTD_compressStream2 with @p op on the given buffers.
+  size_t compress(const char **in, size_t *in_size, char *out,
+                  size_t *out_size, ZSTD_EndDirective op) noexcept;
+
+  // cctx is the zstd compression context.
+  ZSTD_CCtx *cctx = nullptr;
+};
+
+ZstdEncoder::ZstdEncoder() noexcept {
+  cctx = ZSTD_createCCtx();
+  good = cctx != nullptr;
+}
+
+size_t ZstdEncoder::compress(const char **in, size_t *in_size, char *out,
+                             size_t *out_size, ZSTD_EndDirective op) noexcept {
+  ZSTD_inBuffer input = {*in, *in_size, 0};
+  ZSTD_outBuffer output = {out, *out_size, 0};
+  size_t rv = ZSTD_compressStream2(cctx, &output, &input, op);
+  *in += input.pos;
+  *in_size -= input.pos;
+  *out_size = output.pos;
+  return rv;
+}
+
+bool ZstdEncoder::encode(const char **in, size_t *in_size, char *out,
+                         size_t *out_size) noexcept {
+  return !ZSTD_isError(compress(in, in_size, out, out_size, ZSTD_e_continue));
+}
+
+bool ZstdEncoder::finish(char *out, size_t *out_size, bool *done) noexcept {
+  const char *in = nullptr;
+  size_t in_size = 0;
+  size_t rv = compress(&in, &in_size, out, out_size, ZSTD_e_end);
+  *done = (rv == 0);  // Zero means that the frame is complete
+  return !ZSTD_isError(rv);
+}
+
+ZstdEncoder::~ZstdEncoder() noexcept {
+  if (cctx != nullptr) (void)ZSTD_freeCCtx(cctx);
+}
+#endif
+
+// CompressWriter is a ChunkWriter that compresses the data written to
+// another ChunkWriter.
+class CompressWriter : public ChunkWriter {
+ public:
+  // buffer_size is the size of the buffer for compressed data.
+  static constexpr size_t buffer_size = 256 << 10;
+
+  // CompressWriter creates a writer compressing with @p encoder and
+  // writing to @p sink. Check good before using it.
+  CompressWriter(std::unique_ptr<Encoder> encoder,
+                 std::unique_ptr<ChunkWriter> sink) noexcept;
+
+  // good tells whether the writer was successfully initialized.
+  bool good = false;
+
+  // write implements ChunkWriter::write.
+  bool write(const char *data, size_t size) noexcept override;
+
+  // finish implements ChunkWriter::finish.
+  bool finish() noexcept override;
+
+ private:
+  // encoder is the encoder.
+  std::unique_ptr<Encoder> encoder;
+
+  // sink is the underlying writer.
+  std::unique_ptr<ChunkWriter> sink;
+
+  // buffer contains the compressed data.
+  std::unique_ptr<char[]> buffer;
+};
+
+/*static*/ constexpr size_t CompressWriter::buffer_size;
+
+CompressWriter::CompressWriter(std::unique_ptr<Encoder> encoder_,
+                               std::unique_ptr<ChunkWriter> sink_) noexcept
+    : encoder{std::move(encoder_)}, sink{std::move(sink_)} {
+  buffer.reset(new (std::nothrow) char[buffer_size]);
+  good = buffer != nullptr;
+}
+
+bool CompressWriter::write(const char *data, size_t size) noexcept {
+  while (size > 0) {
+    size_t out_size = buffer_size;
+    if (!encoder->encode(&data, &size, buffer.get(), &out_size) ||
+        !sink->write(buffer.get(), out_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CompressWriter::finish() noexcept {
+  for (bool done = false; !done;) {
+    size_t out_size = buffer_size;
+    if (!encoder->finish(buffer.get(), &out_size, &done) ||
+        !sink->write(buffer.get(), out_size)) {
+      return false;
+    }
+  }
+  return sink->finish();
+}
+
+// ChunkOutStreamBuf is a std::streambuf writing to a ChunkWriter.
+class ChunkOutStreamBuf : public std::streambuf {
+ public:
+  // buffer_size is the size of the buffer for serialized data.
+  static constexpr size_t buffer_size = 64 << 10;
+
+  // ChunkOutStreamBuf creates a stream buffer writing to @p writer.
+  explicit ChunkOutStreamBuf(std::unique_ptr<ChunkWriter> writer) noexcept;
+
+  // writer is the underlying writer.
+  std::unique_ptr<ChunkWriter> writer;
+
+  // failed tells whether writing failed.
+  bool failed = false;
+
+  // make creates a stream buffer writing to @p fd and compressing with
+  // @p compression. Returns nullptr on failure, setting @p failure.
+  static std::unique_ptr<ChunkOutStreamBuf> make(
+      int fd, Compression compression, std::string &failure) noexcept;
+
+  // dump serializes @p value followed by @p suffix.
+  Result<void> dump(const JSON &value, const char *suffix) noexcept;
+
+  // finish writes the buffered data and terminates the output.
+  Result<void> finish() noexcept;
+
+ protected:
+  // overflow writes the buffered data and then buffers @p ch.
+  int_type overflow(int_type ch) override;
+
+  // sync writes the buffered data.
+  int sync() override;
+
+ private:
+  // buffer contains the serialized data not written yet.
+  char buffer[buffer_size];
+};
+
+/*static*/ constexpr size_t ChunkOutStreamBuf::buffer_size;
+
+/*explicit*/ ChunkOutStreamBuf::ChunkOutStreamBuf(
+    std::unique_ptr<ChunkWriter> writer_) noexcept
+    : writer{std::move(writer_)} {
+  setp(buffer, buffer + buffer_size);
+}
+
+ChunkOutStreamBuf::int_type ChunkOutStreamBuf::overflow(int_type ch) {
+  if (sync() != 0) return traits_type::eof();
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+int ChunkOutStreamBuf::sync() {
+  failed = failed || !writer->write(pbase(), (size_t)(pptr() - pbase()));
+  setp(buffer, buffer + buffer_size);
+  return failed ? -1 : 0;
+}
+
+/*static*/ std::unique_ptr<ChunkOutStreamBuf> ChunkOutStreamBuf::make(
+    int fd, Compression compression, std::string &failure) noexcept {
+  std::unique_ptr<ChunkWriter> writer{new (std::nothrow) FdWriter{fd}};
+  std::unique_ptr<Encoder> encoder;
+  switch (compression) {
+    case Compression::none:
+      break;
+    case Compression::gzip: {
+#ifdef MKJSON_HAVE_ZLIB
+      auto gzip = new (std::nothrow) GzipEncoder;
+      encoder.reset(gzip);
+      if (gzip == nullptr || !gzip->good) writer.reset();
+#else
+      writer.reset();  // Not compiled in
+#endif
+      break;
+    }
+    case Compression::zstd: {
+#ifdef MKJSON_HAVE_ZSTD
+      auto zstd = new (std::nothrow) ZstdEncoder;
+      encoder.reset(zstd);
+      if (zstd == nullptr || !zstd->good) writer.reset();
+#else
+      writer.reset();  // Not compiled in
+#endif
+      break;
+    }
+  }
+  if (writer && encoder) {
+    auto compress = new (std::nothrow) CompressWriter{std::move(encoder),
+                                                      std::move(writer)};
+    writer.reset(compress);
+    if (compress != nullptr && !compress->good) writer.reset();
+  }
+  std::unique_ptr<ChunkOutStreamBuf> streambuf;
+  if (writer) {
+    streambuf.reset(new (std::nothrow) ChunkOutStreamBuf{std::move(writer)});
+  }
+  if (!streambuf) failure = "Cannot initialize output";
+  return streambuf;
+}
+
+Result<void> ChunkOutStreamBuf::dump(const JSON &value,
+                                     const char *suffix) noexcept {
+  Result<void> result;
+  try {
+    std::ostream stream{this};
+    JSON::Friend::write(value, stream);
+    stream << suffix;
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  if (failed) {
+    result.good = false;
+    result.failure = "Cannot write output";
+  }
+  return result;
+}
+
+Result<void> ChunkOutStreamBuf::finish() noexcept {
+  Result<void> result;
+  if (sync() != 0 || !writer->finish()) {
+    result.good = false;
+    result.failure = "Cannot write output";
+  }
+  return result;
+}
+
+// JSONLWriter::Impl is the concrete implementation of JSONLWriter.
+class JSONLWriter::Impl {
+ public:
+  // failure is the reason why the writer is not usable, if any.
+  std::string failure;
+
+  // streambuf is the stream buffer, if the writer is usable.
+  std::unique_ptr<ChunkOutStreamBuf> streambuf;
+};
+
+Result<void> JSON::dump_fd(int fd, Compression compression) const noexcept {
+  Result<void> result;
+  std::unique_ptr<ChunkOutStreamBuf> streambuf = ChunkOutStreamBuf::make(
+      fd, compression, result.failure);
+  if (!streambuf) {
+    result.good = false;
+    return result;
+  }
+  result = streambuf->dump(*this, "");
+  if (!result.good) return result;
+  return streambuf->finish();
+}
+
+JSONLWriter::JSONLWriter(int fd, Compression compression) noexcept {
+  impl.reset(new JSONLWriter::Impl);
+  impl->streambuf = ChunkOutStreamBuf::make(fd, compression, impl->failure);
+}
+
+Result<void> JSONLWriter::write(const JSON &json) noexcept {
+  if (!impl->streambuf) {
+    Result<void> result;
+    result.good = false;
+    result.failure = impl->failure;
+    return result;
+  }
+  Result<void> result = impl->streambuf->dump(json, "\n");
+  if (!result.good) {
+    // We may have written a partial document, hence we cannot continue.
+    impl->streambuf.reset();
+    impl->failure = result.failure;
+  }
+  return result;
+}
+
+Result<void> JSONLWriter::close() noexcept {
+  if (!impl->streambuf) {
+    Result<void> result;
+    result.good = false;
+    result.failure = impl->failure;
+    return result;
+  }
+  Result<void> result = impl->streambuf->finish();
+  impl->streambuf.reset();
+  impl->failure = "Writer is closed";
+  return result;
+}
+
+JSONLWriter::~JSONLWriter() noexcept {
+  if (impl->streambuf) (void)close();
+}
+
+// Template::Impl is the concrete implementation of Template.
+class Template::Impl {
+ public:
+  // fixed contains the serialized fixed parts, one after the other.
+  std::string fixed;
+
+  // ends contains the end offset within fixed of each fixed part. There is
+  // one more fixed part than slots, possibly empty.
+  std::vector<size_t> ends;
+
+  // slots contains the names of the slots.
+  std::vector<std::string> slots;
+
+  // Impl constructs the template of the null document.
+  Impl();
+
+  // compile appends the serialization of @p node to fixed, starting a new
+  // fixed part at each slot.
+  void compile(const Value &node);
+
+  // escape appends @p value, which must be valid UTF-8, to @p out as a
+  // quoted string, escaped like the nlohmann serializer does.
+  static void escape(const std::string &value, std::string &out);
+};
+
+Template::Impl::Impl() : fixed{"null"}, ends{fixed.size()} {}
+
+void Template::Impl::compile(const Value &node) {
+  switch (node.type()) {
+    case Value::value_t::object: {
+      fixed += '{';
+      bool first = true;
+      for (auto &entry : *node.get_ptr<const Value::object_t *>()) {
+        if (!first) fixed += ',';
+        first = false;
+        escape(entry.first, fixed);
+        fixed += ':';
+        compile(entry.second);
+      }
+      fixed += '}';
+      return;
+    }
+    case Value::value_t::array: {
+      fixed += '[';
+      bool first = true;
+      for (auto &entry : *node.get_ptr<const Value::array_t *>()) {
+        if (!first) fixed += ',';
+        first = false;
+        compile(entry);
+      }
+      fixed += ']';
+      return;
+    }
+    case Value::value_t::string: {
+      auto &value = *node.get_ptr<const std::string *>();
+      if (value.size() >= 3 && value.compare(0, 2, "${") == 0 &&
+          value.back() == '}') {
+        ends.push_back(fixed.size());
+        slots.push_back(value.substr(2, value.size() - 3));
+        return;
+      }
+      escape(value, fixed);
+      return;
+    }
+    default:
+      dump_value(node, fixed);
+      return;
+  }
+}
+
+/*static*/ void Template::Impl::escape(const std::string &value,
+                                      std::string &out) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  const char *p = value.data();
+  const char *end = p + value.size();
+  while (p < end) {
+    // Append the longest run not requiring escaping at once.
+    const char *run = p;
+    while (p < end && (unsigned char)*p > 0x1f && *p != '"' && *p != '\\') {
+      ++p;
+    }
+    out.append(run, (size_t)(p - run));
+    if (p >= end) break;
+    unsigned char ch = (unsigned char)*p++;
+    switch (ch) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\b':
+        out += "\\b";
+        break;
+      case '\f':
+        out += "\\f";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default: {
+        char buffer[] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0x0f]};
+        out.append(buffer, sizeof(buffer));
+        break;
+      }
+    }
+  }
+  out += '"';
+}
+
+Template::Template() noexcept { impl.reset(new Template::Impl); }
+
+/*static*/ Result<Template> Template::compile(
+    const std::string &skeleton) noexcept {
+  Result<Template> result;
+  try {
+    Value root = Value::parse(skeleton);
+    std::unique_ptr<Template::Impl> compiled{new Template::Impl};
+    compiled->fixed.clear();
+    compiled->ends.clear();
+    compiled->compile(root);
+    compiled->ends.push_back(compiled->fixed.size());
+    compiled->fixed.shrink_to_fit();
+    std::swap(result.value.impl, compiled);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Template::Template(Template &&other) noexcept : Template{} {
+  std::swap(impl, other.impl);
+}
+
+Template &Template::operator=(Template &&other) noexcept {
+  std::swap(impl, other.impl);
+  return *this;
+}
+
+const std::vector<std::string> &Template::slots() const noexcept {
+  return impl->slots;
+}
+
+Template::~Template() noexcept {}
+
+// TemplateWriter::Impl is the concrete implementation of TemplateWriter.
+class TemplateWriter::Impl {
+ public:
+  // tmpl is the template.
+  const Template::Impl *tmpl = nullptr;
+
+  // output is where we append.
+  std::string *output = nullptr;
+
+  // next is the index of the next slot.
+  size_t next = 0;
+
+  // result is the result returned by finish.
+  Result<void> result;
+
+  // begin_slot appends the fixed part preceding the next slot and returns
+  // true, or returns false if the writer failed or there is no next slot.
+  bool begin_slot() noexcept;
+
+  // fail makes the writer fail with @p failure, unless already failed.
+  void fail(const char *failure) noexcept;
+};
+
+bool TemplateWriter::Impl::begin_slot() noexcept {
+  if (!result.good) return false;
+  if (next >= tmpl->slots.size()) {
+    fail("Too many values");
+    return false;
+  }
+  size_t begin = (next > 0) ? tmpl->ends[next - 1] : 0;
+  try {
+    output->append(tmpl->fixed, begin, tmpl->ends[next] - begin);
+  } catch (const std::exception &exc) {
+    fail(exc.what());
+    return false;
+  }
+  next += 1;
+  return true;
+}
+
+void TemplateWriter::Impl::fail(const char *failure) noexcept {
+  if (!result.good) return;
+  result.good = false;
+  try {
+    result.failure = failure;
+  } catch (const std::exception &) {
+    // NOTHING
+  }
+}
+
+TemplateWriter::TemplateWriter(const Template &tmpl,
+                               std::string &output) noexcept {
+  impl.reset(new TemplateWriter::Impl);
+  impl->tmpl = tmpl.impl.get();
+  impl->output = &output;
+}
+
+void TemplateWriter::write_boolean(bool value) noexcept {
+  if (!impl->begin_slot()) return;
+  try {
+    *impl->output += (value) ? "true" : "false";
+  } catch (const std::exception &exc) {
+    impl->fail(exc.what());
+  }
+}
+
+void TemplateWriter::write_float64(double value) noexcept {
+  if (!impl->begin_slot()) return;
+  try {
+    dump_value(Value(value), *impl->output);
+  } catch (const std::exception &exc) {
+    impl->fail(exc.what());
+  }
+}
+
+void TemplateWriter::write_int64(int64_t value) noexcept {
+  if (!impl->begin_slot()) return;
+  try {
+    char buffer[24];
+    char *end = buffer + sizeof(buffer);
+    char *first = JSON::Friend::format_int64(value, end);
+    impl->output->append(first, (size_t)(end - first));
+  } catch (const std::exception &exc) {
+    impl->fail(exc.what());
+  }
+}
+
+void TemplateWriter::write_json(const JSON &value) noexcept {
+  if (!impl->begin_slot()) return;
+  try {
+    JSON::Friend::dump(value, *impl->output);
+  } catch (const std::exception &exc) {
+    impl->fail(exc.what());
+  }
+}
+
+void TemplateWriter::write_null() noexcept {
+  if (!impl->begin_slot()) return;
+  try {
+    *impl->output += "null";
+  } catch (const std::exception &exc) {
+    impl->fail(exc.what());
+  }
+}
+
+void TemplateWriter::write_string(const std::string &value) noexcept {
+  if (!impl->begin_slot()) return;
+  try {
+    if (mk::data::contains_valid_utf8(value)) {
+      Template::Impl::escape(value, *impl->output);
+    } else {
+      Template::Impl::escape(mk::data::base64_encode(std::string{value}),
+                             *impl->output);
+    }
+  } catch (const std::exception &exc) {
+    impl->fail(exc.what());
+  }
+}
+
+Result<void> TemplateWriter::finish() noexcept {
+  if (impl->result.good && impl->next != impl->tmpl->slots.size()) {
+    impl->fail("Too few values");
+  }
+  if (impl->result.good) {
+    size_t begin = (impl->next > 0) ? impl->tmpl->ends[impl->next - 1] : 0;
+    try {
+      impl->output->append(impl->tmpl->fixed, begin,
+                           impl->tmpl->ends[impl->next] - begin);
+    } catch (const std::exception &exc) {
+      impl->fail(exc.what());
+    }
+  }
+  return impl->result;
+}
+
+TemplateWriter::~TemplateWriter() noexcept {}
+
+// Query::Impl is the concrete implementation of Query.
+class Query::Impl {
+ public:
+  // Step is a step of the query.
+  class Step {
+   public:
+    // Kind is the kind of step.
+    enum class Kind { member, index, wildcard, slice, filter };
+
+    // Op is the comparison performed by a filter.
+    enum class Op {
+      exists,
+      equal,
+      not_equal,
+      less,
+      less_equal,
+      greater,
+      greater_equal
+    };
+
+    // kind is the kind of step.
+    Kind kind = Kind::wildcard;
+
+    // name is the name of the member selected by member.
+    std::string name;
+
+    // start is the index selected by index or the start of slice.
+    int64_t start = 0;
+
+    // end is the end of slice, if has_end is set.
+    int64_t end = 0;
+
+    // has_end tells whether slice has an end.
+    bool has_end = false;
+
+    // stride is the step of slice.
+    int64_t stride = 1;
+
+    // path contains the names of the members leading, from the member or
+    // element being filtered, to the value that filter tests.
+    std::vector<std::string> path;
+
+    // op is the comparison performed by filter.
+    Op op = Op::exists;
+
+    // literal is the value compared by filter.
+    Value literal;
+  };
+
+  // Parser is a forward declaration to the query parser.
+  class Parser;
+
+  // Matcher is a forward declaration to the SAX consumer evaluating the
+  // query while parsing.
+  class Matcher;
+
+  // steps contains the steps of the query.
+  std::vector<Step> steps;
+
+  // streamable tells whether the query never needs the length of an array.
+  bool streamable = true;
+
+  // evaluate appends to @p out the values below @p node that match the
+  // steps starting with the one at @p from.
+  void evaluate(const Value &node, size_t from,
+                std::vector<const Value *> &out) const;
+
+  // matches tells whether @p step selects the member called @p key.
+  static bool matches(const Step &step, const std::string &key) noexcept;
+
+  // matches tells whether @p step selects the element at @p index. It only
+  // works for streamable queries.
+  static bool matches(const Step &step, size_t index) noexcept;
+
+  // accepts tells whether @p node passes the filter of @p step, if any.
+  static bool accepts(const Step &step, const Value &node);
+
+  // bound converts @p value, a bound of a slice, into an index, which is
+  // not greater than @p size.
+  static size_t bound(int64_t value, size_t size) noexcept;
+
+  // stream evaluates the query while parsing @p input, which may be
+  // anything accepted by sax_parse, calling @p on_match for each match.
+  template <typename... Input>
+  void stream(const std::function<bool(JSON &&)> &on_match,
+              Input &&... input) const;
+};
+
+void Query::Impl::evaluate(const Value &node, size_t from,
+                           std::vector<const Value *> &out) const {
+  if (from >= steps.size()) {
+    out.push_back(&node);
+    return;
+  }
+  const Step &step = steps[from];
+  auto objectp = node.get_ptr<const Value::object_t *>();
+  if (objectp != nullptr) {
+    if (step.kind == Step::Kind::member) {
+      auto it = objectp->find(step.name);
+      if (it != objectp->end()) evaluate(it->second, from + 1, out);
+      return;
+    }
+    if (step.kind != Step::Kind::wildcard && step.kind != Step::Kind::filter) {
+      return;
+    }
+    for (auto &entry : *objectp) {
+      if (accepts(step, entry.second)) evaluate(entry.second, from + 1, out);
+    }
+    return;
+  }
+  auto arrayp = node.get_ptr<const Value::array_t *>();
+  if (arrayp == nullptr) return;
+  size_t size = arrayp->size();
+  switch (step.kind) {
+    case Step::Kind::member:
+      return;
+    case Step::Kind::index: {
+      int64_t index = (step.start < 0) ? step.start + (int64_t)size : step.start;
+      if (index >= 0 && (uint64_t)index < size) {
+        evaluate((*arrayp)[(size_t)index], from + 1, out);
+      }
+      return;
+    }
+    case Step::Kind::slice: {
+      size_t end = step.has_end ? bound(step.end, size) : size;
+      size_t index = bound(step.start, size);
+      while (index < end) {
+        evaluate((*arrayp)[index], from + 1, out);
+        if ((uint64_t)step.stride >= end - index) break;
+        index += (size_t)step.stride;
+      }
+      return;
+    }
+    default:
+      for (auto &entry : *arrayp) {
+        if (accepts(step, entry)) evaluate(entry, from + 1, out);
+      }
+      return;
+  }
+}
+
+/*static*/ bool Query::Impl::matches(const Step &step,
+                                     const std::string &key) noexcept {
+  switch (step.kind) {
+    case Step::Kind::member:
+      return key == step.name;
+    case Step::Kind::wildcard:
+    case Step::Kind::filter:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*static*/ bool Query::Impl::matches(const Step &step, size_t index) noexcept {
+  switch (step.kind) {
+    case Step::Kind::index:
+      return index == (uint64_t)step.start;
+    case Step::Kind::slice:
+      return index >= (uint64_t)step.start &&
+             (!step.has_end || index < (uint64_t)step.end) &&
+             (index - (uint64_t)step.start) % (uint64_t)step.stride == 0;
+    case Step::Kind::wildcard:
+    case Step::Kind::filter:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*static*/ bool Query::Impl::accepts(const Step &step, const Value &node) {
+  if (step.kind != Step::Kind::filter) return true;
+  const Value *current = &node;
+  for (auto &name : step.path) {
+    auto objectp = current->get_ptr<const Value::object_t *>();
+    if (objectp == nullptr) return false;
+    auto it = objectp->find(name);
+    if (it == objectp->end()) return false;
+    current = &it->second;
+  }
+  const Value &literal = step.literal;
+  if (step.op != Step::Op::exists &&
+      !(current->is_number() && literal.is_number()) &&
+      current->type() != literal.type()) {
+    return step.op == Step::Op::not_equal;
+  }
+  switch (step.op) {
+    case Step::Op::equal:
+      return *current == literal;
+    case Step::Op::not_equal:
+      return *current != literal;
+    case Step::Op::less:
+      return *current < literal;
+    case Step::Op::less_equal:
+      return *current <= literal;
+    case Step::Op::greater:
+      return *current > literal;
+    case Step::Op::greater_equal:
+      return *current >= literal;
+    default:
+      return true;  // Op::exists
+  }
+}
+
+/*static*/ size_t Query::Impl::bound(int64_t value, size_t size) noexcept {
+  int64_t length = (int64_t)size;
+  if (value < 0) return (size_t)std::max(value + length, (int64_t)0);
+  return (size_t)std::min(value, length);
+}
+
+// Query::Impl::Parser is the definition of Parser. It is a recursive descent
+// parser throwing on invalid queries.
+class Query::Impl::Parser {
+ public:
+  // Parser creates a parser of @p input, which must outlive it.
+  explicit Parser(const std::string &input) noexcept;
+
+  // parse parses the whole input and appends the steps to @p query.
+  void parse(Impl &query);
+
+ private:
+  // fail throws an exception telling the offset we're at.
+  [[noreturn]] void fail() const;
+
+  // skip_spaces skips the whitespace, if any.
+  void skip_spaces() noexcept;
+
+  // eat consumes @p ch and returns true, if it is the next character.
+  bool eat(char ch) noexcept;
+
+  // expect is like eat but fails if @p ch is not the next character.
+  void expect(char ch);
+
+  // quote tells whether the next character starts a quoted string.
+  bool quote() const noexcept;
+
+  // name parses the name of a member following a dot.
+  std::string name();
+
+  // quoted parses a string within single or double quotes, where a
+  // backslash escapes the following character.
+  std::string quoted();
+
+  // integer parses the integer at the current position, if any, into
+  // @p value and tells whether there was one.
+  bool integer(int64_t &value);
+
+  // bracket parses the step following an opening bracket.
+  Step bracket();
+
+  // filter parses the filter following "?(" into @p step.
+  void filter(Step &step);
+
+  // input is the query being parsed.
+  const std::string &input;
+
+  // pos is the offset of the next character.
+  size_t pos = 0;
+};
+
+/*explicit*/ Query::Impl::Parser::Parser(const std::string &s) noexcept
+    : input{s} {}
+
+void Query::Impl::Parser::parse(Impl &query) {
+  expect('$');
+  while (pos < input.size()) {
+    if (eat('.')) {
+      Step step;
+      if (!eat('*')) {
+        step.kind = Step::Kind::member;
+        step.name = name();
+      }
+      query.steps.push_back(std::move(step));
+    } else if (eat('[')) {
+      query.steps.push_back(bracket());
+    } else {
+      fail();
+    }
+  }
+  for (auto &step : query.steps) {
+    if ((step.kind == Step::Kind::index || step.kind == Step::Kind::slice) &&
+        (step.start < 0 || (step.has_end && step.end < 0))) {
+      query.streamable = false;
+    }
+  }
+}
+
+void Query::Impl::Parser::fail() const {
+  throw std::runtime_error{"Invalid query at offset " + std::to_string(pos)};
+}
+
+void Query::Impl::Parser::skip_spaces() noexcept {
+  while (pos < input.size() && (input[pos] == ' ' || input[pos] == '\t')) {
+    ++pos;
+  }
+}
+
+bool Query::Impl::Parser::eat(char ch) noexcept {
+  if (pos >= input.size() || input[pos] != ch) return false;
+  ++pos;
+  return true;
+}
+
+void Query::Impl::Parser::expect(char ch) {
+  if (!eat(ch)) fail();
+}
+
+bool Query::Impl::Parser::quote() const noexcept {
+  return pos < input.size() && (input[pos] == '\'' || input[pos] == '"');
+}
+
+std::string Query::Impl::Parser::name() {
+  size_t begin = pos;
+  while (pos < input.size()) {
+    unsigned char ch = (unsigned char)input[pos];
+    unsigned char lower = (unsigned char)(ch | 0x20);
+    if (ch < 0x80 && ch != '_' && ch != '-' && (ch < '0' || ch > '9') &&
+        (lower < 'a' || lower > 'z')) {
+      break;
+    }
+    ++pos;
+  }
+  if (pos == begin) fail();
+  return input.substr(begin, pos - begin);
+}
+
+std::string Query::Impl::Parser::quoted() {
+  if (!quote()) fail();
+  char delimiter = input[pos++];
+  std::string value;
+  while (pos < input.size() && input[pos] != delimiter) {
+    if (input[pos] == '\\') ++pos;
+    if (pos >= input.size()) fail();
+    value += input[pos++];
+  }
+  expect(delimiter);
+  return value;
+}
+
+bool Query::Impl::Parser::integer(int64_t &value) {
+  bool negative = eat('-');
+  size_t begin = pos;
+  uint64_t magnitude = 0;
+  while (pos < input.size() && input[pos] >= '0' && input[pos] <= '9') {
+    // Eighteen digits always fit into an int64.
+    if (pos - begin >= 18) fail();
+    magnitude = magnitude * 10 + (uint64_t)(input[pos++] - '0');
+  }
+  if (pos == begin) {
+    if (negative) fail();
+    return false;
+  }
+  value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+  return true;
+}
+
+Query::Impl::Step Query::Impl::Parser::bracket() {
+  Step step;
+  skip_spaces();
+  if (eat('*')) {
+    // Nothing to do, since steps are wildcards by default.
+  } else if (quote()) {
+    step.kind = Step::Kind::member;
+    step.name = quoted();
+  } else if (eat('?')) {
+    skip_spaces();
+    expect('(');
+    filter(step);
+    expect(')');
+  } else {
+    bool has_start = integer(step.start);
+    skip_spaces();
+    if (eat(':')) {
+      step.kind = Step::Kind::slice;
+      skip_spaces();
+      step.has_end = integer(step.end);
+      skip_spaces();
+      if (eat(':')) {
+        skip_spaces();
+        if (integer(step.stride) && step.stride <= 0) fail();
+      }
+    } else {
+      if (!has_start) fail();
+      step.kind = Step::Kind::index;
+    }
+  }
+  skip_spaces();
+  expect(']');
+  return step;
+}
+
+void Query::Impl::Parser::filter(Step &step) {
+  static const std::pair<const char *, Step::Op> ops[] = {
+      {"==", Step::Op::equal},        {"!=", Step::Op::not_equal},
+      {"<=", Step::Op::less_equal},   {">=", Step::Op::greater_equal},
+      {"<", Step::Op::less},          {">", Step::Op::greater},
+  };
+  step.kind = Step::Kind::filter;
+  skip_spaces();
+  expect('@');
+  for (;;) {
+    if (eat('.')) {
+      step.path.push_back(name());
+    } else if (eat('[')) {
+      skip_spaces();
+      step.path.push_back(quoted());
+      skip_spaces();
+      expect(']');
+    } else {
+      break;
+    }
+  }
+  skip_spaces();
+  for (auto &op : ops) {
+    size_t length = strlen(op.first);
+    if (input.compare(pos, length, op.first) == 0) {
+      pos += length;
+      step.op = op.second;
+      break;
+    }
+  }
+  if (step.op == Step::Op::exists) return;
+  skip_spaces();
+  if (quote()) {
+    step.literal = quoted();
+  } else {
+    // We let nlohmann/json parse numbers, true, false and null.
+    size_t begin = pos;
+    while (pos < input.size()) {
+      char ch = input[pos];
+      char lower = (char)(ch | 0x20);
+      if ((ch < '0' || ch > '9') && (lower < 'a' || lower > 'z') &&
+          ch != '+' && ch != '-' && ch != '.') {
+        break;
+      }
+      ++pos;
+    }
+    if (pos == begin) fail();
+    try {
+      step.literal = Value::parse(input.substr(begin, pos - begin));
+    } catch (const std::exception &) {
+      pos = begin;
+      fail();
+    }
+  }
+  skip_spaces();
+}
+
+// Query::Impl::Matcher is the definition of Matcher. It follows the path of
+// the value being parsed and only builds, using JSON::Impl::Builder, the
+// values matching the query and the candidates of filters, i.e. the values
+// we must look into to tell whether they, or their children, match.
+class Query::Impl::Matcher {
+ public:
+  // failure is the error that occurred, if any.
+  std::string failure;
+
+  // stopped is set when on_match has asked us to stop.
+  bool stopped = false;
+
+  // Matcher creates a matcher of @p query, which calls @p on_match for each
+  // match. Both must outlive the matcher.
+  Matcher(const Impl &query,
+          const std::function<bool(JSON &&)> &on_match) noexcept;
+
+  // The following methods implement the SAX interface.
+
+  bool null();
+  bool boolean(bool value);
+  bool number_integer(int64_t value);
+  bool number_unsigned(uint64_t value);
+  bool number_float(double value, const std::string &);
+  bool string(std::string &value);
+  bool start_object(size_t);
+  bool key(std::string &value);
+  bool end_object();
+  bool start_array(size_t);
+  bool end_array();
+
+  // binary is only required by newer versions of nlohmann/json. It is
+  // never called when parsing JSON.
+  template <typename Binary>
+  bool binary(Binary &) {
+    return false;
+  }
+
+  template <typename Exception>
+  bool parse_error(size_t, const std::string &, const Exception &exc) {
+    failure = exc.what();
+    return false;
+  }
+
+ private:
+  // dead is the state of the values that cannot match.
+  static constexpr size_t dead = SIZE_MAX;
+
+  // Frame is a container being parsed that we are not building.
+  class Frame {
+   public:
+    // array tells whether the container is an array.
+    bool array;
+
+    // state is the number of steps matched by the container, or dead.
+    size_t state;
+
+    // index is the index of the next element of an array.
+    size_t index;
+
+    // child is the state of the value of the current member of an object.
+    size_t child;
+  };
+
+  // enter returns the state of the value starting outside of the value
+  // being built, which is also the number of steps it matches.
+  size_t enter() noexcept;
+
+  // value handles the start of a value of type @p type, by calling @p event
+  // on builder if we are building it, or if we should start building it.
+  template <typename Event>
+  bool value(Value::value_t type, const Event &event);
+
+  // end handles the end of a container, calling @p event on builder if we
+  // are building it.
+  template <typename Event>
+  bool end(const Event &event);
+
+  // finish passes the matches within the value just built to on_match.
+  bool finish();
+
+  // query is the query we evaluate.
+  const Impl &query;
+
+  // on_match is the function called for each match.
+  const std::function<bool(JSON &&)> &on_match;
+
+  // frames is the stack of the containers being parsed that we are not
+  // building.
+  std::vector<Frame> frames;
+
+  // built is the value being built.
+  Value built;
+
+  // builder is the builder of built, when we are building it.
+  std::unique_ptr<JSON::Friend::Builder> builder;
+
+  // from is the number of steps matched by built.
+  size_t from = 0;
+
+  // depth is the number of containers open within built.
+  size_t depth = 0;
+};
+
+Query::Impl::Matcher::Matcher(
+    const Impl &q, const std::function<bool(JSON &&)> &f) noexcept
+    : query{q}, on_match{f} {}
+
+bool Query::Impl::Matcher::null() {
+  return value(Value::value_t::null,
+               [](JSON::Friend::Builder &b) { return b.null(); });
+}
+
+bool Query::Impl::Matcher::boolean(bool v) {
+  return value(Value::value_t::boolean,
+               [v](JSON::Friend::Builder &b) { return b.boolean(v); });
+}
+
+bool Query::Impl::Matcher::number_integer(int64_t v) {
+  return value(Value::value_t::number_integer,
+               [v](JSON::Friend::Builder &b) { return b.number_integer(v); });
+}
+
+bool Query::Impl::Matcher::number_unsigned(uint64_t v) {
+  return value(Value::value_t::number_unsigned,
+               [v](JSON::Friend::Builder &b) { return b.number_unsigned(v); });
+}
+
+bool Query::Impl::Matcher::number_float(double v, const std::string &s) {
+  return value(Value::value_t::number_float,
+               [v, &s](JSON::Friend::Builder &b) {
+                 return b.number_float(v, s);
+               });
+}
+
+bool Query::Impl::Matcher::string(std::string &v) {
+  return value(Value::value_t::string,
+               [&v](JSON::Friend::Builder &b) { return b.string(v); });
+}
+
+bool Query::Impl::Matcher::start_object(size_t n) {
+  return value(Value::value_t::object,
+               [n](JSON::Friend::Builder &b) { return b.start_object(n); });
+}
+
+bool Query::Impl::Matcher::key(std::string &v) {
+  if (builder != nullptr) {
+    if (builder->key(v)) return true;
+    failure = builder->failure;
+    return false;
+  }
+  Frame &frame = frames.back();
+  frame.child = (frame.state != dead && matches(query.steps[frame.state], v))
+                    ? frame.state + 1
+                    : dead;
+  return true;
+}
+
+bool Query::Impl::Matcher::end_object() {
+  return end([](JSON::Friend::Builder &b) { return b.end_object(); });
+}
+
+bool Query::Impl::Matcher::start_array(size_t n) {
+  return value(Value::value_t::array,
+               [n](JSON::Friend::Builder &b) { return b.start_array(n); });
+}
+
+bool Query::Impl::Matcher::end_array() {
+  return end([](JSON::Friend::Builder &b) { return b.end_array(); });
+}
+
+size_t Query::Impl::Matcher::enter() noexcept {
+  if (frames.empty()) return 0;  // The root matches no steps.
+  Frame &frame = frames.back();
+  if (!frame.array) return frame.child;
+  size_t index = frame.index++;
+  return (frame.state != dead && matches(query.steps[frame.state], index))
+             ? frame.state + 1
+             : dead;
+}
+
+template <typename Event>
+bool Query::Impl::Matcher::value(Value::value_t type, const Event &event) {
+  bool container =
+      (type == Value::value_t::object || type == Value::value_t::array);
+  if (builder == nullptr) {
+    size_t state = enter();
+    // We build a value when it matches all the steps or it passed the
+    // structural part of a filter and we need to test its content.
+    bool build =
+        state != dead &&
+        (state >= query.steps.size() ||
+         (state > 0 && query.steps[state - 1].kind == Step::Kind::filter));
+    if (!build) {
+      if (container) {
+        frames.push_back(Frame{type == Value::value_t::array, state, 0, dead});
+      }
+      return true;
+    }
+    builder.reset(new JSON::Friend::Builder{built, ParseOptions{}});
+    from = state;
+  }
+  if (!event(*builder)) {
+    failure = builder->failure;
+    return false;
+  }
+  if (container) {
+    ++depth;
+    return true;
+  }
+  return depth > 0 || finish();
+}
+
+template <typename Event>
+bool Query::Impl::Matcher::end(const Event &event) {
+  if (builder == nullptr) {
+    frames.pop_back();
+    return true;
+  }
+  if (!event(*builder)) {
+    failure = builder->failure;
+    return false;
+  }
+  return --depth > 0 || finish();
+}
+
+bool Query::Impl::Matcher::finish() {
+  builder.reset();
+  Value root;
+  std::swap(root, built);
+  if (from > 0 && !accepts(query.steps[from - 1], root)) return true;
+  std::vector<const Value *> nodes;
+  query.evaluate(root, from, nodes);
+  for (const Value *node : nodes) {
+    // The matches are disjoint and root is ours, hence we can move them.
+    JSON match;
+    std::swap(JSON::Friend::unwrap(match), *const_cast<Value *>(node));
+    if (!on_match(std::move(match))) {
+      stopped = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename... Input>
+void Query::Impl::stream(const std::function<bool(JSON &&)> &on_match,
+                         Input &&... input) const {
+  if (!streamable) {
+    throw std::runtime_error{"Cannot stream a query with negative indexes"};
+  }
+  Matcher matcher{*this, on_match};
+  if (!Value::sax_parse(std::forward<Input>(input)..., &matcher) &&
+      !matcher.stopped) {
+    throw std::runtime_error{matcher.failure};
+  }
+}
+
+Query::Query() noexcept { impl.reset(new Query::Impl); }
+
+/*static*/ Result<Query> Query::compile(const std::string &path) noexcept {
+  Result<Query> result;
+  try {
+    std::unique_ptr<Query::Impl> compiled{new Query::Impl};
+    Query::Impl::Parser{path}.parse(*compiled);
+    std::swap(result.value.impl, compiled);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
   }
-  result.value = *valuep;
-  impl->nlohmann_json = nullptr;
   return result;
 }
 
-Result<int64_t> JSON::get_value_int64() noexcept {
-  Result<int64_t> result;
-  auto valuep = impl->nlohmann_json.get_ptr<int64_t *>();
-  if (valuep == nullptr) {
+Query::Query(Query &&other) noexcept : Query{} {
+  std::swap(impl, other.impl);
+}
+
+Query &Query::operator=(Query &&other) noexcept {
+  std::swap(impl, other.impl);
+  return *this;
+}
+
+Result<std::vector<View>> Query::select(const View &root) const noexcept {
+  Result<std::vector<View>> result;
+  try {
+    if (root.node == nullptr) {
+      // A default constructed View refers to null, which has no children.
+      if (impl->steps.empty()) result.value.push_back(root);
+      return result;
+    }
+    std::vector<const Value *> nodes;
+    impl->evaluate(*static_cast<const Value *>(root.node), 0, nodes);
+    result.value.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) result.value[i].node = nodes[i];
+  } catch (const std::exception &exc) {
     result.good = false;
-    result.failure = "Not an int64";
-    return result;
+    result.value.clear();
+    result.failure = exc.what();
   }
-  result.value = *valuep;
-  impl->nlohmann_json = nullptr;
   return result;
 }
 
-Result<std::string> JSON::get_value_string() noexcept {
-  Result<std::string> result;
-  auto valuep = impl->nlohmann_json.get_ptr<std::string *>();
-  if (valuep == nullptr) {
+Result<void> Query::stream(
+    const std::string &input,
+    const std::function<bool(JSON &&match)> &on_match) const noexcept {
+  Result<void> result;
+  try {
+    impl->stream(on_match, input.data(), input.data() + input.size());
+  } catch (const std::exception &exc) {
     result.good = false;
-    result.failure = "Not a string";
-    return result;
+    result.failure = exc.what();
   }
-  std::swap(result.value, *valuep);
-  impl->nlohmann_json = nullptr;
   return result;
 }
 
-Result<void> JSON::set_value_at(const std::string &key, JSON &&value) noexcept {
+Result<void> Query::stream_fd(
+    int fd, const std::function<bool(JSON &&match)> &on_match) const noexcept {
   Result<void> result;
   try {
-    std::swap(value.impl->nlohmann_json, impl->nlohmann_json[key]);
+    std::unique_ptr<ChunkReader> reader{new FdReader{fd}};
+    ChunkStreamBuf streambuf{
+        std::unique_ptr<ChunkReader>{new DecompressReader{std::move(reader)}}};
+    std::istream stream{&streambuf};
+    try {
+      impl->stream(on_match, stream);
+    } catch (const std::exception &) {
+      if (!streambuf.reader->failed()) throw;
+      result.good = false;
+      result.failure = "Cannot read input";
+    }
   } catch (const std::exception &exc) {
     result.good = false;
     result.failure = exc.what();
@@ -339,30 +7026,345 @@ Result<void> JSON::set_value_at(const std::string &key, JSON &&value) noexcept {
   return result;
 }
 
-void JSON::set_value_array(std::vector<JSON> &&value) noexcept {
-  std::vector<nlohmann::json> array;
-  for (JSON &entry : value) {
-    array.push_back(std::move(entry.impl->nlohmann_json));
+Query::~Query() noexcept {}
+
+// Store::Impl is the concrete implementation of Store.
+class Store::Impl {
+ public:
+  // record_magic marks the beginning of each record. A record consists of
+  // the magic, the key size (32 bit), the snapshot size (64 bit), the key
+  // and the snapshot. Sizes are little endian.
+  static constexpr char record_magic[4] = {'M', 'K', 'J', 'R'};
+
+  // record_header_size is the size of a record's header.
+  static constexpr size_t record_header_size = 16;
+
+  // Location is the location of a snapshot inside the file.
+  class Location {
+   public:
+    // offset is the offset of the snapshot.
+    uint64_t offset = 0;
+
+    // size is the size of the snapshot.
+    uint64_t size = 0;
+  };
+
+  // fd is the file descriptor of the open file.
+  int fd = -1;
+
+  // file_size is the number of bytes that have been written to the file.
+  uint64_t file_size = 0;
+
+  // pending contains the records queued for the next flush.
+  std::string pending;
+
+  // index maps each key to the location of its latest snapshot. When the
+  // offset is past file_size, the snapshot is still pending.
+  std::map<std::string, Location> index;
+
+#ifndef _WIN32
+  // mapping is the memory mapped file, if any.
+  void *mapping = nullptr;
+
+  // mapping_size is the size of mapping.
+  size_t mapping_size = 0;
+#endif
+
+  // read_at reads exactly @p count bytes at @p offset into @p buffer.
+  bool read_at(uint64_t offset, void *buffer, size_t count) noexcept;
+
+  // write_all writes all of @p data at the end of the file.
+  bool write_all(const std::string &data) noexcept;
+
+  // truncate truncates the file at @p size.
+  bool truncate(uint64_t size) noexcept;
+
+  // scan rebuilds the index by reading the headers of all records. It
+  // truncates a partially written last record but fails, without changing
+  // the file, if any other record is corrupt.
+  Result<void> scan(uint64_t size) noexcept;
+
+  // load loads the snapshot at @p location from the file.
+  Result<JSON> load(const Location &location) noexcept;
+
+  // close unmaps and closes the file.
+  void close() noexcept;
+};
+
+/*static*/ constexpr char Store::Impl::record_magic[4];
+
+bool Store::Impl::read_at(uint64_t offset, void *buffer,
+                          size_t count) noexcept {
+  auto base = static_cast<char *>(buffer);
+#ifdef _WIN32
+  if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return false;
+#endif
+  while (count > 0) {
+#ifdef _WIN32
+    int n = _read(fd, base, (unsigned int)std::min<size_t>(count, INT_MAX));
+#else
+    ssize_t n = pread(fd, base, count, (off_t)offset);
+#endif
+    if (n <= 0) return false;
+    base += n, count -= (size_t)n, offset += (uint64_t)n;
   }
-  impl->nlohmann_json = std::move(array);
+  return true;
 }
 
-void JSON::set_value_float64(double value) noexcept {
-  impl->nlohmann_json = value;
+bool Store::Impl::write_all(const std::string &data) noexcept {
+  const char *base = data.data();
+  size_t count = data.size();
+#ifdef _WIN32
+  if (_lseeki64(fd, (__int64)file_size, SEEK_SET) < 0) return false;
+#endif
+  while (count > 0) {
+#ifdef _WIN32
+    int n = _write(fd, base, (unsigned int)std::min<size_t>(count, INT_MAX));
+#else
+    ssize_t n = pwrite(fd, base, count, (off_t)file_size);
+#endif
+    if (n <= 0) return false;
+    base += n, count -= (size_t)n, file_size += (uint64_t)n;
+  }
+  return true;
 }
 
-void JSON::set_value_int64(int64_t value) noexcept {
-  impl->nlohmann_json = value;
+bool Store::Impl::truncate(uint64_t size) noexcept {
+#ifdef _WIN32
+  return _chsize_s(fd, (__int64)size) == 0;
+#else
+  return ftruncate(fd, (off_t)size) == 0;
+#endif
 }
 
-void JSON::set_value_string(std::string &&value) noexcept {
-  if (!mk::data::contains_valid_utf8(value)) {
-    value = mk::data::base64_encode(std::move(value));
+Result<void> Store::Impl::scan(uint64_t size) noexcept {
+  Result<void> result;
+  uint64_t offset = 0;
+  // A record whose header or payload runs past the end of the file is the
+  // last one, partially written, e.g., because of a crash.
+  while (size - offset >= record_header_size) {
+    uint8_t header[record_header_size];
+    if (!read_at(offset, header, sizeof(header))) {
+      result.good = false;
+      result.failure = "Cannot read store";
+      return result;
+    }
+    if (memcmp(header, record_magic, sizeof(record_magic)) != 0) {
+      result.good = false;
+      result.failure = "Corrupt store record at offset " +
+                       std::to_string(offset);
+      return result;
+    }
+    uint64_t key_size = 0;
+    uint64_t snapshot_size = 0;
+    for (size_t i = 0; i < 4; ++i) {
+      key_size |= uint64_t{header[4 + i]} << (8 * i);
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      snapshot_size |= uint64_t{header[8 + i]} << (8 * i);
+    }
+    uint64_t available = size - offset - record_header_size;
+    if (key_size > available || snapshot_size > available - key_size) break;
+    std::string key;
+    key.resize((size_t)key_size);
+    if (!read_at(offset + record_header_size, &key[0], key.size())) {
+      result.good = false;
+      result.failure = "Cannot read store";
+      return result;
+    }
+    Location location;
+    location.offset = offset + record_header_size + key_size;
+    location.size = snapshot_size;
+    index[std::move(key)] = location;
+    offset = location.offset + location.size;
+  }
+  file_size = offset;
+  // Discard the partially written record, if any, so that the records that
+  // we'll append next will be reachable when scanning the file again.
+  if (offset != size && !truncate(offset)) {
+    result.good = false;
+    result.failure = "Cannot truncate store";
+  }
+  return result;
+}
+
+Result<JSON> Store::Impl::load(const Location &location) noexcept {
+#ifndef _WIN32
+  if (location.offset + location.size > mapping_size) {
+    if (mapping != nullptr) {
+      (void)munmap(mapping, mapping_size);
+      mapping = nullptr;
+      mapping_size = 0;
+    }
+    void *p = mmap(nullptr, (size_t)file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      mapping = p;
+      mapping_size = (size_t)file_size;
+    }
+  }
+  if (location.offset + location.size <= mapping_size) {
+    return JSON::load_snapshot(static_cast<char *>(mapping) + location.offset,
+                               (size_t)location.size);
+  }
+#endif
+  // Fall back to reading the snapshot, e.g. if we cannot mmap.
+  Result<JSON> result;
+  std::string snapshot;
+  try {
+    snapshot.resize((size_t)location.size);
+  } catch (const std::exception &exc) {
+    result.good = false;
+    result.failure = exc.what();
+    return result;
+  }
+  if (!read_at(location.offset, &snapshot[0], snapshot.size())) {
+    result.good = false;
+    result.failure = "Cannot read snapshot";
+    return result;
+  }
+  return JSON::load_snapshot(snapshot.data(), snapshot.size());
+}
+
+void Store::Impl::close() noexcept {
+#ifndef _WIN32
+  if (mapping != nullptr) {
+    (void)munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+#endif
+  if (fd != -1) {
+#ifdef _WIN32
+    (void)_close(fd);
+#else
+    (void)::close(fd);
+#endif
+    fd = -1;
+  }
+  file_size = 0;
+  pending.clear();
+  index.clear();
+}
+
+Store::Store() noexcept { impl.reset(new Store::Impl); }
+
+Result<void> Store::open(const std::string &path) noexcept {
+  Result<void> result;
+  (void)flush();
+  impl->close();
+#ifdef _WIN32
+  impl->fd = _open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY,
+                   _S_IREAD | _S_IWRITE);
+  __int64 size = (impl->fd != -1) ? _lseeki64(impl->fd, 0, SEEK_END) : -1;
+#else
+  impl->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  struct stat sb {};
+  off_t size = (impl->fd != -1 && fstat(impl->fd, &sb) == 0) ? sb.st_size : -1;
+#endif
+  if (size < 0) {
+    impl->close();
+    result.good = false;
+    result.failure = "Cannot open store";
+    return result;
+  }
+  try {
+    result = impl->scan((uint64_t)size);
+    if (!result.good) impl->close();
+  } catch (const std::exception &exc) {
+    impl->close();
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<void> Store::put(const std::string &key, const JSON &value) noexcept {
+  Result<void> result;
+  if (impl->fd == -1) {
+    result.good = false;
+    result.failure = "Store is not open";
+    return result;
+  }
+  if (key.size() > UINT32_MAX) {
+    result.good = false;
+    result.failure = "Key too long";
+    return result;
+  }
+  Result<std::string> snapshot = value.dump_snapshot();
+  if (!snapshot.good) {
+    result.good = false;
+    result.failure = std::move(snapshot.failure);
+    return result;
+  }
+  size_t pending_size = impl->pending.size();
+  try {
+    uint8_t header[Store::Impl::record_header_size];
+    memcpy(header, Store::Impl::record_magic, sizeof(Store::Impl::record_magic));
+    for (size_t i = 0; i < 4; ++i) {
+      header[4 + i] = (uint8_t)(uint64_t{key.size()} >> (8 * i));
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      header[8 + i] = (uint8_t)(uint64_t{snapshot.value.size()} >> (8 * i));
+    }
+    impl->pending.append((const char *)header, sizeof(header));
+    impl->pending.append(key);
+    Store::Impl::Location location;
+    location.offset = impl->file_size + impl->pending.size();
+    location.size = snapshot.value.size();
+    impl->pending.append(snapshot.value);
+    impl->index[key] = location;
+  } catch (const std::exception &exc) {
+    impl->pending.resize(pending_size);
+    result.good = false;
+    result.failure = exc.what();
+  }
+  return result;
+}
+
+Result<void> Store::flush() noexcept {
+  Result<void> result;
+  if (impl->pending.empty()) return result;
+  uint64_t file_size = impl->file_size;
+  if (!impl->write_all(impl->pending)) {
+    // Drop the partially written records. Should truncate fail as well,
+    // the next open will discard the partially written record anyway.
+    (void)impl->truncate(file_size);
+    impl->file_size = file_size;
+    result.good = false;
+    result.failure = "Cannot write store";
+    return result;
+  }
+  impl->pending.clear();
+  return result;
+}
+
+bool Store::contains(const std::string &key) const noexcept {
+  return impl->index.count(key) > 0;
+}
+
+Result<JSON> Store::get(const std::string &key) noexcept {
+  auto it = impl->index.find(key);
+  if (it == impl->index.end()) {
+    Result<JSON> result;
+    result.good = false;
+    result.failure = "No such key";
+    return result;
+  }
+  const Store::Impl::Location &location = it->second;
+  if (location.offset >= impl->file_size) {
+    return JSON::load_snapshot(
+        impl->pending.data() + (location.offset - impl->file_size),
+        (size_t)location.size);
   }
-  impl->nlohmann_json = std::move(value);
+  return impl->load(location);
 }
 
-JSON::~JSON() noexcept {}
+size_t Store::size() const noexcept { return impl->index.size(); }
+
+Store::~Store() noexcept {
+  (void)flush();
+  impl->close();
+}
 
 }  // namespace json
 }  // namespace mk
@@ -7,11 +7,111 @@
 #define MKJSON_INLINE_IMPL
 #include "mkjson.hpp"
 
+#ifdef MKJSON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef MKJSON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <thread>
 #include <type_traits>
 
 using namespace mk::json;
 
+// heap_allocations counts the calls to operator new made by each thread.
+// We replace all the non-aligned forms of operator new and delete, since
+// sanitizers may otherwise pair ours with theirs.
+static thread_local size_t heap_allocations = 0;
+
+static void *counted_malloc(size_t size) noexcept {
+  heap_allocations += 1;
+  return malloc((size > 0) ? size : 1);
+}
+
+void *operator new(size_t size) {
+  void *ptr = counted_malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc{};
+  return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return counted_malloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return counted_malloc(size);
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete[](void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { free(ptr); }
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { free(ptr); }
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+#endif
+
+// NullSax is a SAX consumer that accepts anything and builds nothing, for
+// measuring what the nlohmann/json parser allocates by itself.
+class NullSax {
+ public:
+  bool null() { return true; }
+  bool boolean(bool) { return true; }
+  bool number_integer(int64_t) { return true; }
+  bool number_unsigned(uint64_t) { return true; }
+  bool number_float(double, const std::string &) { return true; }
+  bool string(std::string &) { return true; }
+  bool start_object(size_t) { return true; }
+  bool key(std::string &) { return true; }
+  bool end_object() { return true; }
+  bool start_array(size_t) { return true; }
+  bool end_array() { return true; }
+
+  template <typename Binary>
+  bool binary(Binary &) {
+    return false;
+  }
+
+  template <typename Exception>
+  bool parse_error(size_t, const std::string &, const Exception &) {
+    return false;
+  }
+};
+
+class HooksCounters {
+ public:
+  std::atomic<size_t> allocations{0};
+  std::atomic<size_t> outstanding{0};
+};
+
+static void *counting_allocate(size_t size, size_t, void *opaque) {
+  auto counters = static_cast<HooksCounters *>(opaque);
+  counters->allocations += 1;
+  counters->outstanding += size;
+  return malloc(size);
+}
+
+static void counting_deallocate(void *ptr, size_t size, size_t, void *opaque) {
+  static_cast<HooksCounters *>(opaque)->outstanding -= size;
+  free(ptr);
+}
+
 TEST_CASE("parse works as expected") {
   SECTION("for a valid JSON") {
     Result<JSON> result = JSON::parse(R"({"success": true})");
@@ -27,6 +127,83 @@ TEST_CASE("parse works as expected") {
   }
 }
 
+TEST_CASE("parse works as expected when reusing recycled nodes") {
+  const std::string input =
+      R"({"a": [1, -2, 3.5, "xo", null, true, {"b": ["longer than SSO strings"]}],)"
+      R"( "c": {"d": [], "e": {}, "f": ""}, "g": 18446744073709551615})";
+  std::string deep;
+  for (size_t i = 0; i < 200; ++i) deep += R"({"x": [)";
+  deep += "0";
+  for (size_t i = 0; i < 200; ++i) deep += "]}";
+
+  SECTION("for many documents") {
+    Result<std::string> expect = JSON::parse(input).value.dump();
+    REQUIRE(expect.good);
+    for (size_t i = 0; i < 1000; ++i) {
+      Result<JSON> doc = JSON::parse(input);
+      REQUIRE(doc.good);
+      Result<std::string> dump = doc.value.dump();
+      REQUIRE(dump.good);
+      REQUIRE(dump.value == expect.value);
+    }
+  }
+
+  SECTION("for deeply nested documents") {
+    Result<std::string> expect = JSON::parse(deep).value.dump();
+    REQUIRE(expect.good);
+    for (size_t i = 0; i < 10; ++i) {
+      Result<JSON> doc = JSON::parse(deep);
+      REQUIRE(doc.good);
+      REQUIRE(doc.value.dump().value == expect.value);
+    }
+  }
+
+  SECTION("after a parse error") {
+    for (size_t i = 0; i < 10; ++i) {
+      Result<JSON> doc = JSON::parse(R"({"a": ["b", {"c": )");
+      REQUIRE(!doc.good);
+      REQUIRE(doc.failure.size() > 0);
+      REQUIRE(doc.value.is_null());
+    }
+    Result<JSON> doc = JSON::parse(input);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.is_object());
+  }
+
+  SECTION("when extracting and setting values") {
+    for (size_t i = 0; i < 100; ++i) {
+      Result<JSON> doc = JSON::parse(R"(["hello", ["world"]])");
+      REQUIRE(doc.good);
+      Result<std::vector<JSON>> array = doc.value.get_value_array();
+      REQUIRE(array.good);
+      REQUIRE(array.value.size() == 2);
+      REQUIRE(array.value[0].get_value_string().value == "hello");
+      array.value[1].set_value_string("hello, world");
+      JSON copy;
+      copy.set_value_array(std::move(array.value));
+      REQUIRE(copy.dump().value == R"([null,"hello, world"])");
+    }
+  }
+
+  SECTION("from many threads") {
+    std::vector<std::thread> threads;
+    std::vector<std::vector<Result<JSON>>> docs(4);
+    for (size_t t = 0; t < docs.size(); ++t) {
+      threads.push_back(std::thread([&docs, &input, t]() {
+        for (size_t i = 0; i < 100; ++i) {
+          docs[t].push_back(JSON::parse(input));
+        }
+      }));
+    }
+    for (std::thread &thread : threads) thread.join();
+    // Here the documents are destroyed by another thread.
+    for (auto &entry : docs) {
+      REQUIRE(entry.size() == 100);
+      for (auto &doc : entry) REQUIRE(doc.good);
+    }
+  }
+}
+
 // clang-format off
 const uint8_t binary_input[] = {
   0x57, 0xe5, 0x79, 0xfb, 0xa6, 0xbb, 0x0d, 0xbc, 0xce, 0xbd, 0xa7, 0xa0,
@@ -54,7 +231,7 @@ TEST_CASE("serialize works as expected") {
 
   SECTION("for an invalid JSON") {
     JSON json;
-    nlohmann::json &inner = JSON::Friend::unwrap(json);
+    Value &inner = JSON::Friend::unwrap(json);
     inner = std::string{(char *)binary_input, sizeof(binary_input)};
     Result<std::string> result = json.dump();
     REQUIRE(!result.good);
@@ -147,10 +324,18 @@ TEST_CASE("get_value_at works as expected") {
     Result<JSON> e = doc.value.get_value_at("success");
     REQUIRE(e.good);
     REQUIRE(e.value.is_boolean());
-    nlohmann::json &inner = JSON::Friend::unwrap(e.value);
+    Value &inner = JSON::Friend::unwrap(e.value);
     REQUIRE(inner.count("success") <= 0);
   }
 
+  SECTION("with a precomputed key") {
+    static const JSON::Key success{"success"};
+    Result<JSON> e = doc.value.get_value_at(success);
+    REQUIRE(e.good);
+    REQUIRE(e.value.is_boolean());
+    REQUIRE(!doc.value.get_value_at(success).good);
+  }
+
   SECTION("when the key is missing") {
     Result<JSON> e = doc.value.get_value_at("failure");
     REQUIRE(!e.good);
@@ -189,6 +374,264 @@ TEST_CASE("get_value_array works as expected") {
   }
 }
 
+TEST_CASE("get_value_array_xxx works as expected") {
+  SECTION("for a valid array of float64") {
+    Result<JSON> doc = JSON::parse("[1.5, -2.25, 0.0]");
+    REQUIRE(doc.good);
+    Result<std::vector<double>> array = doc.value.get_value_array_float64();
+    REQUIRE(array.good);
+    REQUIRE((array.value == std::vector<double>{1.5, -2.25, 0.0}));
+    REQUIRE(doc.value.is_null());
+  }
+
+  SECTION("for a valid array of int64") {
+    Result<JSON> doc = JSON::parse("[1, -2, 3]");
+    REQUIRE(doc.good);
+    Result<std::vector<int64_t>> array = doc.value.get_value_array_int64();
+    REQUIRE(array.good);
+    REQUIRE((array.value == std::vector<int64_t>{1, -2, 3}));
+    REQUIRE(doc.value.is_null());
+  }
+
+  SECTION("for a valid array of string") {
+    Result<JSON> doc = JSON::parse(R"(["a", "longer than SSO strings"])");
+    REQUIRE(doc.good);
+    Result<std::vector<std::string>> array =
+        doc.value.get_value_array_string();
+    REQUIRE(array.good);
+    REQUIRE((array.value ==
+             std::vector<std::string>{"a", "longer than SSO strings"}));
+    REQUIRE(doc.value.is_null());
+  }
+
+  SECTION("for an empty array") {
+    Result<JSON> doc = JSON::parse("[]");
+    REQUIRE(doc.good);
+    Result<std::vector<int64_t>> array = doc.value.get_value_array_int64();
+    REQUIRE(array.good);
+    REQUIRE(array.value.empty());
+  }
+
+  SECTION("for a heterogeneous array") {
+    Result<JSON> doc = JSON::parse(R"([1, 2, "3"])");
+    REQUIRE(doc.good);
+    Result<std::vector<int64_t>> array = doc.value.get_value_array_int64();
+    REQUIRE(!array.good);
+    REQUIRE(array.failure.size() > 0);
+    REQUIRE(doc.value.dump().value == R"([1,2,"3"])");
+    std::clog << array.failure << std::endl;
+  }
+
+  SECTION("for a non array") {
+    Result<JSON> doc = JSON::parse("{}");
+    REQUIRE(doc.good);
+    Result<std::vector<double>> array = doc.value.get_value_array_float64();
+    REQUIRE(!array.good);
+    REQUIRE(array.failure.size() > 0);
+    std::clog << array.failure << std::endl;
+  }
+}
+
+TEST_CASE("set_value_array_xxx works as expected") {
+  JSON doc;
+
+  SECTION("for float64") {
+    doc.set_value_array_float64({1.5, -2.25});
+    REQUIRE(doc.dump().value == "[1.5,-2.25]");
+  }
+
+  SECTION("for int64") {
+    doc.set_value_array_int64({1, -2, 3});
+    REQUIRE(doc.dump().value == "[1,-2,3]");
+  }
+
+  SECTION("for string") {
+    doc.set_value_array_string({"a", std::string{"\xc3\x28", 2}});
+    REQUIRE(doc.dump().value == R"(["a","wyg="])");
+  }
+}
+
+TEST_CASE("packed arrays work as expected") {
+  std::vector<int64_t> samples;
+  for (int64_t i = 0; i < 1000; ++i) samples.push_back(i * i - 500);
+  JSON doc;
+  doc.set_value_array_int64(std::vector<int64_t>{samples});
+  JSON unpacked;
+  {
+    std::vector<JSON> array;
+    for (int64_t sample : samples) {
+      JSON entry;
+      entry.set_value_int64(sample);
+      array.push_back(std::move(entry));
+    }
+    unpacked.set_value_array(std::move(array));
+  }
+
+  SECTION("when inspecting and dumping") {
+    REQUIRE(doc.is_array());
+    REQUIRE(!doc.is_null());
+    REQUIRE(doc.dump().value == unpacked.dump().value);
+    REQUIRE(doc.memory_usage() < unpacked.memory_usage());
+    REQUIRE(doc.compact().good);
+    doc.shrink_to_fit();
+    REQUIRE(doc.dump().value == unpacked.dump().value);
+  }
+
+  SECTION("when dumping float64") {
+    std::vector<double> values{0.1, -2.5, 1.0, 1e300, 3.14159};
+    JSON json;
+    json.set_value_array_float64(std::vector<double>{values});
+    Result<JSON> expected = JSON::parse("[0.1, -2.5, 1.0, 1e300, 3.14159]");
+    REQUIRE(expected.good);
+    REQUIRE(json.dump().value == expected.value.dump().value);
+  }
+
+  SECTION("when extracting the same type") {
+    Result<std::vector<int64_t>> array = doc.get_value_array_int64();
+    REQUIRE(array.good);
+    REQUIRE(array.value == samples);
+    REQUIRE(doc.is_null());
+  }
+
+  SECTION("when extracting another type") {
+    Result<std::vector<double>> array = doc.get_value_array_float64();
+    REQUIRE(!array.good);
+    REQUIRE(doc.dump().value == unpacked.dump().value);
+    Result<std::string> string = doc.get_value_string();
+    REQUIRE(!string.good);
+    REQUIRE(doc.is_array());
+  }
+
+  SECTION("when extracting a generic array") {
+    Result<std::vector<JSON>> array = doc.get_value_array();
+    REQUIRE(array.good);
+    REQUIRE(array.value.size() == samples.size());
+    REQUIRE(array.value[3].get_value_int64().value == samples[3]);
+  }
+
+  SECTION("when inserting into an object") {
+    Result<JSON> object = JSON::parse("{}");
+    REQUIRE(object.good);
+    REQUIRE(object.value.set_value_at("samples", std::move(doc)).good);
+    REQUIRE(object.value.dump().value ==
+            R"({"samples":)" + unpacked.dump().value + "}");
+  }
+
+  SECTION("where the array stays packed") {
+    // A node takes at least twice as much memory as a packed element.
+    size_t packed_usage = doc.memory_usage();
+    size_t nodes_usage = unpacked.memory_usage();
+    REQUIRE(packed_usage < nodes_usage);
+    Result<JSON> parsed = JSON::parse(unpacked.dump().value);
+    REQUIRE(parsed.good);
+    REQUIRE(parsed.value.memory_usage() < nodes_usage);
+    JSON more;
+    more.set_value_array_int64(std::vector<int64_t>{samples});
+    REQUIRE(parsed.value.append_array(std::move(more)).good);
+    REQUIRE(parsed.value.memory_usage() < 2 * nodes_usage);
+    // Nested arrays are nodes, hence a packed array is unpacked when it is
+    // inserted into an object and it is not packed again when extracted.
+    Result<JSON> object = JSON::parse(R"({"samples": null})");
+    REQUIRE(object.good);
+    REQUIRE(object.value.set_value_at("samples", std::move(doc)).good);
+    REQUIRE(object.value.memory_usage() >= nodes_usage);
+    Result<JSON> member = object.value.get_value_at("samples");
+    REQUIRE(member.good);
+    REQUIRE(member.value.memory_usage() >= nodes_usage);
+    REQUIRE(member.value.dump().value == unpacked.dump().value);
+  }
+
+  SECTION("when taking a snapshot") {
+    Result<std::string> snapshot = doc.dump_snapshot();
+    REQUIRE(snapshot.good);
+    Result<JSON> other =
+        JSON::load_snapshot(snapshot.value.data(), snapshot.value.size());
+    REQUIRE(other.good);
+    REQUIRE(other.value.dump().value == unpacked.dump().value);
+  }
+
+  SECTION("when writing to a file") {
+    const char *path = "unit-tests-packed.json";
+    std::FILE *filep = std::fopen(path, "wb");
+    REQUIRE(filep != nullptr);
+    Result<void> result = doc.dump_fd(fileno(filep), Compression::none);
+    std::fclose(filep);
+    REQUIRE(result.good);
+    filep = std::fopen(path, "rb");
+    REQUIRE(filep != nullptr);
+    Result<JSON> other = JSON::parse_fd(fileno(filep));
+    std::fclose(filep);
+    REQUIRE(other.good);
+    REQUIRE(other.value.dump().value == unpacked.dump().value);
+    (void)std::remove(path);
+  }
+}
+
+TEST_CASE("packed arrays are parsed and dumped like other arrays") {
+  SECTION("for int64") {
+    std::vector<int64_t> values{0, 1, -1, 9, 10, 99, 100, -12345,
+                                INT64_MAX, INT64_MIN, INT64_MIN + 1};
+    for (int64_t i = 1; i < 1000000000000000000; i *= 7) {
+      values.push_back(i);
+      values.push_back(-i);
+    }
+    JSON packed;
+    packed.set_value_array_int64(std::vector<int64_t>{values});
+    nlohmann::json expected = values;
+    REQUIRE(packed.dump().value == expected.dump());
+  }
+
+  SECTION("for float64") {
+    std::vector<double> values{0.0, -0.0, 0.1, 1.0, -2.5, 1e-7, 1e15, 1e16,
+                               1e300, 5e-324, 123456789012345.0};
+    uint64_t state = 17;
+    for (size_t i = 0; i < 10000; ++i) {
+      state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+      double value = 0.0;
+      memcpy(&value, &state, sizeof(value));
+      if (std::isfinite(value)) values.push_back(value);
+    }
+    JSON packed;
+    packed.set_value_array_float64(std::vector<double>{values});
+    nlohmann::json expected = values;
+    Result<std::string> dump = packed.dump();
+    REQUIRE(dump.good);
+    REQUIRE(dump.value == expected.dump());
+    Result<JSON> doc = JSON::parse(dump.value);
+    REQUIRE(doc.good);
+    Result<std::vector<double>> array = doc.value.get_value_array_float64();
+    REQUIRE(array.good);
+    REQUIRE(array.value.size() == values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      REQUIRE(memcmp(&array.value[i], &values[i], sizeof(double)) == 0);
+    }
+  }
+
+  SECTION("for valid inputs") {
+    for (const std::string &input : std::vector<std::string>{
+             "[1,2,3]", " [ -1 , 0 , 1 ] ", "[-9223372036854775808]",
+             "[9223372036854775807]", "[1.5,-2e3,3E-2,0.0]", "[1,2.5]",
+             "[18446744073709551615]", "[-9223372036854775809]", "[]",
+             "[1,[2]]", "[1,null]", "[1.0,\"x\"]"}) {
+      Result<JSON> doc = JSON::parse(input);
+      REQUIRE(doc.good);
+      nlohmann::json expected = nlohmann::json::parse(input);
+      REQUIRE(doc.value.dump().value == expected.dump());
+    }
+  }
+
+  SECTION("for invalid inputs") {
+    for (const std::string &input : std::vector<std::string>{
+             "[", "[1", "[1,", "[1,]", "[01]", "[-]", "[1.]", "[.5]",
+             "[1e]", "[1e+]", "[1 2]", "[1]]", "[1] x", "[1e400]",
+             "[-1e400]", "[+1]"}) {
+      Result<JSON> doc = JSON::parse(input);
+      REQUIRE(!doc.good);
+      REQUIRE(doc.failure.size() > 0);
+    }
+  }
+}
+
 TEST_CASE("get_value_boolean works as expected") {
   SECTION("for a valid boolean") {
     Result<JSON> doc = JSON::parse("true");
@@ -265,6 +708,306 @@ TEST_CASE("get_value_string works as expected") {
   }
 }
 
+TEST_CASE("Result chaining works as expected") {
+  Result<int> good;
+  good.value = 2;
+  Result<int> bad;
+  bad.good = false;
+  bad.failure = "bad";
+  auto half = [](int &value) {
+    Result<double> result;
+    result.value = value / 2.0;
+    return result;
+  };
+  auto twice = [](int &value) { return value * 2; };
+  auto recover = [](const std::string &failure) {
+    Result<int> result;
+    result.value = (int)failure.size();
+    return result;
+  };
+
+  SECTION("and_then") {
+    REQUIRE(good.and_then(half).value == 1.0);
+    Result<double> r = bad.and_then(half);
+    REQUIRE(!r.good);
+    REQUIRE(r.failure == "bad");
+    auto moved = [](int &&value) {
+      Result<int> result;
+      result.value = value;
+      return result;
+    };
+    REQUIRE(std::move(good).and_then(moved).value == 2);
+    REQUIRE(std::move(bad).and_then(moved).failure == "bad");
+  }
+
+  SECTION("transform") {
+    REQUIRE(good.transform(twice).value == 4);
+    REQUIRE(bad.transform(twice).failure == "bad");
+    REQUIRE(Result<void>{}.transform([]() { return 7; }).value == 7);
+  }
+
+  SECTION("or_else") {
+    REQUIRE(good.or_else(recover).value == 2);
+    REQUIRE(bad.or_else(recover).value == 3);
+    Result<void> failed;
+    failed.good = false;
+    failed.failure = "x";
+    REQUIRE(failed.or_else([](const std::string &) { return Result<void>{}; }).good);
+    REQUIRE(!failed.and_then([]() { return Result<int>{}; }).good);
+  }
+}
+
+TEST_CASE("View works as expected") {
+  Result<JSON> doc = JSON::parse(R"({"a": {"b": ["x", 1, 2.5, true, null, {}]}, "c": [1, 2]})");
+  REQUIRE(doc.good);
+  Result<View> root = doc.value.view();
+  REQUIRE(root.good);
+
+  SECTION("for chained lookups") {
+    static const JSON::Key a{"a"};
+    Result<std::string> x = root.value.at(a)
+        .and_then([](View v) { return v.at("b"); })
+        .and_then([](View v) { return v.at(0); })
+        .and_then([](View v) { return v.get_value_string(); });
+    REQUIRE(x.good);
+    REQUIRE(x.value == "x");
+    Result<std::string> missing = root.value.at("a")
+        .and_then([](View v) { return v.at("nonexistent"); })
+        .and_then([](View v) { return v.get_value_string(); });
+    REQUIRE(!missing.good);
+    std::clog << missing.failure << std::endl;
+    REQUIRE(doc.value.dump().value == R"({"a":{"b":["x",1,2.5,true,null,{}]},"c":[1,2]})");
+  }
+
+  SECTION("for reading values") {
+    View b = root.value.at("a").value.at("b").value;
+    REQUIRE(b.is_array());
+    REQUIRE(b.size() == 6);
+    REQUIRE(b.at(1).value.get_value_int64().value == 1);
+    REQUIRE(b.at(2).value.get_value_float64().value == 2.5);
+    REQUIRE(b.at(3).value.get_value_boolean().value);
+    REQUIRE(b.at(4).value.is_null());
+    REQUIRE(b.at(5).value.is_object());
+    REQUIRE(!b.at(6).good);
+    REQUIRE(!b.at("x").good);
+    REQUIRE(!b.at(0).value.get_value_int64().good);
+    std::string buffer = "a";
+    REQUIRE(b.at(0).value.append_value_string(buffer).good);
+    REQUIRE(buffer == "ax");
+    REQUIRE(b.dump().value == R"(["x",1,2.5,true,null,{}])");
+    REQUIRE(View{}.is_null());
+    REQUIRE(View{}.dump().value == "null");
+  }
+
+  SECTION("for packed arrays") {
+    Result<JSON> packed = JSON::parse("[1, 2, 3]");
+    REQUIRE(packed.good);
+    Result<View> view = packed.value.view();
+    REQUIRE(view.good);
+    REQUIRE(view.value.size() == 3);
+    REQUIRE(view.value.at(2).value.get_value_int64().value == 3);
+  }
+}
+
+TEST_CASE("get_value_object and set_value_object work as expected") {
+  Result<JSON> doc = JSON::parse(R"({"a": 1, "b": [true]})");
+  REQUIRE(doc.good);
+  Result<std::map<std::string, JSON>> members = doc.value.get_value_object();
+  REQUIRE(members.good);
+  REQUIRE(members.value.size() == 2);
+  REQUIRE(members.value["a"].get_value_int64().value == 1);
+  REQUIRE(doc.value.is_null());
+  REQUIRE(!doc.value.get_value_object().good);
+  JSON json;
+  json.set_value_object(std::move(members.value));
+  REQUIRE(json.dump().value == R"({"a":null,"b":[true]})");
+}
+
+class Point {
+ public:
+  int32_t x = 0;
+  int32_t y = 0;
+};
+
+namespace mk {
+namespace json {
+
+template <>
+class Traits<Point> {
+ public:
+  static Result<Point> get(JSON &json) noexcept {
+    Result<Point> result;
+    Result<std::map<std::string, int32_t>> m = json.get_value<std::map<std::string, int32_t>>();
+    if (!m.good || m.value.count("x") <= 0 || m.value.count("y") <= 0) {
+      result.good = false;
+      result.failure = "Not a point";
+      return result;
+    }
+    result.value.x = m.value["x"];
+    result.value.y = m.value["y"];
+    return result;
+  }
+
+  static Result<void> set(JSON &json, Point &&value) noexcept {
+    return json.set_value(std::map<std::string, int32_t>{{"x", value.x}, {"y", value.y}});
+  }
+};
+
+}  // namespace json
+}  // namespace mk
+
+template <typename Type>
+static Result<Type> convert(const std::string &input) {
+  Result<JSON> doc = JSON::parse(input);
+  REQUIRE(doc.good);
+  return doc.value.get_value<Type>();
+}
+
+template <typename Type>
+static std::string serialize(Type value) {
+  JSON json;
+  REQUIRE(json.set_value(std::move(value)).good);
+  return json.dump().value;
+}
+
+TEST_CASE("get_value and set_value work as expected") {
+  SECTION("for integers") {
+    REQUIRE(convert<uint8_t>("255").value == 255);
+    REQUIRE(!convert<uint8_t>("256").good);
+    REQUIRE(!convert<uint8_t>("-1").good);
+    REQUIRE(convert<int16_t>("-32768").value == -32768);
+    REQUIRE(!convert<int16_t>("32768").good);
+    REQUIRE(convert<uint64_t>("9223372036854775807").value == INT64_MAX);
+    REQUIRE(convert<int64_t>("-9223372036854775808").value == INT64_MIN);
+    REQUIRE(!convert<int>("1.5").good);
+    REQUIRE(serialize<uint16_t>(65535) == "65535");
+    REQUIRE(serialize<int8_t>(-128) == "-128");
+    JSON json;
+    json.set_value_int64(17);
+    REQUIRE(!json.set_value<uint64_t>((uint64_t)INT64_MAX + 1).good);
+    REQUIRE(json.get_value_int64().value == 17);
+  }
+
+  SECTION("for other scalars") {
+    REQUIRE(convert<bool>("true").value);
+    REQUIRE(convert<float>("0.5").value == 0.5f);
+    REQUIRE(convert<double>("2.25").value == 2.25);
+    REQUIRE(convert<std::string>(R"("x")").value == "x");
+    REQUIRE(!convert<std::string>("1").good);
+    REQUIRE(serialize(false) == "false");
+    REQUIRE(serialize(0.25f) == "0.25");
+    REQUIRE(serialize(std::string{"x"}) == R"("x")");
+  }
+
+  SECTION("for containers") {
+    REQUIRE((convert<std::vector<int64_t>>("[1, 2]").value == std::vector<int64_t>{1, 2}));
+    REQUIRE((convert<std::vector<uint8_t>>("[1, 2]").value == std::vector<uint8_t>{1, 2}));
+    REQUIRE(!convert<std::vector<uint8_t>>("[1, 256]").good);
+    REQUIRE((convert<std::vector<std::vector<bool>>>("[[true], []]").value ==
+             std::vector<std::vector<bool>>{{true}, {}}));
+    REQUIRE((convert<std::map<std::string, std::vector<std::string>>>(R"({"a": ["b"]})").value ==
+             std::map<std::string, std::vector<std::string>>{{"a", {"b"}}}));
+    REQUIRE(!convert<std::map<std::string, int>>(R"({"a": "b"})").good);
+    REQUIRE(serialize(std::vector<double>{0.5, 1}) == "[0.5,1.0]");
+    REQUIRE(serialize(std::vector<int16_t>{-1, 1}) == "[-1,1]");
+    REQUIRE(serialize(std::map<std::string, std::vector<bool>>{{"a", {true}}}) == R"({"a":[true]})");
+    JSON json;
+    REQUIRE(!json.set_value(std::vector<uint64_t>{1, UINT64_MAX}).good);
+    REQUIRE(json.is_null());
+  }
+
+  SECTION("when converting a container fails") {
+    const char *inputs[] = {
+        "[1, 256]",
+        R"({"a": [1], "b": [2, -1]})",
+        R"([{"a": [true]}, {"b": [false, 1]}])",
+    };
+    for (const char *input : inputs) {
+      Result<JSON> doc = JSON::parse(input);
+      REQUIRE(doc.good);
+      std::string before = doc.value.dump().value;
+      REQUIRE(!doc.value.get_value<std::vector<uint8_t>>().good);
+      REQUIRE(!doc.value.get_value<std::map<std::string, std::vector<uint8_t>>>().good);
+      REQUIRE(!doc.value.get_value<std::vector<std::map<std::string, std::vector<bool>>>>().good);
+      REQUIRE(!doc.value.get_value<std::vector<std::string>>().good);
+      REQUIRE(doc.value.dump().value == before);
+    }
+    Result<std::vector<uint8_t>> failed = convert<std::vector<uint8_t>>("[1, 256]");
+    REQUIRE(failed.failure == "Value out of range");
+  }
+
+  SECTION("for JSON and user types") {
+    Result<JSON> json = convert<JSON>(R"({"a": 1})");
+    REQUIRE(json.good);
+    REQUIRE(json.value.dump().value == R"({"a":1})");
+    Result<std::vector<Point>> points = convert<std::vector<Point>>(R"([{"x": 1, "y": -2}])");
+    REQUIRE(points.good);
+    REQUIRE(points.value.size() == 1);
+    REQUIRE(points.value[0].x == 1);
+    REQUIRE(points.value[0].y == -2);
+    REQUIRE(serialize(std::move(points.value)) == R"([{"x":1,"y":-2}])");
+    REQUIRE(!convert<Point>(R"({"x": 1})").good);
+  }
+
+#if __cplusplus >= 201703L
+  SECTION("for optional") {
+    REQUIRE(!convert<std::optional<int>>("null").value.has_value());
+    REQUIRE(convert<std::optional<int>>("1").value == 1);
+    REQUIRE(!convert<std::optional<int>>("true").good);
+    REQUIRE(serialize(std::vector<std::optional<bool>>{true, std::nullopt}) == "[true,null]");
+  }
+#endif
+}
+
+TEST_CASE("append_value_string works as expected") {
+  SECTION("for a valid string") {
+    Result<JSON> doc = JSON::parse(R"("world")");
+    REQUIRE(doc.good);
+    std::string buffer = "hello, ";
+    Result<void> res = doc.value.append_value_string(buffer);
+    REQUIRE(res.good);
+    REQUIRE(buffer == "hello, world");
+    REQUIRE(doc.value.is_null());
+  }
+
+  SECTION("for a non string") {
+    Result<JSON> doc = JSON::parse("[]");
+    REQUIRE(doc.good);
+    std::string buffer = "hello";
+    Result<void> res = doc.value.append_value_string(buffer);
+    REQUIRE(!res.good);
+    REQUIRE(res.failure.size() > 0);
+    REQUIRE(buffer == "hello");
+    REQUIRE(doc.value.is_array());
+    std::clog << res.failure << std::endl;
+  }
+
+  SECTION("when recycling many strings") {
+    HooksCounters counters;
+    AllocatorHooks hooks;
+    hooks.allocate = counting_allocate;
+    hooks.deallocate = counting_deallocate;
+    hooks.opaque = &counters;
+    set_thread_allocator_hooks(&hooks);
+    std::string buffer;
+    size_t allocations = 0;
+    for (size_t i = 0; i < 256; ++i) {
+      if (i == 1) allocations = counters.allocations;  // after warming up
+      JSON doc;
+      doc.set_value_string("a string longer than SSO #" + std::to_string(i));
+      buffer.clear();
+      Result<void> res = doc.append_value_string(buffer);
+      REQUIRE(res.good);
+      REQUIRE(buffer == "a string longer than SSO #" + std::to_string(i));
+    }
+    allocations = counters.allocations - allocations;
+    set_thread_allocator_hooks(nullptr);
+    JSON{};  // flushes the pool
+    REQUIRE(allocations == 0);
+    REQUIRE(counters.outstanding == 0);
+  }
+}
+
 TEST_CASE("set_value_at works as expected") {
   Result<JSON> v = JSON::parse("false");
   REQUIRE(v.good);
@@ -283,6 +1026,15 @@ TEST_CASE("set_value_at works as expected") {
     REQUIRE(res.good);
   }
 
+  SECTION("with a precomputed key") {
+    static const JSON::Key failure{"failure"};
+    Result<JSON> doc = JSON::parse(R"({"success": true})");
+    REQUIRE(doc.good);
+    Result<void> res = doc.value.set_value_at(failure, std::move(v.value));
+    REQUIRE(res.good);
+    REQUIRE(doc.value.dump().value == R"({"failure":false,"success":true})");
+  }
+
   SECTION("when the JSON is not an object") {
     Result<JSON> doc = JSON::parse("0");
     REQUIRE(doc.good);
@@ -293,47 +1045,1532 @@ TEST_CASE("set_value_at works as expected") {
   }
 }
 
-TEST_CASE("we can successfully create a complex JSON") {
-  JSON document;
-  {
-    std::vector<JSON> vector;
-    {
-      JSON number;
-      number.set_value_int64(42);
-      vector.push_back(std::move(number));
-    }
-    {
-      JSON pi;
-      pi.set_value_float64(3.1415);
-      vector.push_back(std::move(pi));
-    }
-    {
-      JSON name;
-      name.set_value_string("Simone");
-      vector.push_back(std::move(name));
+TEST_CASE("append_array works as expected") {
+  auto append = [](const std::string &left, const std::string &right) {
+    Result<JSON> a = JSON::parse(left);
+    Result<JSON> b = JSON::parse(right);
+    REQUIRE(a.good);
+    REQUIRE(b.good);
+    Result<void> result = a.value.append_array(std::move(b.value));
+    if (!result.good) {
+      std::clog << result.failure << std::endl;
+      REQUIRE(a.value.dump().value == left);
+      REQUIRE(b.value.dump().value == right);
+      return std::string{};
     }
-    JSON array;
-    array.set_value_array(std::move(vector));
-    Result<void> result = document.set_value_at("array", std::move(array));
-    REQUIRE(result.good);
+    REQUIRE(b.value.is_null());
+    return a.value.dump().value;
+  };
+
+  SECTION("for packed arrays of the same type") {
+    Result<JSON> a = JSON::parse("[1,2]");
+    Result<JSON> b = JSON::parse("[3]");
+    REQUIRE(a.value.append_array(std::move(b.value)).good);
+    REQUIRE(a.value.get_value_array_int64().value == std::vector<int64_t>{1, 2, 3});
+    REQUIRE(append("[0.5]", "[1.5,2.5]") == "[0.5,1.5,2.5]");
   }
-  {
-    JSON number;
-    number.set_value_int64(42);
-    Result<void> result = document.set_value_at("number", std::move(number));
-    REQUIRE(result.good);
+
+  SECTION("for other arrays") {
+    REQUIRE(append("[1,2]", "[0.5]") == "[1,2,0.5]");
+    REQUIRE(append("[\"a\"]", "[1,2]") == "[\"a\",1,2]");
+    REQUIRE(append("[1,2]", "[{\"a\":null}]") == "[1,2,{\"a\":null}]");
+    REQUIRE(append("[[]]", "[true,\"x\"]") == "[[],true,\"x\"]");
+    REQUIRE(append("[]", "[true]") == "[true]");
+    REQUIRE(append("[true]", "[]") == "[true]");
+  }
+
+  SECTION("when either is not an array") {
+    REQUIRE(append("[1]", "{}") == "");
+    REQUIRE(append("null", "[1]") == "");
   }
-  Result<std::string> dump = document.dump();
-  REQUIRE(dump.good);
-  std::clog << dump.value << std::endl;
 }
 
-TEST_CASE("set_value_string will base64 a string") {
-  JSON json;
-  std::string string{(char *)binary_input, sizeof(binary_input)};
-  json.set_value_string(std::move(string));
-  Result<std::string> res = json.dump();
-  REQUIRE(res.good);
-  REQUIRE(res.value.size() > 0);
+TEST_CASE("merge_object works as expected") {
+  auto merge = [](const std::string &left, const std::string &right) {
+    Result<JSON> a = JSON::parse(left);
+    Result<JSON> b = JSON::parse(right);
+    REQUIRE(a.good);
+    REQUIRE(b.good);
+    Result<void> result = a.value.merge_object(std::move(b.value));
+    if (!result.good) {
+      std::clog << result.failure << std::endl;
+      REQUIRE(a.value.dump().value == left);
+      REQUIRE(b.value.dump().value == right);
+      return std::string{};
+    }
+    REQUIRE(b.value.is_null());
+    return a.value.dump().value;
+  };
+  REQUIRE(merge(R"({"a":1,"c":3})", R"({"b":2,"c":4})") == R"({"a":1,"b":2,"c":4})");
+  REQUIRE(merge(R"({"c":3})", R"({"a":1,"b":2,"c":4,"d":[5]})") == R"({"a":1,"b":2,"c":4,"d":[5]})");
+  REQUIRE(merge(R"({"a":1,"b":2,"c":3,"d":4})", R"({"b":{"x":0}})") == R"({"a":1,"b":{"x":0},"c":3,"d":4})");
+  REQUIRE(merge("{}", R"({"a":1})") == R"({"a":1})");
+  REQUIRE(merge(R"({"a":1})", "[1]") == "");
+}
+
+TEST_CASE("sort_by and partial_sort_top_k work as expected") {
+  const char *input = R"([{"id": 0, "k": {"rtt": 2.5}}, {"id": 1, "k": {"rtt": "b"}},
+    {"id": 2, "k": {"rtt": 1}}, {"id": 3}, {"id": 4, "k": {"rtt": "a"}},
+    {"id": 5, "k": {"rtt": 2.5}}, {"id": 6, "k": {"rtt": null}}, {"id": 7, "k": {"rtt": -3}}])";
+  auto ids = [](JSON &json) {
+    std::vector<int64_t> result;
+    Result<View> view = json.view();
+    REQUIRE(view.good);
+    for (size_t i = 0; i < view.value.size(); ++i) {
+      result.push_back(view.value.at(i).value.at("id").value.get_value_int64().value);
+    }
+    return result;
+  };
+
+  SECTION("in ascending order") {
+    Result<JSON> doc = JSON::parse(input);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.sort_by("/k/rtt", SortOrder::ascending).good);
+    REQUIRE(ids(doc.value) == std::vector<int64_t>{7, 2, 0, 5, 4, 1, 3, 6});
+  }
+
+  SECTION("in descending order") {
+    Result<JSON> doc = JSON::parse(input);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.sort_by("/k/rtt", SortOrder::descending).good);
+    REQUIRE(ids(doc.value) == std::vector<int64_t>{0, 5, 2, 7, 1, 4, 3, 6});
+  }
+
+  SECTION("keeping the top k") {
+    Result<JSON> doc = JSON::parse(input);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.partial_sort_top_k("/k/rtt", SortOrder::descending, 3).good);
+    REQUIRE(ids(doc.value) == std::vector<int64_t>{0, 5, 2});
+    REQUIRE(doc.value.partial_sort_top_k("/id", SortOrder::ascending, 10).good);
+    REQUIRE(ids(doc.value) == std::vector<int64_t>{0, 2, 5});
+  }
+
+  SECTION("with escaped keys and indexes") {
+    Result<JSON> doc = JSON::parse(R"([{"a/b": [0, 2]}, {"a/b": [0, 1]}, {"a~b": 0}])");
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.sort_by("/a~1b/1", SortOrder::ascending).good);
+    REQUIRE(doc.value.dump().value == R"([{"a/b":[0,1]},{"a/b":[0,2]},{"a~b":0}])");
+    REQUIRE(doc.value.sort_by("/a~0b", SortOrder::ascending).good);
+    REQUIRE(doc.value.dump().value == R"([{"a~b":0},{"a/b":[0,1]},{"a/b":[0,2]}])");
+  }
+
+  SECTION("for packed arrays") {
+    Result<JSON> doc = JSON::parse("[3, -1, 2, 10]");
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.sort_by("", SortOrder::ascending).good);
+    REQUIRE(doc.value.dump().value == "[-1,2,3,10]");
+    REQUIRE(doc.value.partial_sort_top_k("", SortOrder::descending, 2).good);
+    REQUIRE(doc.value.get_value_array_int64().value == std::vector<int64_t>{10, 3});
+    JSON floats;
+    floats.set_value_array_float64({0.5, NAN, -2.5});
+    REQUIRE(floats.sort_by("", SortOrder::descending).good);
+    REQUIRE(floats.dump().value == "[0.5,-2.5,null]");
+  }
+
+  SECTION("for integers and floats beyond 2^53") {
+    Result<JSON> doc = JSON::parse(
+        R"([{"id": 0, "v": 9007199254740993}, {"id": 1, "v": 9007199254740992.0},)"
+        R"( {"id": 2, "v": 18446744073709551615}, {"id": 3, "v": 1.8446744073709552e19},)"
+        R"( {"id": 4, "v": 9007199254740992}, {"id": 5, "v": -1},)"
+        R"( {"id": 6, "v": 9223372036854775807}, {"id": 7, "v": 9223372036854775808.0},)"
+        R"( {"id": 8, "v": -9223372036854775808}, {"id": 9, "v": -9.3e18}, {"id": 10, "v": 0.5}])");
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.sort_by("/v", SortOrder::ascending).good);
+    REQUIRE(ids(doc.value) == std::vector<int64_t>{9, 8, 5, 10, 1, 4, 0, 6, 7, 2, 3});
+    REQUIRE(doc.value.sort_by("/v", SortOrder::descending).good);
+    REQUIRE(ids(doc.value) == std::vector<int64_t>{3, 2, 7, 6, 0, 1, 4, 10, 5, 8, 9});
+  }
+
+  SECTION("for large arrays") {
+    std::vector<int64_t> values;
+    for (int64_t i = 0; i < 300000; ++i) values.push_back((i * 7919) % 1000);
+    std::string text = "[";
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (i > 0) text += ",";
+      text += R"({"v":)" + std::to_string(values[i]) + R"(,"i":)" + std::to_string(i) + "}";
+    }
+    text += "]";
+    Result<JSON> doc = JSON::parse(text);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.sort_by("/v", SortOrder::descending).good);
+    std::vector<size_t> expect;
+    for (size_t i = 0; i < values.size(); ++i) expect.push_back(i);
+    std::stable_sort(expect.begin(), expect.end(), [&](size_t a, size_t b) { return values[a] > values[b]; });
+    Result<View> view = doc.value.view();
+    REQUIRE(view.good);
+    bool same = view.value.size() == expect.size();
+    for (size_t i = 0; same && i < expect.size(); ++i) {
+      same = view.value.at(i).value.at("i").value.get_value_int64().value == (int64_t)expect[i];
+    }
+    REQUIRE(same);
+  }
+
+  SECTION("when failing") {
+    Result<JSON> doc = JSON::parse(input);
+    REQUIRE(doc.good);
+    std::string before = doc.value.dump().value;
+    Result<void> result = doc.value.sort_by("k/rtt", SortOrder::ascending);
+    REQUIRE(!result.good);
+    std::clog << result.failure << std::endl;
+    REQUIRE(!doc.value.sort_by("/k~2", SortOrder::ascending).good);
+    REQUIRE(doc.value.dump().value == before);
+    JSON object;
+    REQUIRE(!object.sort_by("", SortOrder::ascending).good);
+  }
+}
+
+TEST_CASE("filter works as expected") {
+  SECTION("for arrays of objects") {
+    Result<JSON> doc = JSON::parse(R"([{"ok": true, "i": 0}, {"ok": false, "i": 1}, {"i": 2}, {"ok": true, "i": 3}])");
+    REQUIRE(doc.good);
+    Result<void> result = doc.value.filter([](const View &entry) {
+      Result<bool> ok = entry.at("ok").and_then([](View v) { return v.get_value_boolean(); });
+      return ok.good && ok.value;
+    });
+    REQUIRE(result.good);
+    REQUIRE(doc.value.dump().value == R"([{"i":0,"ok":true},{"i":3,"ok":true}])");
+  }
+
+  SECTION("for packed arrays") {
+    Result<JSON> doc = JSON::parse("[1, 2, 3, 4]");
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.filter([](const View &entry) {
+      return entry.get_value_int64().value % 2 == 0;
+    }).good);
+    REQUIRE(doc.value.get_value_array_int64().value == std::vector<int64_t>{2, 4});
+  }
+
+  SECTION("when the predicate throws") {
+    Result<JSON> doc = JSON::parse(R"([1, "a", null])");
+    REQUIRE(doc.good);
+    Result<void> result = doc.value.filter([](const View &entry) -> bool {
+      if (entry.is_null()) throw std::runtime_error("predicate failed");
+      return false;
+    });
+    REQUIRE(!result.good);
+    REQUIRE(result.failure == "predicate failed");
+    REQUIRE(doc.value.dump().value == R"([1,"a",null])");
+  }
+}
+
+// query_tree returns the dumps of the values selected by @p path in @p doc.
+static std::vector<std::string> query_tree(JSON &doc, const std::string &path) {
+  Result<Query> query = Query::compile(path);
+  REQUIRE(query.good);
+  Result<View> root = doc.view();
+  REQUIRE(root.good);
+  Result<std::vector<View>> views = query.value.select(root.value);
+  REQUIRE(views.good);
+  std::vector<std::string> dumps;
+  for (auto &view : views.value) dumps.push_back(view.dump().value);
+  return dumps;
+}
+
+// query_stream is like query_tree but streams @p input.
+static std::vector<std::string> query_stream(const std::string &input,
+                                             const std::string &path) {
+  Result<Query> query = Query::compile(path);
+  REQUIRE(query.good);
+  std::vector<std::string> dumps;
+  Result<void> result = query.value.stream(input, [&](JSON &&match) {
+    dumps.push_back(match.dump().value);
+    return true;
+  });
+  REQUIRE(result.good);
+  return dumps;
+}
+
+TEST_CASE("Query works as expected") {
+  // Keys are sorted so that the tree and the stream visit them alike.
+  std::string input = R"({"store": {"bicycle": {"color": "red", "price": 19.95},
+    "book": [{"price": 8.95, "title": "A"}, {"isbn": "1", "price": 12, "title": "B"},
+             {"isbn": "2", "price": 8, "title": "C"}, {"price": 22.99, "title": "D"}]}})";
+  Result<JSON> doc = JSON::parse(input);
+  REQUIRE(doc.good);
+
+  SECTION("with streamable queries") {
+    std::vector<std::pair<std::string, std::vector<std::string>>> cases = {
+        {"$.store.bicycle.color", {R"("red")"}},
+        {"$['store'][\"bicycle\"]['color']", {R"("red")"}},
+        {"$.store.book[*].title", {R"("A")", R"("B")", R"("C")", R"("D")"}},
+        {"$.store.book[1].title", {R"("B")"}},
+        {"$.store.book[9].title", {}},
+        {"$.store.book[1:3].title", {R"("B")", R"("C")"}},
+        {"$.store.book[::2].title", {R"("A")", R"("C")"}},
+        {"$.store.book[ 1 : ].title", {R"("B")", R"("C")", R"("D")"}},
+        {"$.store.*.price", {"19.95"}},
+        {"$.store.book[?(@.price < 10)].title", {R"("A")", R"("C")"}},
+        {"$.store.book[?(@.price >= 12)].title", {R"("B")", R"("D")"}},
+        {"$.store.book[?(@.isbn)].title", {R"("B")", R"("C")"}},
+        {"$.store.book[?(@.title == 'B')].isbn", {R"("1")"}},
+        {"$.store.book[?(@.price == '8')].title", {}},
+        {"$.store.book[?(@.price != '8')].title", {R"("A")", R"("B")", R"("C")", R"("D")"}},
+        {"$.store[?(@.color == \"red\")]", {R"({"color":"red","price":19.95})"}},
+        {"$.store.book[0]", {R"({"price":8.95,"title":"A"})"}},
+        {"$.nothing[*]", {}},
+        {"$", {doc.value.dump().value}},
+    };
+    for (auto &entry : cases) {
+      INFO(entry.first);
+      REQUIRE(query_tree(doc.value, entry.first) == entry.second);
+      REQUIRE(query_stream(input, entry.first) == entry.second);
+    }
+  }
+
+  SECTION("with queries using negative indexes") {
+    REQUIRE(query_tree(doc.value, "$.store.book[-1].title") == std::vector<std::string>{R"("D")"});
+    REQUIRE(query_tree(doc.value, "$.store.book[-9].title").empty());
+    REQUIRE(query_tree(doc.value, "$.store.book[:-2].title") == (std::vector<std::string>{R"("A")", R"("B")"}));
+    Result<Query> query = Query::compile("$.store.book[-1]");
+    REQUIRE(query.good);
+    Result<void> result = query.value.stream(input, [](JSON &&) { return true; });
+    REQUIRE(!result.good);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("when stopping the stream early") {
+    Result<Query> query = Query::compile("$.store.book[*].title");
+    REQUIRE(query.good);
+    size_t count = 0;
+    Result<void> result = query.value.stream(input, [&](JSON &&) {
+      return ++count < 2;
+    });
+    REQUIRE(result.good);
+    REQUIRE(count == 2);
+  }
+
+  SECTION("when streaming an invalid JSON") {
+    Result<Query> query = Query::compile("$.store");
+    REQUIRE(query.good);
+    Result<void> result = query.value.stream(R"({"store": [)", [](JSON &&) { return true; });
+    REQUIRE(!result.good);
+    REQUIRE(result.failure.size() > 0);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("with a default constructed Query") {
+    Query query;
+    Result<std::vector<View>> views = query.select(doc.value.view().value);
+    REQUIRE(views.good);
+    REQUIRE(views.value.size() == 1);
+    REQUIRE(query.select(View{}).value.size() == 1);
+  }
+
+  SECTION("with invalid queries") {
+    for (std::string path : {"", "store", "$.", "$[", "$[]", "$[1:2:0]", "$..a",
+                             "$['a]", "$[?(@.a == )]", "$[?(@.a == nope)]",
+                             "$[?(a == 1)]", "$[99999999999999999999]"}) {
+      Result<Query> query = Query::compile(path);
+      INFO(path);
+      REQUIRE(!query.good);
+      std::clog << query.failure << std::endl;
+    }
+  }
+}
+
+TEST_CASE("we can successfully create a complex JSON") {
+  JSON document;
+  {
+    std::vector<JSON> vector;
+    {
+      JSON number;
+      number.set_value_int64(42);
+      vector.push_back(std::move(number));
+    }
+    {
+      JSON pi;
+      pi.set_value_float64(3.1415);
+      vector.push_back(std::move(pi));
+    }
+    {
+      JSON name;
+      name.set_value_string("Simone");
+      vector.push_back(std::move(name));
+    }
+    JSON array;
+    array.set_value_array(std::move(vector));
+    Result<void> result = document.set_value_at("array", std::move(array));
+    REQUIRE(result.good);
+  }
+  {
+    JSON number;
+    number.set_value_int64(42);
+    Result<void> result = document.set_value_at("number", std::move(number));
+    REQUIRE(result.good);
+  }
+  Result<std::string> dump = document.dump();
+  REQUIRE(dump.good);
+  std::clog << dump.value << std::endl;
+}
+
+TEST_CASE("set_value_string will base64 a string") {
+  JSON json;
+  std::string string{(char *)binary_input, sizeof(binary_input)};
+  json.set_value_string(std::move(string));
+  Result<std::string> res = json.dump();
+  REQUIRE(res.good);
+  REQUIRE(res.value.size() > 0);
   std::clog << res.value << std::endl;
 }
+
+TEST_CASE("Template works as expected") {
+  Result<Template> tmpl = Template::compile(R"({
+    "test_name": "web_connectivity",
+    "test_keys": {"rtt": "${rtt}", "status": "${status}", "blocked": "${blocked}", "queries": "${queries}", "note": "${note}"},
+    "input": "${input}", "version": 1, "tags": ["a", null, 2.5], "empty": {}
+  })");
+  REQUIRE(tmpl.good);
+  std::vector<std::string> slots{"input", "blocked", "note", "queries", "rtt", "status"};
+  REQUIRE(tmpl.value.slots() == slots);
+
+  SECTION("the output is the same as dump's") {
+    std::string strings[] = {
+        "https://example.com/", "quote \" and backslash \\", "control \x01\x1f\t\n",
+        "unicode \xc3\xa8 \xe2\x82\xac", std::string{(char *)binary_input, sizeof(binary_input)}};
+    for (auto &str : strings) {
+      Result<JSON> expect = JSON::parse(R"({"test_name": "web_connectivity", "test_keys": {"rtt": 0.125, "status": -17, "blocked": false, "queries": [1, 2, 3], "note": null}, "version": 1, "tags": ["a", null, 2.5], "empty": {}})");
+      REQUIRE(expect.good);
+      JSON input;
+      input.set_value_string(std::string{str});
+      REQUIRE(expect.value.set_value_at("input", std::move(input)).good);
+      Result<JSON> queries = JSON::parse("[1,2,3]");
+      REQUIRE(queries.good);
+      std::string output = "prefix";
+      TemplateWriter writer{tmpl.value, output};
+      writer.write_string(str);
+      writer.write_boolean(false);
+      writer.write_null();
+      writer.write_json(queries.value);
+      writer.write_float64(0.125);
+      writer.write_int64(-17);
+      REQUIRE(writer.finish().good);
+      REQUIRE(output == "prefix" + expect.value.dump().value);
+    }
+  }
+
+  SECTION("when there are too few values") {
+    std::string output;
+    TemplateWriter writer{tmpl.value, output};
+    writer.write_string("x");
+    Result<void> result = writer.finish();
+    REQUIRE(!result.good);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("when there are too many values") {
+    std::string output;
+    TemplateWriter writer{tmpl.value, output};
+    for (size_t i = 0; i <= slots.size(); ++i) writer.write_int64((int64_t)i);
+    Result<void> result = writer.finish();
+    REQUIRE(!result.good);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("when the skeleton is not valid") {
+    Result<Template> invalid = Template::compile("{");
+    REQUIRE(!invalid.good);
+    std::clog << invalid.failure << std::endl;
+  }
+
+  SECTION("when the template is empty") {
+    Template empty;
+    std::string output;
+    TemplateWriter writer{empty, output};
+    REQUIRE(writer.finish().good);
+    REQUIRE(output == "null");
+  }
+}
+
+TEST_CASE("memory_usage works as expected") {
+  SECTION("for a null JSON") {
+    JSON json;
+    REQUIRE(json.memory_usage() > 0);
+  }
+
+  SECTION("for a complex JSON") {
+    JSON small;
+    Result<JSON> big = JSON::parse(R"({"array": [1, 2, 3], "string": "a string that is long enough to be heap allocated"})");
+    REQUIRE(big.good);
+    REQUIRE(big.value.memory_usage() > small.memory_usage());
+  }
+
+  SECTION("when the JSON grows") {
+    JSON json;
+    size_t before = json.memory_usage();
+    json.set_value_string("a string that is long enough to be heap allocated");
+    REQUIRE(json.memory_usage() > before);
+  }
+}
+
+TEST_CASE("shrink_to_fit works as expected") {
+  JSON document;
+  {
+    std::vector<JSON> vector;
+    for (int64_t i = 0; i < 100; ++i) {
+      JSON number;
+      number.set_value_int64(i);
+      vector.push_back(std::move(number));
+    }
+    JSON array;
+    array.set_value_array(std::move(vector));
+    Result<void> result = document.set_value_at("array", std::move(array));
+    REQUIRE(result.good);
+  }
+  Value &inner = JSON::Friend::unwrap(document);
+  inner["array"].push_back(100);  // likely to create capacity slack
+  size_t before = document.memory_usage();
+  std::string before_dump = document.dump().value;
+  document.shrink_to_fit();
+  REQUIRE(document.memory_usage() <= before);
+  REQUIRE(inner["array"].size() == inner["array"].get_ptr<Value::array_t *>()->capacity());
+  REQUIRE(document.dump().value == before_dump);
+}
+
+TEST_CASE("compact works as expected") {
+  Result<JSON> doc = JSON::parse(R"({"a": [1, 2.5, "a string that is long enough to be heap allocated", {"b": null}], "c": true})");
+  REQUIRE(doc.good);
+  Value &inner = JSON::Friend::unwrap(doc.value);
+  inner["a"].push_back(false);  // likely to create capacity slack
+  std::string before = doc.value.dump().value;
+  size_t usage = doc.value.memory_usage();
+  Result<void> result = doc.value.compact();
+  REQUIRE(result.good);
+  REQUIRE(doc.value.dump().value == before);
+  REQUIRE(doc.value.memory_usage() <= usage);
+  REQUIRE(inner["a"].size() == inner["a"].get_ptr<Value::array_t *>()->capacity());
+}
+
+class CountingResource : public MemoryResource {
+ public:
+  size_t allocations = 0;
+  size_t outstanding = 0;
+
+  void *allocate(size_t size, size_t alignment) override {
+    allocations++, outstanding += size;
+    (void)alignment;
+    return ::operator new(size);
+  }
+
+  void deallocate(void *ptr, size_t size, size_t alignment) noexcept override {
+    outstanding -= size;
+    (void)alignment;
+    ::operator delete(ptr);
+  }
+};
+
+TEST_CASE("memory resources work as expected") {
+  CountingResource resource;
+  ParseOptions options;
+  options.memory_resource = &resource;
+
+  SECTION("parsed documents allocate from the resource") {
+    {
+      Result<JSON> doc = JSON::parse(R"({"a": [1, "x", {"b": null}], "c": true})", options);
+      REQUIRE(doc.good);
+      REQUIRE(doc.value.memory_resource() == &resource);
+      REQUIRE(resource.allocations > 0);
+      REQUIRE(resource.outstanding > 0);
+      Result<JSON> a = doc.value.get_value_at("a");
+      REQUIRE(a.good);
+      REQUIRE(a.value.memory_resource() == &resource);
+      Result<std::vector<JSON>> entries = a.value.get_value_array();
+      REQUIRE(entries.good);
+      for (JSON &entry : entries.value) {
+        REQUIRE(entry.memory_resource() == &resource);
+      }
+    }
+    REQUIRE(resource.outstanding == 0);
+  }
+
+  SECTION("memory_usage accounts for the resource allocations") {
+    Result<JSON> doc = JSON::parse(R"({"a": [1, "x", {"b": null}], "c": true})", options);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.memory_usage() - JSON{}.memory_usage() == resource.outstanding);
+  }
+
+  SECTION("compact relocates the nodes into a single allocation") {
+    {
+      JSON doc{&resource};
+      doc.set_value_object({});
+      for (int64_t i = 0; i < 100; ++i) {
+        JSON entry;
+        entry.set_value_array_string({"x", std::to_string(i)});
+        REQUIRE(doc.set_value_at(std::to_string(i), std::move(entry)).good);
+      }
+      std::string before = doc.dump().value;
+      size_t allocations = resource.allocations;
+      size_t usage = doc.memory_usage();
+      REQUIRE(doc.compact().good);
+      REQUIRE(resource.allocations == allocations + 1);
+      REQUIRE(resource.outstanding <= usage);
+      REQUIRE(doc.dump().value == before);
+      // Nodes moved out of the compacted JSON keep the buffer alive.
+      Result<JSON> member = doc.get_value_at("7");
+      REQUIRE(member.good);
+      doc = JSON{};
+      REQUIRE(resource.outstanding > 0);
+      REQUIRE(member.value.dump().value == R"(["x","7"])");
+    }
+    REQUIRE(resource.outstanding == 0);
+  }
+
+  SECTION("packed documents allocate from the resource once unpacked") {
+    {
+      Result<JSON> doc = JSON::parse("[1, 2, 3]", options);
+      REQUIRE(doc.good);
+      size_t allocations = resource.allocations;
+      REQUIRE(JSON::Friend::unwrap(doc.value).size() == 3);
+      REQUIRE(resource.allocations > allocations);
+    }
+    REQUIRE(resource.outstanding == 0);
+  }
+
+  SECTION("setters allocate from the resource") {
+    {
+      JSON doc{&resource};
+      JSON value;
+      value.set_value_array_string({"a", "b"});
+      REQUIRE(doc.set_value_at("x", std::move(value)).good);
+      REQUIRE(resource.allocations > 0);
+      size_t allocations = resource.allocations;
+      JSON other;
+      other.set_value_string("y");
+      REQUIRE(resource.allocations == allocations);
+      std::vector<JSON> array;
+      array.push_back(std::move(other));
+      doc.set_value_array(std::move(array));
+      REQUIRE(resource.allocations > allocations);
+      REQUIRE(doc.dump().value == R"(["y"])");
+    }
+    REQUIRE(resource.outstanding == 0);
+  }
+
+  SECTION("values move between heap and resource documents") {
+    Result<JSON> heap = JSON::parse(R"({"a": {"b": [1, "x"]}})");
+    REQUIRE(heap.good);
+    {
+      Result<JSON> doc = JSON::parse(R"({"c": {"d": false}})", options);
+      REQUIRE(doc.good);
+      Result<JSON> a = heap.value.get_value_at("a");
+      REQUIRE(a.good);
+      REQUIRE(doc.value.set_value_at("a", std::move(a.value)).good);
+      Result<JSON> c = doc.value.get_value_at("c");
+      REQUIRE(c.good);
+      REQUIRE(heap.value.set_value_at("c", std::move(c.value)).good);
+      REQUIRE(doc.value.dump().value == R"({"a":{"b":[1,"x"]}})");
+    }
+    REQUIRE(heap.value.dump().value == R"({"c":{"d":false}})");
+    // Destroying heap now frees the nodes it obtained from resource, which
+    // is why the resource must outlive the values moved out of it.
+    heap.value = JSON{};
+    REQUIRE(resource.outstanding == 0);
+  }
+}
+
+TEST_CASE("allocator hooks work as expected") {
+  HooksCounters counters;
+  AllocatorHooks hooks;
+  hooks.allocate = counting_allocate;
+  hooks.deallocate = counting_deallocate;
+  hooks.opaque = &counters;
+  const char *input = R"({"a": [1, "a string that is long enough", {"b": null}]})";
+
+  SECTION("for the calling thread") {
+    set_thread_allocator_hooks(&hooks);
+    {
+      Result<JSON> doc = JSON::parse(input);
+      REQUIRE(doc.good);
+      REQUIRE(counters.allocations > 0);
+    }
+    set_thread_allocator_hooks(nullptr);
+    size_t allocations = counters.allocations;
+    {
+      Result<JSON> doc = JSON::parse(input);  // also flushes the pool
+      REQUIRE(doc.good);
+    }
+    REQUIRE(counters.allocations == allocations);
+    REQUIRE(counters.outstanding == 0);
+  }
+
+  SECTION("to show that recycled nodes are reused") {
+    const char *array = R"(["a string that is long enough", [1, 2.5, true, null], "x"])";
+    set_thread_allocator_hooks(&hooks);
+    size_t array_allocations = 0, object_allocations = 0;
+    for (size_t i = 0; i < 3; ++i) {  // the first round warms up the pool
+      size_t allocations = counters.allocations;
+      {
+        Result<JSON> doc = JSON::parse(array);
+        REQUIRE(doc.good);
+        Result<std::vector<JSON>> items = doc.value.get_value_array();
+        REQUIRE(items.good);
+        REQUIRE(items.value.size() == 3);
+        REQUIRE(items.value[0].get_value_string().good);
+        items.value[2].set_value_string("a string that is also long enough");
+        JSON copy;
+        copy.set_value_array(std::move(items.value));
+      }
+      array_allocations = counters.allocations - allocations;
+      allocations = counters.allocations;
+      {
+        Result<JSON> doc = JSON::parse(input);
+        REQUIRE(doc.good);
+      }
+      object_allocations = counters.allocations - allocations;
+    }
+    set_thread_allocator_hooks(nullptr);
+    JSON{};  // flushes the pool
+    REQUIRE(array_allocations == 0);
+    REQUIRE(object_allocations == 2);  // one map node per member
+    REQUIRE(counters.outstanding == 0);
+  }
+
+  SECTION("for all threads") {
+    set_allocator_hooks(&hooks);
+    bool good = false;
+    std::thread thread{[&]() { good = JSON::parse(input).good; }};
+    thread.join();
+    set_allocator_hooks(nullptr);
+    REQUIRE(good);
+    REQUIRE(counters.allocations > 0);
+    REQUIRE(counters.outstanding == 0);  // the thread pool is gone
+  }
+
+  SECTION("with the thread hooks overriding the global hooks") {
+    HooksCounters global;
+    AllocatorHooks other = hooks;
+    other.opaque = &global;
+    set_allocator_hooks(&other);
+    set_thread_allocator_hooks(&hooks);
+    {
+      Result<JSON> doc = JSON::parse(input);
+      REQUIRE(doc.good);
+    }
+    set_thread_allocator_hooks(nullptr);
+    set_allocator_hooks(nullptr);
+    JSON{};  // flushes the pool
+    REQUIRE(counters.allocations > 0);
+    REQUIRE(global.allocations == 0);
+    REQUIRE(counters.outstanding == 0);
+  }
+}
+
+TEST_CASE("SmallJSON works as expected") {
+  const std::string input = R"({"type": "ping", "id": 17, "ok": true, "rtt": [0.5, 1]})";
+
+  SECTION("small documents do not allocate their nodes on the heap") {
+    HooksCounters counters;
+    AllocatorHooks hooks;
+    hooks.allocate = counting_allocate;
+    hooks.deallocate = counting_deallocate;
+    hooks.opaque = &counters;
+    set_thread_allocator_hooks(&hooks);
+    SmallJSON<1024> buffer;
+    size_t allocations = 0, heap = 0;
+    for (size_t i = 0; i < 2; ++i) {  // the first round warms up the pool
+      allocations = counters.allocations;
+      heap = heap_allocations;
+      Result<JSON> doc = JSON::parse(input, buffer);
+      heap = heap_allocations - heap;
+      REQUIRE(doc.good);
+      REQUIRE(doc.value.memory_resource() == &buffer);
+      Result<JSON> id = doc.value.get_value_at("id");
+      REQUIRE(id.good);
+      REQUIRE(id.value.get_value_int64().value == 17);
+    }
+    set_thread_allocator_hooks(nullptr);
+    REQUIRE(counters.allocations == allocations);
+    REQUIRE(buffer.spills() == 0);
+    // The only heap allocations left are those of the nlohmann/json parser.
+    NullSax sax;
+    size_t scratch = heap_allocations;
+    REQUIRE(Value::sax_parse(input, &sax));
+    scratch = heap_allocations - scratch;
+    REQUIRE(heap == scratch);
+  }
+
+  SECTION("the buffer is reused once the document is gone") {
+    SmallJSON<1024> buffer;
+    for (size_t i = 0; i < 100; ++i) {
+      Result<JSON> doc = JSON::parse(input, buffer);
+      REQUIRE(doc.good);
+      REQUIRE(doc.value.dump().value == R"({"id":17,"ok":true,"rtt":[0.5,1],"type":"ping"})");
+    }
+    REQUIRE(buffer.spills() == 0);
+  }
+
+  SECTION("large documents spill to the heap") {
+    SmallJSON<64> buffer;
+    {
+      Result<JSON> doc = JSON::parse(input, buffer);
+      REQUIRE(doc.good);
+      REQUIRE(buffer.spills() > 0);
+      JSON::Friend::unwrap(doc.value)["more"] = "data";
+      REQUIRE(doc.value.dump().value == R"({"id":17,"more":"data","ok":true,"rtt":[0.5,1],"type":"ping"})");
+    }
+    Result<JSON> doc = JSON::parse(input, buffer);
+    REQUIRE(doc.good);
+  }
+}
+
+TEST_CASE("dump_snapshot and load_snapshot work as expected") {
+  Result<JSON> doc = JSON::parse(R"({"a": [1, -2, 2.5, "x", {"b": null}], "c": true})");
+  REQUIRE(doc.good);
+  Result<std::string> snapshot = doc.value.dump_snapshot();
+  REQUIRE(snapshot.good);
+
+  SECTION("for a valid snapshot") {
+    Result<JSON> loaded = JSON::load_snapshot(snapshot.value.data(),
+                                              snapshot.value.size());
+    REQUIRE(loaded.good);
+    REQUIRE(loaded.value.dump().value == doc.value.dump().value);
+  }
+
+  SECTION("for a truncated snapshot") {
+    Result<JSON> loaded = JSON::load_snapshot(snapshot.value.data(),
+                                              snapshot.value.size() - 1);
+    REQUIRE(!loaded.good);
+    REQUIRE(loaded.failure.size() > 0);
+    std::clog << loaded.failure << std::endl;
+  }
+
+  SECTION("for a corrupt snapshot") {
+    snapshot.value[snapshot.value.size() - 1] ^= 1;
+    Result<JSON> loaded = JSON::load_snapshot(snapshot.value.data(),
+                                              snapshot.value.size());
+    REQUIRE(!loaded.good);
+    REQUIRE(loaded.failure.size() > 0);
+    std::clog << loaded.failure << std::endl;
+  }
+
+  SECTION("for any flipped bit") {
+    // The header is 24 bytes and the checksum handles 32 bytes at a time,
+    // so we check both the words and the trailing bytes of the payload.
+    Result<JSON> larger = JSON::parse(R"({"input": "https://www.example.com/", "runtime": 0.25, "tags": [1, 2, 3]})");
+    REQUIRE(larger.good);
+    snapshot = larger.value.dump_snapshot();
+    REQUIRE(snapshot.good);
+    REQUIRE(snapshot.value.size() > 24 + 32);
+    REQUIRE((snapshot.value.size() - 24) % 32 != 0);
+    for (size_t i = 24; i < snapshot.value.size(); ++i) {
+      for (size_t bit = 0; bit < 8; ++bit) {
+        std::string copy = snapshot.value;
+        copy[i] = (char)(copy[i] ^ (1 << bit));
+        REQUIRE(!JSON::load_snapshot(copy.data(), copy.size()).good);
+      }
+    }
+  }
+
+  SECTION("for another version") {
+    snapshot.value[7] = 1;
+    Result<JSON> loaded = JSON::load_snapshot(snapshot.value.data(),
+                                              snapshot.value.size());
+    REQUIRE(!loaded.good);
+    REQUIRE(loaded.failure == "Not a snapshot");
+  }
+
+  SECTION("for something that is not a snapshot") {
+    std::string text = R"({"a": 1})";
+    Result<JSON> loaded = JSON::load_snapshot(text.data(), text.size());
+    REQUIRE(!loaded.good);
+    REQUIRE(loaded.failure.size() > 0);
+    std::clog << loaded.failure << std::endl;
+  }
+}
+
+// write_file writes @p data into a new file at @p path.
+static void write_file(const char *path, const std::string &data) {
+  std::FILE *filep = std::fopen(path, "wb");
+  REQUIRE(filep != nullptr);
+  REQUIRE(std::fwrite(data.data(), 1, data.size(), filep) == data.size());
+  REQUIRE(std::fclose(filep) == 0);
+}
+
+// read_file returns the content of the file at @p path.
+static std::string read_file(const char *path) {
+  std::FILE *filep = std::fopen(path, "rb");
+  REQUIRE(filep != nullptr);
+  std::string data;
+  char buffer[4096];
+  size_t n = 0;
+  while ((n = std::fread(buffer, 1, sizeof(buffer), filep)) > 0) {
+    data.append(buffer, n);
+  }
+  REQUIRE(std::fclose(filep) == 0);
+  return data;
+}
+
+TEST_CASE("Store works as expected") {
+  const char *path = "unit-tests-store.db";
+  (void)std::remove(path);
+
+  SECTION("when the store is not open") {
+    Store store;
+    Result<void> result = store.put("a", JSON{});
+    REQUIRE(!result.good);
+    REQUIRE(result.failure.size() > 0);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("when the key is missing") {
+    Store store;
+    REQUIRE(store.open(path).good);
+    Result<JSON> result = store.get("a");
+    REQUIRE(!result.good);
+    REQUIRE(result.failure.size() > 0);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("for pending, flushed and reopened documents") {
+    {
+      Store store;
+      REQUIRE(store.open(path).good);
+      for (int64_t i = 0; i < 10; ++i) {
+        JSON json;
+        json.set_value_int64(i);
+        REQUIRE(store.put("k" + std::to_string(i % 5), json).good);
+      }
+      REQUIRE(store.size() == 5);
+      REQUIRE(store.get("k3").value.get_value_int64().value == 8);
+      REQUIRE(store.flush().good);
+      REQUIRE(store.get("k3").value.get_value_int64().value == 8);
+      Result<JSON> doc = JSON::parse(R"({"a": [1, 2, 3]})");
+      REQUIRE(doc.good);
+      REQUIRE(store.put("k3", doc.value).good);
+    }  // Destructor flushes
+    Store store;
+    REQUIRE(store.open(path).good);
+    REQUIRE(store.size() == 5);
+    REQUIRE(store.contains("k0"));
+    REQUIRE(!store.contains("k5"));
+    Result<JSON> doc = store.get("k3");
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value == R"({"a":[1,2,3]})");
+  }
+
+  SECTION("when the last record is truncated") {
+    {
+      Store store;
+      REQUIRE(store.open(path).good);
+      REQUIRE(store.put("a", JSON{}).good);
+      REQUIRE(store.put("b", JSON{}).good);
+    }
+    {
+      std::FILE *filep = std::fopen(path, "ab");
+      REQUIRE(filep != nullptr);
+      REQUIRE(std::fwrite("MKJR\x01", 1, 5, filep) == 5);
+      REQUIRE(std::fclose(filep) == 0);
+    }
+    {
+      Store store;
+      REQUIRE(store.open(path).good);
+      REQUIRE(store.size() == 2);
+      REQUIRE(store.put("c", JSON{}).good);
+    }
+    Store store;
+    REQUIRE(store.open(path).good);
+    REQUIRE(store.size() == 3);
+    REQUIRE(store.get("c").good);
+  }
+
+  SECTION("when a record in the middle is corrupt") {
+    {
+      Store store;
+      REQUIRE(store.open(path).good);
+      REQUIRE(store.put("a", JSON{}).good);
+      REQUIRE(store.put("b", JSON{}).good);
+      REQUIRE(store.put("c", JSON{}).good);
+    }
+    std::string corrupt = read_file(path);
+    size_t second = corrupt.find("MKJR", 1);
+    REQUIRE(second != std::string::npos);
+    corrupt[second] = 'X';
+    write_file(path, corrupt);
+    {
+      Store store;
+      Result<void> result = store.open(path);
+      REQUIRE(!result.good);
+      REQUIRE(result.failure == "Corrupt store record at offset " +
+                                    std::to_string(second));
+      std::clog << result.failure << std::endl;
+    }
+    // Failing to open must not drop any data.
+    REQUIRE(read_file(path) == corrupt);
+  }
+
+  (void)std::remove(path);
+}
+
+TEST_CASE("parse_fd works as expected") {
+  const char *path = "unit-tests-parse-fd.json";
+
+  SECTION("for a valid JSON") {
+    std::string data = R"({"array": [)";
+    for (int64_t i = 0; i < 300000; ++i) {
+      data += std::to_string(i) + ", ";  // Spans more than one buffer
+    }
+    data += R"(0], "success": true})";
+    write_file(path, data);
+    std::FILE *filep = std::fopen(path, "rb");
+    REQUIRE(filep != nullptr);
+    Result<JSON> result = JSON::parse_fd(fileno(filep));
+    std::fclose(filep);
+    REQUIRE(result.good);
+    REQUIRE(result.value.get_value_at("array").value.get_value_array().value.size() == 300001);
+  }
+
+  SECTION("for an invalid JSON") {
+    write_file(path, R"({"success": )");
+    std::FILE *filep = std::fopen(path, "rb");
+    REQUIRE(filep != nullptr);
+    Result<JSON> result = JSON::parse_fd(fileno(filep));
+    std::fclose(filep);
+    REQUIRE(!result.good);
+    REQUIRE(result.failure.size() > 0);
+    std::clog << result.failure << std::endl;
+  }
+
+  SECTION("for an invalid file descriptor") {
+    Result<JSON> result = JSON::parse_fd(-1);
+    REQUIRE(!result.good);
+    REQUIRE(result.failure.size() > 0);
+    std::clog << result.failure << std::endl;
+  }
+
+  (void)std::remove(path);
+}
+
+TEST_CASE("Query::stream_fd works as expected") {
+  const char *path = "unit-tests-query-stream-fd.json";
+  std::string data = R"({"array": [)";
+  for (int64_t i = 0; i < 300000; ++i) {
+    data += R"({"i": )" + std::to_string(i) + "}, ";  // Spans more than one buffer
+  }
+  data += R"({"i": 0}], "success": true})";
+  write_file(path, data);
+  Result<Query> query = Query::compile("$.array[?(@.i >= 299998)].i");
+  REQUIRE(query.good);
+  std::vector<int64_t> matches;
+  std::FILE *filep = std::fopen(path, "rb");
+  REQUIRE(filep != nullptr);
+  Result<void> result = query.value.stream_fd(fileno(filep), [&](JSON &&match) {
+    matches.push_back(match.get_value_int64().value);
+    return true;
+  });
+  std::fclose(filep);
+  REQUIRE(result.good);
+  REQUIRE(matches == (std::vector<int64_t>{299998, 299999}));
+  REQUIRE(!query.value.stream_fd(-1, [](JSON &&) { return true; }).good);
+  (void)std::remove(path);
+}
+
+TEST_CASE("JSONLReader works as expected") {
+  const char *path = "unit-tests-jsonl-reader.jsonl";
+  std::string data;
+  for (int64_t i = 0; i < 100000; ++i) {
+    data += R"({"i": )" + std::to_string(i) + "}\n";
+    if (i == 10) data += "\n\r\n";
+    if (i == 20) data += "{\n";
+  }
+  data += "[]";  // Without trailing newline
+  write_file(path, data);
+  std::FILE *filep = std::fopen(path, "rb");
+  REQUIRE(filep != nullptr);
+  {
+    JSONLReader reader{fileno(filep)};
+    int64_t count = 0;
+    int64_t failures = 0;
+    while (!reader.eof()) {
+      Result<JSON> result = reader.read_next();
+      if (!result.good) {
+        failures += 1;
+        continue;
+      }
+      if (result.value.is_array()) break;
+      REQUIRE(result.value.get_value_at("i").value.get_value_int64().value == count);
+      count += 1;
+    }
+    REQUIRE(count == 100000);
+    REQUIRE(failures == 1);
+    Result<JSON> result = reader.read_next();
+    REQUIRE(!result.good);
+    REQUIRE(reader.eof());
+  }
+  std::fclose(filep);
+  (void)std::remove(path);
+}
+
+TEST_CASE("JSONLReader works as expected with many files") {
+  std::vector<std::string> paths;
+  int64_t expect = 0;
+  for (int64_t i = 0; i < 4; ++i) {
+    std::string path = "unit-tests-jsonl-reader-" + std::to_string(i) + ".jsonl";
+    std::string data;
+    // The second file is larger than all the read slots together.
+    int64_t lines = (i == 1) ? 400000 : (i == 2) ? 0 : 1000;
+    for (int64_t j = 0; j < lines; ++j) {
+      data += R"({"i": )" + std::to_string(expect++) + ", \"padding\": \"" +
+              std::string(8, 'x') + "\"}";
+      if (j < lines - 1) data += "\n";  // No trailing newline
+    }
+    write_file(path.c_str(), data);
+    paths.push_back(std::move(path));
+  }
+
+  SECTION("when all the files exist") {
+    JSONLReader reader{paths};
+    int64_t count = 0;
+    bool ordered = true;
+    while (!reader.eof()) {
+      Result<JSON> result = reader.read_next();
+      if (!result.good) break;
+      ordered = ordered && result.value.get_value_at("i").value.get_value_int64().value == count;
+      count += 1;
+    }
+    REQUIRE(ordered);
+    REQUIRE(count == expect);
+    REQUIRE(reader.eof());
+  }
+
+#ifndef _WIN32
+  SECTION("when io_uring is disabled at run time") {
+    REQUIRE(setenv("MKJSON_NO_IO_URING", "1", 1) == 0);
+    REQUIRE(!FilesReader{paths}.uses_io_uring());
+    JSONLReader reader{paths};
+    int64_t count = 0;
+    bool ordered = true;
+    while (!reader.eof()) {
+      Result<JSON> result = reader.read_next();
+      if (!result.good) break;
+      ordered = ordered && result.value.get_value_at("i").value.get_value_int64().value == count;
+      count += 1;
+    }
+    REQUIRE(unsetenv("MKJSON_NO_IO_URING") == 0);
+    REQUIRE(ordered);
+    REQUIRE(count == expect);
+    REQUIRE(reader.eof());
+  }
+#endif
+
+  SECTION("when a file does not exist") {
+    std::vector<std::string> more = paths;
+    more.push_back("unit-tests-jsonl-reader-nonexistent.jsonl");
+    JSONLReader reader{more};
+    int64_t count = 0;
+    Result<JSON> result;
+    while ((result = reader.read_next()).good) {
+      count += 1;
+    }
+    REQUIRE(count == expect);
+    REQUIRE(reader.eof());
+    REQUIRE(result.failure == "Cannot read input");
+  }
+
+  for (const std::string &path : paths) {
+    (void)std::remove(path.c_str());
+  }
+}
+
+#ifdef MKJSON_HAVE_ZLIB
+// gzip_compress compresses @p data as a gzip member.
+static std::string gzip_compress(const std::string &data) {
+  z_stream stream{};
+  REQUIRE(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                       8, Z_DEFAULT_STRATEGY) == Z_OK);
+  std::string out;
+  out.resize(deflateBound(&stream, (uLong)data.size()));
+  stream.next_in = (Bytef *)data.data();
+  stream.avail_in = (uInt)data.size();
+  stream.next_out = (Bytef *)&out[0];
+  stream.avail_out = (uInt)out.size();
+  REQUIRE(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+  out.resize(stream.total_out);
+  REQUIRE(deflateEnd(&stream) == Z_OK);
+  return out;
+}
+#endif
+
+#ifdef MKJSON_HAVE_ZSTD
+// zstd_compress compresses @p data as a zstd frame.
+static std::string zstd_compress(const std::string &data) {
+  std::string out;
+  out.resize(ZSTD_compressBound(data.size()));
+  size_t n = ZSTD_compress(&out[0], out.size(), data.data(), data.size(), 3);
+  REQUIRE(!ZSTD_isError(n));
+  out.resize(n);
+  return out;
+}
+#endif
+
+#if defined MKJSON_HAVE_ZLIB || defined MKJSON_HAVE_ZSTD
+TEST_CASE("JSONLReader transparently decompresses its input") {
+  std::vector<std::string> paths;
+  std::vector<std::string> contents;
+  int64_t expect = 0;
+  for (int64_t i = 0; i < 3; ++i) {
+    std::string data;
+    for (int64_t j = 0; j < 50000; ++j) {
+      data += R"({"i": )" + std::to_string(expect++) + "}";
+      if (j < 49999) data += "\n";  // No trailing newline
+    }
+    contents.push_back(std::move(data));
+  }
+  std::vector<std::string> compressed;
+#ifdef MKJSON_HAVE_ZLIB
+  // Two concatenated members make up a valid gzip file.
+  size_t half = contents[0].size() / 2;
+  compressed.push_back(gzip_compress(contents[0].substr(0, half)) +
+                       gzip_compress(contents[0].substr(half)));
+#else
+  compressed.push_back(contents[0]);
+#endif
+  compressed.push_back(contents[1]);  // Uncompressed
+#ifdef MKJSON_HAVE_ZSTD
+  compressed.push_back(zstd_compress(contents[2]));
+#else
+  compressed.push_back(gzip_compress(contents[2]));
+#endif
+  for (size_t i = 0; i < compressed.size(); ++i) {
+    std::string path = "unit-tests-decompress-" + std::to_string(i);
+    write_file(path.c_str(), compressed[i]);
+    paths.push_back(std::move(path));
+  }
+
+  SECTION("when reading many files") {
+    JSONLReader reader{paths};
+    int64_t count = 0;
+    bool ordered = true;
+    Result<JSON> result;
+    while ((result = reader.read_next()).good) {
+      ordered = ordered && result.value.get_value_at("i").value.get_value_int64().value == count;
+      count += 1;
+    }
+    REQUIRE(ordered);
+    REQUIRE(count == expect);
+    REQUIRE(result.failure == "End of file");
+  }
+
+  SECTION("when reading from a file descriptor") {
+    std::FILE *filep = std::fopen(paths[0].c_str(), "rb");
+    REQUIRE(filep != nullptr);
+    {
+      JSONLReader reader{fileno(filep)};
+      int64_t count = 0;
+      while (reader.read_next().good) {
+        count += 1;
+      }
+      REQUIRE(count == 50000);
+    }
+    std::fclose(filep);
+  }
+
+  SECTION("when the compressed data is truncated") {
+    std::string truncated = compressed[2].substr(0, compressed[2].size() - 8);
+    write_file(paths[2].c_str(), truncated);
+    JSONLReader reader{paths};
+    while (!reader.eof()) {
+      (void)reader.read_next();
+    }
+    Result<JSON> result = reader.read_next();
+    REQUIRE(!result.good);
+    REQUIRE(result.failure == "Cannot read input");
+  }
+
+  for (const std::string &path : paths) {
+    (void)std::remove(path.c_str());
+  }
+}
+
+TEST_CASE("parse_fd transparently decompresses its input") {
+  const char *path = "unit-tests-decompress.json";
+#ifdef MKJSON_HAVE_ZLIB
+  write_file(path, gzip_compress(R"({"success": true})"));
+#else
+  write_file(path, zstd_compress(R"({"success": true})"));
+#endif
+  std::FILE *filep = std::fopen(path, "rb");
+  REQUIRE(filep != nullptr);
+  Result<JSON> result = JSON::parse_fd(fileno(filep));
+  std::fclose(filep);
+  REQUIRE(result.good);
+  REQUIRE(result.value.is_object());
+  (void)std::remove(path);
+}
+
+// ByteReader is a ChunkReader returning its streams one byte at a time,
+// like reading from a pipe may do in the worst case.
+class ByteReader : public ChunkReader {
+ public:
+  explicit ByteReader(std::vector<std::string> s) : streams{std::move(s)} {}
+
+  bool next(Chunk &chunk) noexcept override {
+    while (stream < streams.size() && offset >= streams[stream].size()) {
+      stream += 1;
+      offset = 0;
+    }
+    if (stream >= streams.size()) return false;
+    chunk.data = streams[stream].data() + offset++;
+    chunk.size = 1;
+    chunk.stream = stream;
+    return true;
+  }
+
+  bool failed() const noexcept override { return false; }
+
+  std::vector<std::string> streams;
+  size_t stream = 0;
+  size_t offset = 0;
+};
+
+TEST_CASE("DecompressReader detects the format across short chunks") {
+  std::vector<std::string> contents = {"{\"a\": 1}\n", "1\n", "2", "{\"b\": 2}\n"};
+  std::vector<std::string> streams = contents;
+#ifdef MKJSON_HAVE_ZLIB
+  streams[0] = gzip_compress(contents[0]);
+#endif
+#ifdef MKJSON_HAVE_ZSTD
+  streams[3] = zstd_compress(contents[3]);
+#else
+  streams[3] = gzip_compress(contents[3]);
+#endif
+  DecompressReader reader{std::unique_ptr<ChunkReader>{new ByteReader{streams}}};
+  std::vector<std::string> output(contents.size());
+  Chunk chunk;
+  while (reader.next(chunk)) {
+    REQUIRE(chunk.stream < output.size());
+    output[chunk.stream].append(chunk.data, chunk.size);
+  }
+  REQUIRE(!reader.failed());
+  REQUIRE(output == contents);
+}
+#endif
+
+// roundtrip_jsonl writes documents with @p compression and reads them back.
+static void roundtrip_jsonl(Compression compression) {
+  const char *path = "unit-tests-jsonl-writer.jsonl";
+  std::FILE *filep = std::fopen(path, "wb");
+  REQUIRE(filep != nullptr);
+  {
+    JSONLWriter writer{fileno(filep), compression};
+    bool written = true;
+    for (int64_t i = 0; i < 100000; ++i) {
+      JSON json;
+      json.set_value_int64(i);
+      written = written && writer.write(json).good;
+    }
+    REQUIRE(written);
+    REQUIRE(writer.close().good);
+    JSON json;
+    REQUIRE(!writer.write(json).good);
+  }
+  std::fclose(filep);
+  filep = std::fopen(path, "rb");
+  REQUIRE(filep != nullptr);
+  {
+    JSONLReader reader{fileno(filep)};
+    int64_t count = 0;
+    bool ordered = true;
+    Result<JSON> result;
+    while ((result = reader.read_next()).good) {
+      ordered = ordered && result.value.get_value_int64().value == count;
+      count += 1;
+    }
+    REQUIRE(ordered);
+    REQUIRE(count == 100000);
+    REQUIRE(result.failure == "End of file");
+  }
+  std::fclose(filep);
+  (void)std::remove(path);
+}
+
+TEST_CASE("parse handles duplicate keys as expected") {
+  const std::string input =
+      R"({"a": 1, "b": {"c": [1], "c": {"d": 2}}, "a": [3], "a": "4"})";
+  ParseOptions options;
+
+  SECTION("by default") {
+    Result<JSON> doc = JSON::parse(input);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value == R"({"a":"4","b":{"c":{"d":2}}})");
+  }
+
+  SECTION("with last_wins") {
+    options.duplicate_keys = DuplicateKeys::last_wins;
+    Result<JSON> doc = JSON::parse(input, options);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value == R"({"a":"4","b":{"c":{"d":2}}})");
+  }
+
+  SECTION("with first_wins") {
+    options.duplicate_keys = DuplicateKeys::first_wins;
+    Result<JSON> doc = JSON::parse(input, options);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value == R"({"a":1,"b":{"c":[1]}})");
+    doc = JSON::parse(R"({"a":1,"a":{"x":1,"x":2,"y":3},"b":[{"c":1,"c":2}]})",
+                      options);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value == R"({"a":1,"b":[{"c":1}]})");
+  }
+
+  SECTION("with reject") {
+    options.duplicate_keys = DuplicateKeys::reject;
+    Result<JSON> doc = JSON::parse(input, options);
+    REQUIRE(!doc.good);
+    REQUIRE(doc.failure.size() > 0);
+    REQUIRE(doc.value.is_null());
+    std::clog << doc.failure << std::endl;
+    REQUIRE(JSON::parse(R"({"a": {"a": 1}, "b": [{"a": 2}]})", options).good);
+  }
+
+  SECTION("with collect") {
+    options.duplicate_keys = DuplicateKeys::collect;
+    Result<JSON> doc = JSON::parse(input, options);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value ==
+            R"({"a":[1,[3],"4"],"b":{"c":[[1],{"d":2}]}})");
+    doc = JSON::parse(R"({"a":1,"b":{"a":1,"a":2},"a":2,"c":[{"a":1,"a":2}],"a":3})",
+                      options);
+    REQUIRE(doc.good);
+    REQUIRE(doc.value.dump().value ==
+            R"({"a":[1,2,3],"b":{"a":[1,2]},"c":[{"a":[1,2]}]})");
+  }
+
+  SECTION("with JSONLReader") {
+    const char *path = "unit-tests-duplicate-keys.jsonl";
+    write_file(path, "{\"a\": 1}\n{\"a\": 1, \"a\": 2}\n");
+    options.duplicate_keys = DuplicateKeys::reject;
+    JSONLReader reader{std::vector<std::string>{path}, options};
+    REQUIRE(reader.read_next().good);
+    REQUIRE(!reader.read_next().good);
+    REQUIRE(!reader.read_next().good);
+    REQUIRE(reader.eof());
+    (void)std::remove(path);
+  }
+}
+
+TEST_CASE("parse reports where parsing failed") {
+  ParseOptions options;
+  ParseError error;
+
+  SECTION("for a syntax error") {
+    std::string input = "{\n  \"results\": [\n    {\"rtt\": 1},\n    {\"rtt\": x}\n  ]\n}";
+    Result<JSON> doc = JSON::parse(input, options, error);
+    REQUIRE(!doc.good);
+    REQUIRE(error.offset == input.find('x'));
+    REQUIRE(error.pointer == "/results/1/rtt");
+    REQUIRE(error.context.find('x') != std::string::npos);
+    REQUIRE(error.context.size() <= 32);
+    REQUIRE(error.line(input) == 4);
+    REQUIRE(error.column(input) == 13);
+  }
+
+  SECTION("for escaped keys and truncated input") {
+    std::string input = R"({"a/b": {"c~d": [1, 2, )";
+    Result<JSON> doc = JSON::parse(input, options, error);
+    REQUIRE(!doc.good);
+    REQUIRE(error.offset == input.size());
+    REQUIRE(error.pointer == "/a~1b/c~0d/2");
+    REQUIRE(error.line(input) == 1);
+    REQUIRE(error.column(input) == input.size() + 1);
+  }
+
+  SECTION("for a rejected duplicate key") {
+    options.duplicate_keys = DuplicateKeys::reject;
+    std::string input = R"({"a": {"b": 1, "b": 2}})";
+    Result<JSON> doc = JSON::parse(input, options, error);
+    REQUIRE(!doc.good);
+    REQUIRE(error.offset == input.rfind(R"("b")") + 2);
+    REQUIRE(error.pointer == "/a/b");
+    REQUIRE(error.context.find(R"("b": 1, "b")") != std::string::npos);
+    REQUIRE(error.line(input) == 1);
+  }
+
+  SECTION("for a valid input") {
+    error.pointer = "/stale";
+    Result<JSON> doc = JSON::parse(R"({"a": 1})", options, error);
+    REQUIRE(doc.good);
+    REQUIRE(error.offset == ParseError::npos);
+    REQUIRE(error.pointer.empty());
+  }
+
+  SECTION("with JSONLReader") {
+    const char *path = "unit-tests-parse-error.jsonl";
+    write_file(path, "[1, 2]\n{\"a\": [true, nul]}\n");
+    JSONLReader reader{std::vector<std::string>{path}};
+    REQUIRE(reader.read_next(error).good);
+    REQUIRE(!reader.read_next(error).good);
+    REQUIRE(error.offset == 16);
+    REQUIRE(error.pointer == "/a/1");
+    REQUIRE(error.context == R"({"a": [true, nul]})");
+    (void)std::remove(path);
+  }
+}
+
+TEST_CASE("JSONLWriter works as expected") {
+  SECTION("without compression") {
+    roundtrip_jsonl(Compression::none);
+  }
+
+#ifdef MKJSON_HAVE_ZLIB
+  SECTION("with gzip compression") {
+    roundtrip_jsonl(Compression::gzip);
+  }
+#endif
+
+#ifdef MKJSON_HAVE_ZSTD
+  SECTION("with zstd compression") {
+    roundtrip_jsonl(Compression::zstd);
+  }
+#endif
+
+#ifndef MKJSON_HAVE_ZSTD
+  SECTION("with unsupported compression") {
+    JSONLWriter writer{1, Compression::zstd};
+    Result<void> result = writer.write(JSON{});
+    REQUIRE(!result.good);
+    REQUIRE(result.failure.size() > 0);
+    std::clog << result.failure << std::endl;
+  }
+#endif
+
+  SECTION("for an invalid JSON") {
+    const char *path = "unit-tests-jsonl-writer.jsonl";
+    std::FILE *filep = std::fopen(path, "wb");
+    REQUIRE(filep != nullptr);
+    {
+      JSONLWriter writer{fileno(filep), Compression::none};
+      JSON json;
+      Value &inner = JSON::Friend::unwrap(json);
+      inner = std::string{(char *)binary_input, sizeof(binary_input)};
+      Result<void> result = writer.write(json);
+      REQUIRE(!result.good);
+      REQUIRE(result.failure.size() > 0);
+      std::clog << result.failure << std::endl;
+      REQUIRE(!writer.write(JSON{}).good);
+    }
+    std::fclose(filep);
+    (void)std::remove(path);
+  }
+}
+
+TEST_CASE("dump_fd works as expected") {
+  const char *path = "unit-tests-dump-fd.json";
+  Result<JSON> doc = JSON::parse(R"({"array": [1, 2, 3], "success": true})");
+  REQUIRE(doc.good);
+#ifdef MKJSON_HAVE_ZLIB
+  Compression compression = Compression::gzip;
+#else
+  Compression compression = Compression::none;
+#endif
+  std::FILE *filep = std::fopen(path, "wb");
+  REQUIRE(filep != nullptr);
+  Result<void> result = doc.value.dump_fd(fileno(filep), compression);
+  std::fclose(filep);
+  REQUIRE(result.good);
+  filep = std::fopen(path, "rb");
+  REQUIRE(filep != nullptr);
+  Result<JSON> other = JSON::parse_fd(fileno(filep));
+  std::fclose(filep);
+  REQUIRE(other.good);
+  REQUIRE(other.value.dump().value == doc.value.dump().value);
+  (void)std::remove(path);
+}